@@ -60,86 +60,81 @@ static int resampleLengthNeeded(int src_srate, int dest_srate, int dest_len, dou
 
 }
 
-static void mixFloatsNIOutput(float *src, int src_srate, int src_nch,  // lengths are sample pairs. input is interleaved samples, output not
-                            float **dest, int dest_srate, int dest_nch, 
-                            int dest_len, float vol, float pan, double *state)
+// left/right gains for a volume and pan, as used by mixFloatsNIOutput()
+static void mixFloatsPanGains(float vol, float pan, double *vol1, double *vol2)
 {
-  // fucko: better resampling, this is shite
-  int x;
   if (pan < -1.0f) pan=-1.0f;
   else if (pan > 1.0f) pan=1.0f;
   if (vol > 4.0f) vol=4.0f;
   if (vol < 0.0f) vol=0.0f;
 
-  if (!src_srate) src_srate=48000;
-  if (!dest_srate) dest_srate=48000;
+  *vol1=*vol2=vol;
+  if (pan < 0.0f)  *vol2 *= 1.0f+pan;
+  else if (pan > 0.0f) *vol1 *= 1.0f-pan;
+}
 
-  double vol1=vol,vol2=vol;
-  float *dest1=dest[0];
-  float *dest2=NULL;
-  if (dest_nch > 1)
+// Adds one channel to dest with gain vol, resampling with linear
+// interpolation when drspos != 1.0. Returns the resampling position after
+// dest_len samples.
+static double mixFloatsChannel(const float *src, float *dest, int dest_len,
+                               double vol, double rspos, double drspos)
+{
+  int x;
+  if (drspos == 1.0)
   {
-    dest2=dest[1];
-    if (pan < 0.0f)  vol2 *= 1.0f+pan;
-    else if (pan > 0.0f) vol1 *= 1.0f-pan;
+    for (x = 0; x < dest_len; x ++)
+    {
+      double s=src[x]*vol;
+      if (s > 1.0) s=1.0;
+      else if (s<-1.0) s=-1.0;
+      dest[x] += (float) s;
+    }
+    return rspos;
   }
-  
-
-  double rspos=*state;
-  double drspos = 1.0;
-  if (src_srate != dest_srate) drspos=(double)src_srate/(double)dest_srate;
 
   for (x = 0; x < dest_len; x ++)
   {
-    double ls,rs;
-    if (src_srate != dest_srate)
-    {
-      int ipos = (int)rspos;
-      double fracpos=rspos-ipos; 
-      if (src_nch == 2)
-      {
-        ipos+=ipos;
-        ls=src[ipos]*(1.0-fracpos) + src[ipos+2]*fracpos;
-        rs=src[ipos+1]*(1.0-fracpos) + src[ipos+3]*fracpos;
-      }
-      else 
-      {
-        rs=ls=src[ipos]*(1.0-fracpos) + src[ipos+1]*fracpos;
-      }
-      rspos+=drspos;
-
-    }
-    else
-    {
-      if (src_nch == 2)
-      {
-        int t=x+x;
-        ls=src[t];
-        rs=src[t+1];
-      }
-      else
-      {
-        rs=ls=src[x];
-      }
-    }
+    int ipos = (int)rspos;
+    double fracpos=rspos-ipos;
+    double s=(src[ipos]*(1.0-fracpos) + src[ipos+1]*fracpos)*vol;
+    if (s > 1.0) s=1.0;
+    else if (s<-1.0) s=-1.0;
+    dest[x] += (float) s;
+    rspos+=drspos;
+  }
+  return rspos;
+}
 
-    ls *= vol1;
-    if (ls > 1.0) ls=1.0;
-    else if (ls<-1.0) ls=-1.0;
+// same as mixFloatsNIOutput() but with precomputed gains. vol1 is used for
+// mono output.
+static void mixFloatsNIOutputGains(float **src, int src_srate, int src_nch,  // lengths are sample pairs. input and output are not interleaved
+                            float **dest, int dest_srate, int dest_nch, 
+                            int dest_len, double vol1, double vol2, double *state)
+{
+  // fucko: better resampling, this is shite
+  if (!src_srate) src_srate=48000;
+  if (!dest_srate) dest_srate=48000;
 
-    *dest1++ +=(float) ls;
+  double drspos = 1.0;
+  if (src_srate != dest_srate) drspos=(double)src_srate/(double)dest_srate;
 
-    if (dest_nch > 1)
-    {
-      rs *= vol2;
-      if (rs > 1.0) rs=1.0;
-      else if (rs<-1.0) rs=-1.0;
+  // a mono source goes to both sides, extra source channels are ignored
+  double rspos=mixFloatsChannel(src[0],dest[0],dest_len,vol1,*state,drspos);
+  if (dest_nch > 1)
+    mixFloatsChannel(src[src_nch > 1 ? 1 : 0],dest[1],dest_len,vol2,*state,drspos);
 
-      *dest2++ += (float) rs;
-    }
-  }
   *state = rspos - (int)rspos;
 }
 
+static void mixFloatsNIOutput(float **src, int src_srate, int src_nch,  // lengths are sample pairs. input and output are not interleaved
+                            float **dest, int dest_srate, int dest_nch, 
+                            int dest_len, float vol, float pan, double *state)
+{
+  double vol1,vol2;
+  mixFloatsPanGains(vol, dest_nch > 1 ? pan : 0.0f, &vol1, &vol2);
+  mixFloatsNIOutputGains(src, src_srate, src_nch, dest, dest_srate, dest_nch,
+                         dest_len, vol1, vol2, state);
+}
+
 
 #endif //_PCMFMTCVT_H_
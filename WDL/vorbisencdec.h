@@ -53,14 +53,14 @@
 
 #include "vorbis/vorbisenc.h"
 #include "vorbis/codec.h"
-#include "../WDL/queue.h"
+#include "../common/njcodec.h"
 
-class VorbisDecoder
+class VorbisDecoder : public I_NJDecoder
 {
   public:
     VorbisDecoder()
     {
-      m_samples_used=0;
+      m_hdr_match=-1;
     	packets=0;
 	    memset(&oy,0,sizeof(oy));
 	    memset(&os,0,sizeof(os));
@@ -86,12 +86,10 @@ class VorbisDecoder
   	  ogg_sync_clear(&oy);
     }
 
+    unsigned int GetFourcc() { return NJ_VORBIS_FOURCC; }
     int GetSampleRate() { return vi.rate; }
     int GetNumChannels() { return vi.channels?vi.channels:1; }
 
-    WDL_HeapBuf m_samples; // we let the size get as big as it needs to, so we don't worry about tons of mallocs/etc
-    int m_samples_used;
-
     void *DecodeGetSrcBuffer(int srclen)
     {
 		  return ogg_sync_buffer(&oy,srclen);
@@ -99,89 +97,153 @@ class VorbisDecoder
 
     void DecodeWrote(int srclen)
     {
-      ogg_sync_wrote(&oy,srclen);
-  
-		  while(ogg_sync_pageout(&oy,&og)>0)
-		  {
-			  int serial=ogg_page_serialno(&og);
-			  if (!packets) ogg_stream_init(&os,serial);
-			  else if (serial!=os.serialno)
-			  {
-				  vorbis_block_clear(&vb);
-				  vorbis_dsp_clear(&vd);
-				  vorbis_comment_clear(&vc);
-				  vorbis_info_clear(&vi);
+      if (srclen > 0) ogg_sync_wrote(&oy,srclen);
 
-				  ogg_stream_clear(&os);
-				  ogg_stream_init(&os,serial);
-				  packets=0;
-			  }
-			  if (!packets)
-			  {
-				  vorbis_info_init(&vi);
-				  vorbis_comment_init(&vc);
-			  }
-			  ogg_stream_pagein(&os,&og);
-			  while(ogg_stream_packetout(&os,&op)>0)
-			  {
+      for (;;)
+      {
+        if (!DecodeFlushPCM()) return; // ring buffer full
+
+        if (!ogg_stream_check(&os) && ogg_stream_packetout(&os,&op)>0)
+        {
 				  if (packets<3)
 				  {
-					  if(vorbis_synthesis_headerin(&vi,&vc,&op)<0) return;
+            // headers identical to the last stream's keep its setup
+            if (m_hdr_match == packets && HeaderMatches(packets,&op)) m_hdr_match++;
+            else
+            {
+              if (m_hdr_match >= 0) ReparseHeaders(packets);
+					    if(vorbis_synthesis_headerin(&vi,&vc,&op)<0) return;
+              m_hdr[packets].Resize(op.bytes,false);
+              memcpy(m_hdr[packets].Get(),op.packet,op.bytes);
+            }
 				  }
 				  else
 				  {
-					  float ** pcm;
-					  int samples;
 					  if(vorbis_synthesis(&vb,&op)==0) vorbis_synthesis_blockin(&vd,&vb);
-					  while((samples=vorbis_synthesis_pcmout(&vd,&pcm))>0)
-					  {
-						  int n,c;
-
-              int newsize=(m_samples_used+(samples+4096)*vi.channels)*sizeof(float);
-
-              if (m_samples.GetSize() < newsize) m_samples.Resize(newsize+32768);
-
-              float *bufmem = (float *)m_samples.Get();
-
-						  for(n=0;n<samples;n++)
-						  {
-							  for(c=0;c<vi.channels;c++)
-							  {
-								  bufmem[m_samples_used++]=pcm[c][n];
-							  }							
-						  }
-						  vorbis_synthesis_read(&vd,samples);
-					  }
 				  }
 				  packets++;
 				  if (packets==3)
 				  {
-					  vorbis_synthesis_init(&vd,&vi);
-					  vorbis_block_init(&vd,&vb);
+            if (m_hdr_match != 3)
+            {
+					    vorbis_synthesis_init(&vd,&vi);
+					    vorbis_block_init(&vd,&vb);
+            }
+            m_hdr_match=-1;
+            AllocSamples(GetNumChannels(),vi.rate,vorbis_info_blocksize(&vi,1));
 				  }
+          continue;
+        }
+
+		    if (ogg_sync_pageout(&oy,&og)<=0) return;
+
+			  int serial=ogg_page_serialno(&og);
+			  if (!packets)
+			  {
+          if (ogg_stream_check(&os)) ogg_stream_init(&os,serial);
+          else if (serial!=os.serialno) ogg_stream_reset_serialno(&os,serial);
+			  }
+			  else if (serial!=os.serialno)
+			  {
+				  ClearSetup();
+				  ogg_stream_reset_serialno(&os,serial);
+				  packets=0;
+			  }
+			  if (!packets && m_hdr_match < 0)
+			  {
+				  vorbis_info_init(&vi);
+				  vorbis_comment_init(&vc);
 			  }
+			  ogg_stream_pagein(&os,&og);
 		  }
     }
 
+    // Get ready for a new stream. The sample buffer is kept, and so is the
+    // parsed setup as long as the new stream's headers are the same.
     void Reset()
     {
-      m_samples_used=0;
+      ResetSamples();
+
+      ogg_sync_reset(&oy);
+      if (!ogg_stream_check(&os)) ogg_stream_reset(&os);
+
+      if (packets >= 3)
+      {
+        vorbis_synthesis_restart(&vd);
+        m_hdr_match=0;
+      }
+      else
+      {
+        ClearSetup();
+      }
+			packets=0;
+    }
+
+  private:
 
+    void ClearSetup()
+    {
 			vorbis_block_clear(&vb);
 			vorbis_dsp_clear(&vd);
 			vorbis_comment_clear(&vc);
 			vorbis_info_clear(&vi);
+      m_hdr_match=-1;
+    }
 
-			ogg_stream_clear(&os);
-			packets=0;
+    bool HeaderMatches(int idx, ogg_packet *p)
+    {
+      return m_hdr[idx].GetSize() == p->bytes &&
+             !memcmp(m_hdr[idx].Get(),p->packet,p->bytes);
     }
 
-  private:
+    // The new stream's headers turned out to be different after the first
+    // nhdr, which matched and were skipped. Parse those again from scratch.
+    void ReparseHeaders(int nhdr)
+    {
+      ClearSetup();
+      vorbis_info_init(&vi);
+      vorbis_comment_init(&vc);
 
+      int x;
+      for (x = 0; x < nhdr; x ++)
+      {
+        ogg_packet hp;
+        memset(&hp,0,sizeof(hp));
+        hp.packet=(unsigned char *)m_hdr[x].Get();
+        hp.bytes=m_hdr[x].GetSize();
+        hp.b_o_s=!x;
+        hp.packetno=x;
+        vorbis_synthesis_headerin(&vi,&vc,&hp);
+      }
+    }
+
+    // Move decoded PCM into the ring buffer, returns false if some is left
+    // over because the ring buffer is full
+    bool DecodeFlushPCM()
+    {
+      if (packets<3) return true;
+
+      float **pcm;
+      int samples;
+      while((samples=vorbis_synthesis_pcmout(&vd,&pcm))>0)
+      {
+        int nch=vi.channels;
+        int avail=SamplesFree();
+        if (avail <= 0) return false;
+        if (samples > avail) samples=avail;
+
+        WriteSamples(pcm,NULL,nch,samples);
+        vorbis_synthesis_read(&vd,samples);
+      }
+      return true;
+    }
 
     int m_err;
     int packets;
 
+    WDL_HeapBuf m_hdr[3]; // header packets of the last stream
+    int m_hdr_match; // headers of the new stream seen so far that match, -1 if not reusing
+
     ogg_sync_state   oy; /* sync and verify incoming physical bitstream */
     ogg_stream_state os; /* take physical pages, weld into a logical
 			    stream of packets */
@@ -197,17 +259,20 @@ class VorbisDecoder
 };
 
 
-class VorbisEncoder
+class VorbisEncoder : public I_NJEncoder
 {
 public:
   VorbisEncoder(int srate, int nch, int bitrate, int serno)
   {
     m_ds=0;
+    m_cur=0;
+    m_next_ready=false;
+    m_header_npages=0;
 
     memset(&vi,0,sizeof(vi));
     memset(&vc,0,sizeof(vc));
-    memset(&vd,0,sizeof(vd));
-    memset(&vb,0,sizeof(vb));
+    memset(m_vd,0,sizeof(m_vd));
+    memset(m_vb,0,sizeof(m_vb));
 
     m_nch=nch;
     vorbis_info_init(&vi);
@@ -242,37 +307,18 @@ public:
     m_err=vorbis_encode_init_vbr(&vi,nch,srate>>m_ds,qv);
 
     vorbis_comment_init(&vc);
-    vorbis_analysis_init(&vd,&vi);
-    vorbis_block_init(&vd,&vb);
+    vorbis_analysis_init(&m_vd[0],&vi);
+    vorbis_block_init(&m_vd[0],&m_vb[0]);
     ogg_stream_init(&os,m_ser=serno);
 
     if (m_err) return;
 
-
-    reinit(1);
-  }
-
-  void reinit(int bla=0)
-  {
-    if (!bla)
-    {
-      ogg_stream_clear(&os);
-      vorbis_block_clear(&vb);
-      vorbis_dsp_clear(&vd);
-
-      vorbis_analysis_init(&vd,&vi);
-      vorbis_block_init(&vd,&vb);
-      ogg_stream_init(&os,m_ser++); //++?
- 
-      outqueue.Advance(outqueue.Available());
-      outqueue.Compact();
-    }
-
-
+    // The headers only depend on the settings, so every stream starts with
+    // the same pages
     ogg_packet header;
     ogg_packet header_comm;
     ogg_packet header_code;
-    vorbis_analysis_headerout(&vd,&vc,&header,&header_comm,&header_code);
+    vorbis_analysis_headerout(&m_vd[0],&vc,&header,&header_comm,&header_code);
     ogg_stream_packetin(&os,&header); /* automatically placed in its own page */
     ogg_stream_packetin(&os,&header_comm);
     ogg_stream_packetin(&os,&header_code);
@@ -282,25 +328,65 @@ public:
       ogg_page og;
 		  int result=ogg_stream_flush(&os,&og);
 		  if(result==0)break;
-      outqueue.Add(og.header,og.header_len);
-		  outqueue.Add(og.body,og.body_len);
+      m_header_pages.Add(og.header,og.header_len);
+		  m_header_pages.Add(og.body,og.body_len);
+      m_header_npages++;
 	  }
+    outqueue.Add(m_header_pages.Get(),m_header_pages.GetSize());
+  }
+
+  // Start a new stream after Encode(NULL,0) ended the last one. libvorbis
+  // cannot restart the analysis state, so it switches to the one that
+  // PrepareNext() built (or builds it now if that was not called).
+  void reinit()
+  {
+    if (m_err) return;
+
+    PrepareNext();
+    m_cur=!m_cur;
+    m_next_ready=false;
+
+    // Same serial number and buffers, continuing after the cached headers
+    ogg_stream_reset(&os);
+    os.pageno=m_header_npages;
+    os.b_o_s=1;
+
+    outqueue.Advance(outqueue.Available());
+    outqueue.Compact();
+    outqueue.Add(m_header_pages.Get(),m_header_pages.GetSize());
+  }
+
+  // Build the analysis state for the next stream ahead of time, so reinit()
+  // is cheap. Call when the encoder has time to spare.
+  void PrepareNext()
+  {
+    if (m_err || m_next_ready) return;
+
+    int n=!m_cur;
+    vorbis_block_clear(&m_vb[n]);
+    vorbis_dsp_clear(&m_vd[n]);
+    vorbis_analysis_init(&m_vd[n],&vi);
+    vorbis_block_init(&m_vd[n],&m_vb[n]);
+    m_next_ready=true;
   }
 
   void Encode(float *in, int inlen, int advance=1, int spacing=1) // length in sample (PAIRS)
   {
     if (m_err) return;
 
+    vorbis_dsp_state *vd=&m_vd[m_cur];
+    vorbis_block *vb=&m_vb[m_cur];
+
     if (inlen == 0)
     {
       // disable this for now, it fucks us sometimes
       // maybe we should throw some silence in instead?
-        vorbis_analysis_wrote(&vd,0);
+        vorbis_analysis_wrote(vd,0);
     }
     else
     {
       inlen >>= m_ds;
-      float **buffer=vorbis_analysis_buffer(&vd,inlen);
+      float **buffer=vorbis_analysis_buffer(vd,inlen);
       int i,i2=0;
       for (i = 0; i < inlen; i ++)
       {
@@ -308,17 +394,17 @@ public:
         if (m_nch==2) buffer[1][i]=in[i2+spacing];
         i2+=advance<<m_ds;
       }
-      vorbis_analysis_wrote(&vd,i);
+      vorbis_analysis_wrote(vd,i);
     }
 
     int eos=0;
-    while(vorbis_analysis_blockout(&vd,&vb)==1)
+    while(vorbis_analysis_blockout(vd,vb)==1)
     {
-      vorbis_analysis(&vb,NULL);
-      vorbis_bitrate_addblock(&vb);
+      vorbis_analysis(vb,NULL);
+      vorbis_bitrate_addblock(vb);
       ogg_packet       op;
 
-      while(vorbis_bitrate_flushpacket(&vd,&op))
+      while(vorbis_bitrate_flushpacket(vd,&op))
       {
 	
       	ogg_stream_packetin(&os,&op);
@@ -336,31 +422,39 @@ public:
     }
   }
 
+  unsigned int GetFourcc() { return NJ_VORBIS_FOURCC; }
   int isError() { return m_err; }
 
 
   ~VorbisEncoder()
   {
     ogg_stream_clear(&os);
-    vorbis_block_clear(&vb);
-    vorbis_dsp_clear(&vd);
+    int x;
+    for (x = 0; x < 2; x ++)
+    {
+      vorbis_block_clear(&m_vb[x]);
+      vorbis_dsp_clear(&m_vd[x]);
+    }
     vorbis_comment_clear(&vc);
     if (!m_err) vorbis_info_clear(&vi);
   }
 
-  WDL_Queue outqueue;
-
 private:
   int m_err,m_nch;
 
   ogg_stream_state os;
   vorbis_info      vi;
   vorbis_comment   vc;
-  vorbis_dsp_state vd;
-  vorbis_block     vb;
+  vorbis_dsp_state m_vd[2]; // current stream's and the next one's
+  vorbis_block     m_vb[2];
+  int m_cur;
+  bool m_next_ready;
   int m_ser;
   int m_ds;
 
+  WDL_Queue m_header_pages;
+  int m_header_npages;
+
 };
 
 
@@ -34,6 +34,8 @@
 #include <libresample.h>
 
 #include "../WDL/vorbisencdec.h"
+#include "../common/opusencdec.h"
+#include "../common/flacencdec.h"
 
 /* Output audio parameters */
 #define SAMPLE_RATE 44100 /* Hz */
@@ -264,13 +266,14 @@ public:
 #define DIRCHAR '/'
 #define DIRCHAR_S "/"
 
-bool resolveFile(const char *name, std::string &outpath, const char *path)
+bool resolveFile(const char *name, std::string &outpath, unsigned int *fourcc, const char *path)
 {
   const char *p=name;
   while (*p && *p == '0') p++;
   if (!*p) return false;
 
-  const char *exts[] = {".ogg", ".OGG"};
+  const char *exts[] = {".ogg", ".OGG", ".opu", ".OPU", ".fla", ".FLA"};
+  const unsigned int fourccs[] = {NJ_VORBIS_FOURCC, NJ_VORBIS_FOURCC, NJ_OPUS_FOURCC, NJ_OPUS_FOURCC, NJ_FLAC_FOURCC, NJ_FLAC_FOURCC};
   std::string fnfind;
   size_t x;
   for (x = 0; x < sizeof(exts)/sizeof(exts[0]); x ++)
@@ -301,6 +304,7 @@ bool resolveFile(const char *name, std::string &outpath, const char *path)
       if (l) 
       {
         outpath = fnfind;
+        *fourcc = fourccs[x];
         return true;
       }
     }
@@ -340,23 +344,34 @@ static void fillSilence(FILE *outfile, VorbisEncoder *encoder, double msecs)
   fillSilenceSamples(outfile, encoder, msecs * SAMPLE_RATE / 1000.0);
 }
 
-static void transcode(FILE *infile, FILE *outfile, void **resampleState, VorbisEncoder *encoder, double msecs)
+static void transcode(FILE *infile, unsigned int fourcc, FILE *outfile, void **resampleState, VorbisEncoder *encoder, double msecs)
 {
   uint64_t framesRemaining = msecs * SAMPLE_RATE / 1000.0;
-  VorbisDecoder decoder;
+  VorbisDecoder vorbisDecoder;
+  OggOpusDecoder opusDecoder;
+  FlacDecoder flacDecoder;
+  I_NJDecoder &decoder = fourcc == NJ_OPUS_FOURCC ? (I_NJDecoder&)opusDecoder :
+                         fourcc == NJ_FLAC_FOURCC ? (I_NJDecoder&)flacDecoder :
+                         (I_NJDecoder&)vorbisDecoder;
   bool drainResampler = false;
 
   while (framesRemaining) {
-    while (decoder.m_samples_used < 1024 * NCHANNELS) {
+    while (decoder.DecodeGetAvailable() < 1024) {
       size_t nread = fread(decoder.DecodeGetSrcBuffer(4096), 1, 4096, infile);
-      if (nread == 0 && decoder.m_samples_used == 0) {
+
+      /* Also decodes data that did not fit into the sample buffer last time */
+      decoder.DecodeWrote(nread);
+
+      /* End of file, decode what the codec may have held back */
+      if (nread < 4096) {
+        decoder.DecodeEnd();
+      }
+
+      if (nread == 0 && decoder.DecodeGetAvailable() == 0) {
         /* Silence left-over frames and then finish */
         fillSilenceSamples(outfile, encoder, framesRemaining);
         return;
       }
-      if (nread > 0) {
-        decoder.DecodeWrote(nread);
-      }
       if (nread < 4096) {
         drainResampler = true;
         break;
@@ -364,18 +379,34 @@ static void transcode(FILE *infile, FILE *outfile, void **resampleState, VorbisE
     }
 
     /* If no samples were decoded, then something is wrong */
-    if (decoder.m_samples_used == 0) {
+    if (decoder.DecodeGetAvailable() == 0) {
       fillSilenceSamples(outfile, encoder, framesRemaining);
       break;
     }
 
-    int nframes = decoder.m_samples_used / decoder.GetNumChannels();
-    AudioBuffer abuf((float*)decoder.m_samples.Get(), nframes, decoder.GetNumChannels(), true);
-    decoder.m_samples_used = 0;
+    /* Copy out of the decoder's sample buffer so it can be refilled */
+    float *samples[NJ_DECODER_MAX_CHANNELS];
+    int nframes = decoder.DecodePeek(samples);
+    int nch = decoder.GetNumChannels() > 1 ? 2 : 1;
+    AudioBuffer abuf(nframes, nch, false);
+    for (int c = 0; c < nch; c++) {
+      memcpy(abuf.getSamples() + c * nframes, samples[c], nframes * sizeof(float));
+    }
+    decoder.DecodeAdvance(nframes);
+
+    /* Only drain the resampler after the final samples */
+    if (drainResampler) {
+      decoder.DecodeWrote(0);
+      if (decoder.DecodeGetAvailable() > 0) {
+        drainResampler = false;
+      }
+    }
+
     if (NCHANNELS == 1) {
       abuf.setMono();
     } else {
       abuf.setStereo();
+      abuf.setInterleaved(true); /* for the encoder */
     }
     if (decoder.GetSampleRate() != SAMPLE_RATE) {
       double factor = (double)SAMPLE_RATE / decoder.GetSampleRate();
@@ -438,7 +469,8 @@ void WriteOutTrack(const char *chname, UserChannelList *list, int *track_id, con
     }
 
     std::string infilename;
-    if (!resolveFile(rec->guidstr.c_str(), infilename, path)) {
+    unsigned int fourcc;
+    if (!resolveFile(rec->guidstr.c_str(), infilename, &fourcc, path)) {
       position += rec->length;
       continue; /* skip this interval */
     }
@@ -449,7 +481,7 @@ void WriteOutTrack(const char *chname, UserChannelList *list, int *track_id, con
       goto out;
     }
 
-    transcode(infile, outfile, &resampleState, &encoder, rec->length);
+    transcode(infile, fourcc, outfile, &resampleState, &encoder, rec->length);
     fclose(infile);
     position += rec->length;
   }
@@ -1,7 +1,7 @@
 TEMPLATE = app
 CONFIG += console
 CONFIG += link_pkgconfig
-PKGCONFIG += ogg vorbis vorbisenc
+PKGCONFIG += ogg vorbis vorbisenc opus flac
 
 # On Debian stretch the libresample1-dev pkgconfig file is missing the actual
 # library!  Add it manually...
@@ -0,0 +1,341 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Lossless FLAC encoding and decoding, each interval is a native FLAC stream.
+  Samples are quantized to 24 bits once by the encoder and then survive
+  transmission and archiving bit-exact.  This uses several times the bandwidth
+  of the lossy codecs but very little CPU.
+
+*/
+
+#ifndef _FLACENCDEC_H_
+#define _FLACENCDEC_H_
+
+#include <math.h>
+#include <string.h>
+#include "FLAC/stream_encoder.h"
+#include "FLAC/stream_decoder.h"
+#include "njcodec.h"
+
+#define FLAC_ENC_BITS_PER_SAMPLE 24
+
+class FlacDecoder : public I_NJDecoder
+{
+  public:
+    FlacDecoder()
+    {
+      m_nch=0;
+      m_srate=0;
+      m_pcm_pos=0;
+      m_pcm_len=0;
+      m_pcm_stride=0;
+      m_read_total=0;
+      m_frame_bound=STREAMINFO_BYTES;
+      m_eof=false;
+
+      m_dec=FLAC__stream_decoder_new();
+      if (m_dec &&
+          FLAC__stream_decoder_init_stream(m_dec,ReadCallback,NULL,TellCallback,
+                                           NULL,NULL,WriteCallback,MetadataCallback,
+                                           ErrorCallback,this) != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+      {
+        FLAC__stream_decoder_delete(m_dec);
+        m_dec=0;
+      }
+    }
+    ~FlacDecoder()
+    {
+      if (m_dec)
+      {
+        FLAC__stream_decoder_finish(m_dec);
+        FLAC__stream_decoder_delete(m_dec);
+      }
+    }
+
+    unsigned int GetFourcc() { return NJ_FLAC_FOURCC; }
+    int GetSampleRate() { return m_srate?m_srate:44100; }
+    int GetNumChannels() { return m_nch?m_nch:1; }
+
+    void *DecodeGetSrcBuffer(int srclen)
+    {
+      m_srcbuf.Resize(srclen,false);
+      return m_srcbuf.Get();
+    }
+
+    void DecodeWrote(int srclen)
+    {
+      if (srclen > 0) m_in.Add(m_srcbuf.Get(),srclen);
+      if (!m_dec) return;
+
+      for (;;)
+      {
+        if (!DecodeFlushPCM()) return; // ring buffer full
+
+        FLAC__StreamDecoderState state=FLAC__stream_decoder_get_state(m_dec);
+        if (state == FLAC__STREAM_DECODER_END_OF_STREAM ||
+            state == FLAC__STREAM_DECODER_ABORTED ||
+            state == FLAC__STREAM_DECODER_MEMORY_ALLOCATION_ERROR) return;
+
+        // libFLAC cannot stop in the middle of a frame and resume later, so
+        // only go ahead once the largest possible frame is here
+        if (!m_eof && m_in.Available()+BytesHeld() < m_frame_bound) return;
+
+        if (!FLAC__stream_decoder_process_single(m_dec)) return;
+      }
+    }
+
+    void DecodeEnd()
+    {
+      m_eof=true;
+      DecodeWrote(0);
+    }
+
+    // The sample buffer and the FLAC decoder are kept
+    void Reset()
+    {
+      ResetSamples();
+      m_in.Advance(m_in.Available());
+      m_in.Compact();
+      m_pcm_pos=m_pcm_len=0;
+      m_read_total=0;
+      m_frame_bound=STREAMINFO_BYTES;
+      m_eof=false;
+      if (m_dec) FLAC__stream_decoder_reset(m_dec);
+    }
+
+  private:
+    enum { STREAMINFO_BYTES = 4+4+34 }; // "fLaC" and the first metadata block
+
+    // Bytes passed to libFLAC that it has not decoded yet
+    int BytesHeld()
+    {
+      FLAC__uint64 pos;
+      if (!FLAC__stream_decoder_get_decode_position(m_dec,&pos)) return 0;
+      return (int)(m_read_total-pos);
+    }
+
+    // Returns false while decoded frames don't fit in the ring buffer
+    bool DecodeFlushPCM()
+    {
+      while (m_pcm_pos < m_pcm_len)
+      {
+        int avail=SamplesFree();
+        if (avail <= 0) return false;
+
+        int n=m_pcm_len-m_pcm_pos;
+        if (n > avail) n=avail;
+
+        const float *planar[FLAC__MAX_CHANNELS];
+        int c;
+        for (c=0;c<m_nch;c++)
+          planar[c]=(float *)m_pcm.Get()+c*m_pcm_stride+m_pcm_pos;
+        WriteSamples(planar,NULL,m_nch,n);
+        m_pcm_pos+=n;
+      }
+      return true;
+    }
+
+    static FLAC__StreamDecoderReadStatus ReadCallback(const FLAC__StreamDecoder *dec,
+        FLAC__byte buffer[], size_t *bytes, void *client_data)
+    {
+      FlacDecoder *_this=(FlacDecoder *)client_data;
+      int n=_this->m_in.Available();
+      if (n <= 0)
+      {
+        *bytes=0;
+        return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+      }
+      if ((size_t)n > *bytes) n=(int)*bytes;
+      memcpy(buffer,_this->m_in.Get(),n);
+      _this->m_in.Advance(n);
+      _this->m_in.Compact();
+      _this->m_read_total+=n;
+      *bytes=n;
+      return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+    }
+
+    static FLAC__StreamDecoderTellStatus TellCallback(const FLAC__StreamDecoder *dec,
+        FLAC__uint64 *absolute_byte_offset, void *client_data)
+    {
+      *absolute_byte_offset=((FlacDecoder *)client_data)->m_read_total;
+      return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+    }
+
+    static void MetadataCallback(const FLAC__StreamDecoder *dec,
+        const FLAC__StreamMetadata *metadata, void *client_data)
+    {
+      FlacDecoder *_this=(FlacDecoder *)client_data;
+      if (metadata->type != FLAC__METADATA_TYPE_STREAMINFO) return;
+
+      const FLAC__StreamMetadata_StreamInfo *si=&metadata->data.stream_info;
+      _this->m_nch=si->channels;
+      _this->m_srate=si->sample_rate;
+      _this->m_pcm_stride=si->max_blocksize;
+      _this->m_pcm.Resize(si->max_blocksize*si->channels*sizeof(float),false);
+      _this->AllocSamples(si->channels,si->sample_rate,si->max_blocksize);
+
+      // a verbatim frame with a side channel plus frame and subframe headers
+      if (si->max_framesize) _this->m_frame_bound=si->max_framesize;
+      else _this->m_frame_bound=si->max_blocksize*si->channels*(si->bits_per_sample+1)/8+64;
+    }
+
+    static FLAC__StreamDecoderWriteStatus WriteCallback(const FLAC__StreamDecoder *dec,
+        const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data)
+    {
+      FlacDecoder *_this=(FlacDecoder *)client_data;
+      int nch=_this->m_nch;
+      int len=frame->header.blocksize;
+      if ((int)frame->header.channels != nch || len > _this->m_pcm_stride)
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+      float scale=1.0f/(float)(1<<(frame->header.bits_per_sample-1));
+      int n,c;
+      for(c=0;c<nch;c++)
+      {
+        float *pcm=(float *)_this->m_pcm.Get()+c*_this->m_pcm_stride;
+        const FLAC__int32 *in=buffer[c];
+        for(n=0;n<len;n++) pcm[n]=in[n]*scale;
+      }
+
+      _this->m_pcm_pos=0;
+      _this->m_pcm_len=len;
+      return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+
+    static void ErrorCallback(const FLAC__StreamDecoder *dec,
+        FLAC__StreamDecoderErrorStatus status, void *client_data)
+    {
+      // libFLAC resyncs to the next frame by itself
+    }
+
+    FLAC__StreamDecoder *m_dec;
+    int m_nch, m_srate;
+    WDL_HeapBuf m_srcbuf; // see DecodeGetSrcBuffer()
+    WDL_Queue m_in; // compressed data not passed to libFLAC yet
+    FLAC__uint64 m_read_total; // bytes passed to libFLAC
+    int m_frame_bound; // bytes needed before decoding the next block
+    bool m_eof;
+    WDL_HeapBuf m_pcm; // last decoded frame, m_pcm_stride floats per channel
+    int m_pcm_pos, m_pcm_len, m_pcm_stride; // sample frames
+};
+
+
+class FlacEncoder : public I_NJEncoder
+{
+public:
+  // FLAC is lossless so there is no bitrate setting
+  FlacEncoder(int srate, int nch)
+  {
+    m_srate=srate;
+    m_nch=nch;
+    m_err=0;
+    m_enc=FLAC__stream_encoder_new();
+    if (!m_enc || nch < 1 || nch > 2) m_err=1;
+    else Init();
+  }
+
+  ~FlacEncoder()
+  {
+    if (m_enc)
+    {
+      FLAC__stream_encoder_finish(m_enc);
+      FLAC__stream_encoder_delete(m_enc);
+    }
+  }
+
+  unsigned int GetFourcc() { return NJ_FLAC_FOURCC; }
+  int isError() { return m_err; }
+
+  void Encode(float *in, int inlen, int advance=1, int spacing=1) // length in sample (PAIRS)
+  {
+    if (m_err) return;
+
+    if (inlen == 0)
+    {
+      // flushes the last frame, the stream's headers are not rewritten
+      // because there is no way to seek back in outqueue
+      FLAC__stream_encoder_finish(m_enc);
+      return;
+    }
+
+    m_buf.Resize(inlen*m_nch*sizeof(FLAC__int32),false);
+    FLAC__int32 *buf=(FLAC__int32 *)m_buf.Get();
+    const float scale=(float)((1<<(FLAC_ENC_BITS_PER_SAMPLE-1))-1);
+    int i,c,i2=0;
+    for (i = 0; i < inlen; i ++)
+    {
+      for (c = 0; c < m_nch; c ++)
+      {
+        float s=in[i2+c*spacing];
+        if (s > 1.0f) s=1.0f;
+        else if (s < -1.0f) s=-1.0f;
+        *buf++=(FLAC__int32)lrintf(s*scale);
+      }
+      i2+=advance;
+    }
+
+    if (!FLAC__stream_encoder_process_interleaved(m_enc,(FLAC__int32 *)m_buf.Get(),inlen))
+      m_err=1;
+  }
+
+  // The stream was finished by Encode(NULL,0), start the next one
+  void reinit()
+  {
+    if (!m_enc) return;
+
+    FLAC__stream_encoder_finish(m_enc);
+    outqueue.Advance(outqueue.Available());
+    outqueue.Compact();
+    m_err=0;
+    Init();
+  }
+
+  bool SetBitrate(int bitrate) { return true; } // lossless, nothing to change
+
+private:
+  // Settings are lost when a stream is finished, so they are applied again
+  void Init()
+  {
+    FLAC__stream_encoder_set_channels(m_enc,m_nch);
+    FLAC__stream_encoder_set_bits_per_sample(m_enc,FLAC_ENC_BITS_PER_SAMPLE);
+    FLAC__stream_encoder_set_sample_rate(m_enc,m_srate);
+    FLAC__stream_encoder_set_compression_level(m_enc,1); // fast, mid-side stereo
+    FLAC__stream_encoder_set_blocksize(m_enc,4096);
+    FLAC__stream_encoder_set_do_md5(m_enc,false);
+
+    if (FLAC__stream_encoder_init_stream(m_enc,WriteCallback,NULL,NULL,NULL,this) !=
+        FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+      m_err=1;
+  }
+
+  static FLAC__StreamEncoderWriteStatus WriteCallback(const FLAC__StreamEncoder *enc,
+      const FLAC__byte buffer[], size_t bytes, unsigned samples,
+      unsigned current_frame, void *client_data)
+  {
+    ((FlacEncoder *)client_data)->outqueue.Add(buffer,(int)bytes);
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+  }
+
+  FLAC__StreamEncoder *m_enc;
+  int m_err, m_nch, m_srate;
+  WDL_HeapBuf m_buf; // interleaved 24-bit input
+};
+
+#endif//_FLACENCDEC_H_
@@ -825,6 +825,63 @@ Net_Message *mpb_client_upload_interval_write::build()
 }
 
 
+// MESSAGE_CLIENT_UPLOAD_INTERVAL_VARIANTS
+int mpb_client_upload_interval_variants::parse(Net_Message *msg) // return 0 on success
+{
+  if (msg->get_type() != MESSAGE_CLIENT_UPLOAD_INTERVAL_VARIANTS) return -1;
+  if (msg->get_size() < 1+18 || (msg->get_size()-1)%18) return 1;
+  unsigned char *p=(unsigned char *)msg->get_data();
+  if (!p) return 2;
+
+  chidx = (int)*p++;
+  num_variants=(msg->get_size()-1)/18;
+  if (num_variants > MAX_INTERVAL_VARIANTS) return 1;
+
+  int x;
+  for (x = 0; x < num_variants; x ++)
+  {
+    memcpy(guids[x],p,sizeof(guids[x]));
+    p+=sizeof(guids[x]);
+    bitrates[x] = (int)*p++;
+    bitrates[x] |= ((int)*p++)<<8;
+  }
+
+  return 0;
+}
+
+
+Net_Message *mpb_client_upload_interval_variants::build()
+{
+  if (num_variants < 1 || num_variants > MAX_INTERVAL_VARIANTS) return 0;
+
+  Net_Message *nm=new Net_Message;
+  nm->set_type(MESSAGE_CLIENT_UPLOAD_INTERVAL_VARIANTS);
+
+  nm->set_size(1+18*num_variants);
+
+  unsigned char *p=(unsigned char *)nm->get_data();
+
+  if (!p)
+  {
+    delete nm;
+    return 0;
+  }
+
+  *p++=(unsigned char)((chidx)&0xff);
+
+  int x;
+  for (x = 0; x < num_variants; x ++)
+  {
+    memcpy(p,guids[x],sizeof(guids[x]));
+    p+=sizeof(guids[x]);
+    *p++=(unsigned char)((bitrates[x])&0xff);
+    *p++=(unsigned char)((bitrates[x]>>8)&0xff);
+  }
+
+  return nm;
+}
+
+
 /////////////////////////////////////////////////////////////////////////
 //////////// bidirectional generic  messages
 /////////////////////////////////////////////////////////////////////////
@@ -45,6 +45,8 @@ enum JamProtocol {
 #define PROTO_JAMMR_VER_MAX 0x8000ffff
 #define PROTO_JAMMR_VER_CUR 0x80000000
 
+#define SERVER_CAP_SIMULCAST 2 // see MESSAGE_CLIENT_UPLOAD_INTERVAL_VARIANTS
+
 
 #define MESSAGE_SERVER_AUTH_CHALLENGE 0x00
 
@@ -61,6 +63,7 @@ class mpb_server_auth_challenge
     // public data
     unsigned char challenge[8];
     int server_caps; // low bit is license agreement, bits 8-16 are keepalive
+                     // SERVER_CAP_SIMULCAST if interval variants are understood
     char *license_agreement;
     int protocol_version; // version should be 1 to start.
 };
@@ -272,6 +275,28 @@ class mpb_client_upload_interval_write
 };
 
 
+// links uploads of the same interval at different bitrates, so the server
+// can forward each subscriber the best one its connection keeps up with.
+// Sent before the begin messages of the uploads it lists, best first.
+#define MESSAGE_CLIENT_UPLOAD_INTERVAL_VARIANTS 0x85
+#define MAX_INTERVAL_VARIANTS 3
+class mpb_client_upload_interval_variants
+{
+  public:
+    mpb_client_upload_interval_variants() : chidx(0), num_variants(0) { memset(guids,0,sizeof(guids)); memset(bitrates,0,sizeof(bitrates)); }
+    ~mpb_client_upload_interval_variants() { }
+
+    int parse(Net_Message *msg); // return 0 on success
+    Net_Message *build();
+
+    // public data
+    int chidx;       // only 1 byte
+    int num_variants;
+    unsigned char guids[MAX_INTERVAL_VARIANTS][16];
+    int bitrates[MAX_INTERVAL_VARIANTS]; // kbps, only 2 bytes
+};
+
+
 #define MESSAGE_CHAT_MESSAGE 0xC0
 class mpb_chat_message
 {
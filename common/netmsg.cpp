@@ -35,6 +35,10 @@
 
 #include "netmsg.h"
 
+#define SEND_RATE_MAX_BACKLOG_SECS 0.5 // more than this waiting to be sent is congestion
+#define SEND_RATE_CLEAR_BACKLOG_SECS 0.1
+#define SEND_RATE_RAISE_CHECKS 5 // uncongested checks before raising the share
+
 static void hexDump(void *data, int len)
 {
   for (int i = 0; i < len; i += 16) {
@@ -224,6 +228,7 @@ int Net_Connection::Send(Net_Message *msg, bool deleteAfterSend)
     goto err;
   }
 
+  m_bytes_queued += hdrlen + msg->get_size();
   sendKeepaliveTimer.start();
   ret = 0;
 err:
@@ -233,6 +238,11 @@ err:
   return ret;
 }
 
+qint64 Net_Connection::GetSendBacklog()
+{
+  return m_sock->bytesToWrite();
+}
+
 QHostAddress Net_Connection::GetRemoteAddr()
 {
   /* Cache remote address since QTcpSocket clears it on disconnect */
@@ -245,7 +255,7 @@ QHostAddress Net_Connection::GetRemoteAddr()
 
 Net_Connection::Net_Connection(QTcpSocket *sock, QObject *parent)
   : QObject(parent), m_recvstate(0), m_recvmsg(0), m_sock(sock),
-    remoteAddr(sock->peerAddress())
+    remoteAddr(sock->peerAddress()), m_bytes_queued(0)
 {
   m_sock->setParent(this);
 
@@ -290,3 +300,64 @@ void Net_Connection::Kill()
   delete m_recvmsg;
   m_recvmsg = NULL;
 }
+
+
+Net_SendRateEstimator::Net_SendRateEstimator(int check_ms, double min_step, double max_step)
+  : m_check_ms(check_ms), m_min_step(min_step), m_max_step(max_step)
+{
+  Reset();
+}
+
+void Net_SendRateEstimator::Reset()
+{
+  m_timer.invalidate();
+  m_last_queued=m_last_drained=0;
+  m_backlog=0;
+  m_drain_rate=0.0;
+  m_clear_checks=0;
+}
+
+int Net_SendRateEstimator::Update(Net_Connection *con, int pct)
+{
+  if (!m_timer.isValid())
+  {
+    m_timer.start();
+    m_last_queued=con->GetBytesQueued();
+    m_last_drained=m_last_queued-con->GetSendBacklog();
+    return pct;
+  }
+  if (m_timer.elapsed() < m_check_ms) return pct;
+  double secs=m_timer.restart()/1000.0;
+  if (secs <= 0.0) return pct;
+
+  qint64 queued=con->GetBytesQueued();
+  m_backlog=con->GetSendBacklog();
+  qint64 drained=queued-m_backlog;
+  double offered_rate=(queued-m_last_queued)/secs;
+  m_drain_rate=(drained-m_last_drained)/secs;
+  m_last_queued=queued;
+  m_last_drained=drained;
+
+  if (m_backlog > m_drain_rate*SEND_RATE_MAX_BACKLOG_SECS)
+  {
+    // step down in proportion to the shortfall, but not too far at once
+    double step=offered_rate > 0.0 ? 0.9*m_drain_rate/offered_rate : 0.0;
+    if (step < m_min_step) step=m_min_step;
+    else if (step > m_max_step) step=m_max_step;
+    pct=(int)(pct*step);
+    if (pct < 1) pct=1;
+    m_clear_checks=0;
+  }
+  else if (m_backlog <= m_drain_rate*SEND_RATE_CLEAR_BACKLOG_SECS)
+  {
+    if (pct < 100 && ++m_clear_checks >= SEND_RATE_RAISE_CHECKS)
+    {
+      pct+=5;
+      if (pct > 100) pct=100;
+      m_clear_checks=0;
+    }
+  }
+  else m_clear_checks=0;
+
+  return pct;
+}
@@ -28,6 +28,7 @@
 #ifndef _NETMSG_H_
 #define _NETMSG_H_
 
+#include <QElapsedTimer>
 #include <QQueue>
 #include <QTimer>
 #include <QTcpSocket>
@@ -97,6 +98,11 @@ class Net_Connection : public QObject
 
     void SetKeepAlive(int interval);
 
+    // Bytes passed to Send() so far, and how many of them are still waiting
+    // to go out. Together these show how fast the connection drains.
+    qint64 GetBytesQueued() { return m_bytes_queued; }
+    qint64 GetSendBacklog();
+
     void Kill();
 
   signals:
@@ -117,6 +123,37 @@ class Net_Connection : public QObject
     QQueue<Net_Message*> recvq;
     QTcpSocket *m_sock;
     QHostAddress remoteAddr;
+    qint64 m_bytes_queued;
+};
+
+
+// Scales a share of the full send rate to what a connection drains. The share
+// drops by a factor between min_step and max_step when more than half a
+// second waits to be sent, and rises 5% after several checks with little
+// backlog.
+class Net_SendRateEstimator
+{
+  public:
+    Net_SendRateEstimator(int check_ms, double min_step, double max_step);
+
+    void Reset(); // for a new connection
+
+    // Returns the new share in percent. Checks more often than check_ms
+    // return pct unchanged.
+    int Update(Net_Connection *con, int pct);
+
+    // as of the last check
+    qint64 GetBacklog() { return m_backlog; }
+    double GetDrainRate() { return m_drain_rate; } // bytes/s
+
+  private:
+    int m_check_ms;
+    double m_min_step, m_max_step;
+    QElapsedTimer m_timer;
+    qint64 m_last_queued, m_last_drained;
+    qint64 m_backlog;
+    double m_drain_rate;
+    int m_clear_checks;
 };
 
 
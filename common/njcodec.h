@@ -0,0 +1,234 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Base classes for the codecs intervals can be encoded with.  Each codec has
+  its own fourcc, which is sent along with every interval so receivers know
+  which decoder to use.
+
+*/
+
+#ifndef _NJCODEC_H_
+#define _NJCODEC_H_
+
+#include <string.h>
+#include "../WDL/queue.h"
+#include "../WDL/heapbuf.h"
+
+#define MAKE_NJ_FOURCC(A,B,C,D) ((A) | ((B)<<8) | ((C)<<16) | ((D)<<24))
+
+#define NJ_VORBIS_FOURCC MAKE_NJ_FOURCC('O','G','G','v')
+#define NJ_OPUS_FOURCC MAKE_NJ_FOURCC('O','P','U','S')
+#define NJ_FLAC_FOURCC MAKE_NJ_FOURCC('F','L','A','C')
+
+#define NJ_DECODER_MAX_CHANNELS 8
+
+class I_NJEncoder
+{
+  public:
+    virtual ~I_NJEncoder() { }
+
+    virtual unsigned int GetFourcc()=0;
+    virtual int isError()=0;
+
+    // inlen is in sample frames, advance is the distance between frames and
+    // spacing the distance between channels. inlen 0 ends the stream.
+    virtual void Encode(float *in, int inlen, int advance=1, int spacing=1)=0;
+
+    // Start a new stream after the last one was ended
+    virtual void reinit()=0;
+
+    // Optionally do reinit()'s expensive work ahead of time
+    virtual void PrepareNext() { }
+
+    // Change the bitrate (kbps) from the next stream on, returns false if
+    // the encoder has to be recreated for that instead
+    virtual bool SetBitrate(int bitrate) { return false; }
+
+    WDL_Queue outqueue; // encoded stream
+};
+
+class I_NJDecoder
+{
+  public:
+    I_NJDecoder()
+    {
+      m_nch=0;
+      m_frames_used=0;
+      m_frames_read=0;
+      m_frames_write=0;
+      m_frames_size=0;
+      m_frames_mirror=0;
+      m_maxread_len=0;
+      m_maxread_srate=0;
+    }
+    virtual ~I_NJDecoder() { }
+
+    virtual unsigned int GetFourcc()=0;
+    virtual int GetSampleRate()=0;
+    virtual int GetNumChannels()=0;
+
+    virtual void *DecodeGetSrcBuffer(int srclen)=0;
+
+    // Also decodes data left over from earlier calls when the sample buffer
+    // was full, so DecodeWrote(0) is a valid way to pump the decoder.
+    virtual void DecodeWrote(int srclen)=0;
+
+    // No more data will be written.  Codecs that can only decode a frame
+    // once they have seen enough of the stream after it decode the rest.
+    virtual void DecodeEnd() { }
+
+    // Get ready for a new stream, keeping what can be reused
+    virtual void Reset()=0;
+
+    // Decoded samples are kept in a fixed-size ring buffer per channel that
+    // is allocated once the stream headers have been parsed.  It is sized so
+    // that up to len sample frames at dest_srate can be read at once, plus
+    // one maximum-size codec block.  Call before feeding in any data.
+    void DecodeSetMaxReadLength(int len, int dest_srate)
+    {
+      m_maxread_len=len;
+      m_maxread_srate=dest_srate;
+    }
+
+    // Number of decoded sample frames waiting to be read
+    int DecodeGetAvailable() { return m_frames_used; }
+
+    // Points samples[c] at the next sample of each channel, samples needs
+    // room for NJ_DECODER_MAX_CHANNELS pointers.  Returns the number of sample
+    // frames that can be read contiguously, which is at least
+    // min(DecodeGetAvailable(), DecodeGetMaxRead())
+    int DecodePeek(float **samples)
+    {
+      int c;
+      for (c=0;c<m_nch;c++) samples[c]=ChannelBuffer(c)+m_frames_read;
+      int l=m_frames_size-m_frames_read+m_frames_mirror;
+      return l < m_frames_used ? l : m_frames_used;
+    }
+
+    // Largest contiguous read that DecodePeek() always satisfies
+    int DecodeGetMaxRead() { return m_frames_mirror; }
+
+    // Consume sample frames returned by DecodePeek()
+    void DecodeAdvance(int nframes)
+    {
+      if (nframes > m_frames_used) nframes=m_frames_used;
+      if (nframes <= 0) return;
+      m_frames_used-=nframes;
+      m_frames_read+=nframes;
+      if (m_frames_read >= m_frames_size) m_frames_read-=m_frames_size;
+    }
+
+  protected:
+    // Size the ring buffers for the stream parameters just parsed.  The first
+    // m_frames_mirror samples of each channel are duplicated after the end of
+    // its ring so reads up to that length never have to wrap.  blocksize is
+    // the most sample frames the codec outputs at once.  Channels beyond
+    // NJ_DECODER_MAX_CHANNELS are dropped.
+    void AllocSamples(int nch, int srate, int blocksize)
+    {
+      int len=m_maxread_len > 0 ? m_maxread_len : 4096;
+      if (m_maxread_srate > 0 && srate > 0)
+        len=(int)(((double)len*srate)/m_maxread_srate);
+      len+=2; // resampler interpolation reads one sample frame ahead
+
+      if (blocksize <= 0) blocksize=8192;
+      if (nch > NJ_DECODER_MAX_CHANNELS) nch=NJ_DECODER_MAX_CHANNELS;
+
+      int mirror=len;
+      int size=len+blocksize;
+      if (nch == m_nch && size == m_frames_size && mirror == m_frames_mirror) return;
+
+      m_samples.Resize(nch*(size+mirror)*sizeof(float),false);
+      m_nch=nch;
+      m_frames_size=size;
+      m_frames_mirror=mirror;
+      ResetSamples();
+    }
+
+    void ResetSamples()
+    {
+      m_frames_used=0;
+      m_frames_read=0;
+      m_frames_write=0;
+    }
+
+    // Room left in the ring buffers, in sample frames
+    int SamplesFree()
+    {
+      return m_frames_size-m_frames_used;
+    }
+
+    // Append sample frames, pcm[c][n] if planar or pcm[n*nch+c] otherwise.
+    // Call SamplesFree() first.
+    void WriteSamples(const float * const *planar, const float *interleaved,
+                      int nch, int frames)
+    {
+      int c;
+      for(c=0;c<m_nch;c++)
+      {
+        float *buf=ChannelBuffer(c);
+        int w=m_frames_write;
+        int n=0;
+        while (n < frames)
+        {
+          int l=m_frames_size-w;
+          if (l > frames-n) l=frames-n;
+
+          if (planar) memcpy(buf+w,planar[c]+n,l*sizeof(float));
+          else
+          {
+            const float *in=interleaved+n*nch+c;
+            int i;
+            for(i=0;i<l;i++) buf[w+i]=in[i*nch];
+          }
+
+          if (w < m_frames_mirror)
+          {
+            int ml=m_frames_mirror-w;
+            if (ml > l) ml=l;
+            memcpy(buf+m_frames_size+w,buf+w,ml*sizeof(float));
+          }
+
+          n+=l;
+          w+=l;
+          if (w >= m_frames_size) w=0;
+        }
+      }
+
+      m_frames_write+=frames;
+      if (m_frames_write >= m_frames_size) m_frames_write-=m_frames_size;
+      m_frames_used+=frames;
+    }
+
+  private:
+    float *ChannelBuffer(int c)
+    {
+      return (float *)m_samples.Get()+c*(m_frames_size+m_frames_mirror);
+    }
+
+    WDL_HeapBuf m_samples; // rings plus mirrored heads, see AllocSamples()
+    int m_nch; // channels in m_samples
+    int m_frames_used; // sample frames available to read
+    int m_frames_read, m_frames_write; // ring buffer indices
+    int m_frames_size, m_frames_mirror;
+    int m_maxread_len, m_maxread_srate;
+};
+
+#endif//_NJCODEC_H_
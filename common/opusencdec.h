@@ -0,0 +1,588 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Opus encoding and decoding in Ogg streams as described in RFC 7845, so an
+  interval is a regular .opus file.  Compared to Vorbis, Opus uses less CPU
+  and has shorter frames and less codec delay.
+
+*/
+
+#ifndef _OPUSENCDEC_H_
+#define _OPUSENCDEC_H_
+
+#include <string.h>
+#include <math.h>
+#include <opus.h>
+#include "ogg/ogg.h"
+#include "njcodec.h"
+
+static inline void opus_write_le16(unsigned char *p, int v)
+{
+  p[0]=v&0xff;
+  p[1]=(v>>8)&0xff;
+}
+
+static inline void opus_write_le32(unsigned char *p, unsigned int v)
+{
+  opus_write_le16(p,v&0xffff);
+  opus_write_le16(p+2,v>>16);
+}
+
+class OggOpusDecoder : public I_NJDecoder
+{
+  public:
+    enum { MAX_FRAME = 5760 }; // 120 ms at 48 kHz, the longest Opus packet
+
+    OggOpusDecoder()
+    {
+      m_dec=0;
+      m_nch=0;
+      m_skip=0;
+      m_decoded=0;
+      m_pcm_pos=0;
+      m_pcm_len=0;
+      packets=0;
+      memset(&oy,0,sizeof(oy));
+      memset(&os,0,sizeof(os));
+      memset(&og,0,sizeof(og));
+      memset(&op,0,sizeof(op));
+
+      ogg_sync_init(&oy);
+    }
+    ~OggOpusDecoder()
+    {
+      if (m_dec) opus_decoder_destroy(m_dec);
+      ogg_stream_clear(&os);
+      ogg_sync_clear(&oy);
+    }
+
+    unsigned int GetFourcc() { return NJ_OPUS_FOURCC; }
+    int GetSampleRate() { return 48000; } // Opus always decodes at 48 kHz here
+    int GetNumChannels() { return m_nch?m_nch:1; }
+
+    void *DecodeGetSrcBuffer(int srclen)
+    {
+      return ogg_sync_buffer(&oy,srclen);
+    }
+
+    void DecodeWrote(int srclen)
+    {
+      if (srclen > 0) ogg_sync_wrote(&oy,srclen);
+
+      for (;;)
+      {
+        if (!DecodeFlushPCM()) return; // ring buffer full
+
+        if (!ogg_stream_check(&os) && ogg_stream_packetout(&os,&op)>0)
+        {
+          if (packets == 0)
+          {
+            if (!ParseHead(&op)) return;
+          }
+          else if (packets > 1 && m_dec) // packet 1 is OpusTags
+          {
+            int n=opus_decode_float(m_dec,op.packet,op.bytes,
+                                    (float *)m_pcm.Get(),MAX_FRAME,0);
+            if (n > 0)
+            {
+              // the last page's granule position trims the encoder's padding
+              m_decoded+=n;
+              if (op.e_o_s && op.granulepos >= 0 && op.granulepos < m_decoded)
+              {
+                ogg_int64_t trim=m_decoded-op.granulepos;
+                n=trim < n ? n-(int)trim : 0;
+              }
+
+              // the encoder's lookahead comes first
+              m_pcm_pos=n < m_skip ? n : m_skip;
+              m_pcm_len=n;
+              m_skip-=m_pcm_pos;
+            }
+          }
+          packets++;
+          continue;
+        }
+
+        if (ogg_sync_pageout(&oy,&og)<=0) return;
+
+        int serial=ogg_page_serialno(&og);
+        if (ogg_stream_check(&os)) ogg_stream_init(&os,serial);
+        else if (serial!=os.serialno)
+        {
+          ogg_stream_reset_serialno(&os,serial);
+          m_pcm_pos=m_pcm_len=0;
+          packets=0;
+        }
+        ogg_stream_pagein(&os,&og);
+      }
+    }
+
+    // The sample buffer and the Opus decoder are kept
+    void Reset()
+    {
+      ResetSamples();
+      ogg_sync_reset(&oy);
+      if (!ogg_stream_check(&os)) ogg_stream_reset(&os);
+      m_pcm_pos=m_pcm_len=0;
+      packets=0;
+    }
+
+  private:
+    bool ParseHead(ogg_packet *p)
+    {
+      const unsigned char *h=p->packet;
+      if (p->bytes < 19 || memcmp(h,"OpusHead",8)) return false;
+      if ((h[8]&0xf0) != 0) return false; // incompatible version
+      if (h[18] != 0) return false; // only mono and stereo mapping
+      int nch=h[9];
+      if (nch < 1 || nch > 2) return false;
+
+      if (m_dec && nch == m_nch) opus_decoder_ctl(m_dec,OPUS_RESET_STATE);
+      else
+      {
+        if (m_dec) opus_decoder_destroy(m_dec);
+        int err;
+        m_dec=opus_decoder_create(48000,nch,&err);
+        if (err != OPUS_OK) m_dec=0;
+        m_nch=nch;
+        m_pcm.Resize(MAX_FRAME*nch*sizeof(float),false);
+      }
+      m_skip=h[10]|(h[11]<<8); // pre-skip
+      m_decoded=0;
+      AllocSamples(nch,48000,MAX_FRAME);
+      return m_dec != 0;
+    }
+
+    // Returns false while m_pcm doesn't fit in the ring buffer
+    bool DecodeFlushPCM()
+    {
+      while (m_pcm_pos < m_pcm_len)
+      {
+        int avail=SamplesFree();
+        if (avail <= 0) return false;
+
+        int n=m_pcm_len-m_pcm_pos;
+        if (n > avail) n=avail;
+        WriteSamples(NULL,(float *)m_pcm.Get()+m_pcm_pos*m_nch,m_nch,n);
+        m_pcm_pos+=n;
+      }
+      return true;
+    }
+
+    OpusDecoder *m_dec;
+    int m_nch;
+    int m_skip; // pre-skip samples still to drop
+    ogg_int64_t m_decoded; // granule position of the last decoded packet
+    WDL_HeapBuf m_pcm; // last decoded packet, interleaved
+    int m_pcm_pos, m_pcm_len; // sample frames
+    int packets;
+
+    ogg_sync_state   oy;
+    ogg_stream_state os;
+    ogg_page         og;
+    ogg_packet       op;
+};
+
+
+// Windowed-sinc resampler to 48 kHz for input rates libopus can't encode, such
+// as 44.1 kHz. The ratio is rational so each output phase has its own filter.
+class OpusResampler
+{
+public:
+  enum { HALF_TAPS = 16, MAX_PHASES = 1024 };
+
+  // number of output phases, 0 if srate would need too many
+  static int NumPhases(int srate)
+  {
+    if (srate <= 0) return 0;
+    int a=48000, b=srate;
+    while (b) { int t=a%b; a=b; b=t; }
+    return 48000/a <= MAX_PHASES ? 48000/a : 0;
+  }
+
+  OpusResampler(int srate, int nch)
+  {
+    static const double pi=3.14159265358979323846;
+    m_phases=NumPhases(srate);
+    m_step=srate/(48000/m_phases);
+    m_nch=nch;
+
+    // cut off below the lower of the two Nyquist frequencies
+    double fc=0.95*(m_phases < m_step ? (double)m_phases/m_step : 1.0);
+    float *f=(float *)m_filter.Resize(m_phases*2*HALF_TAPS*sizeof(float),false);
+    int p,k;
+    for (p = 0; p < m_phases; p ++)
+    {
+      float *h=f+p*2*HALF_TAPS;
+      double sum=0;
+      for (k = 0; k < 2*HALF_TAPS; k ++)
+      {
+        double x=(double)p/m_phases-(k-HALF_TAPS+1);
+        double s=x == 0 ? 1.0 : sin(pi*fc*x)/(pi*fc*x);
+        double w=0.42+0.5*cos(pi*x/HALF_TAPS)+0.08*cos(2*pi*x/HALF_TAPS);
+        h[k]=(float)(s*w);
+        sum+=h[k];
+      }
+      for (k = 0; k < 2*HALF_TAPS; k ++) h[k]=(float)(h[k]/sum); // unity gain
+    }
+    Reset();
+  }
+
+  void Reset()
+  {
+    // silence before the first input sample
+    memset(m_buf.Resize((HALF_TAPS-1)*m_nch*sizeof(float),false),0,
+           (HALF_TAPS-1)*m_nch*sizeof(float));
+    m_pos=HALF_TAPS-1;
+    m_phase=0;
+  }
+
+  // input is laid out like I_NJEncoder::Encode()'s
+  void Write(const float *in, int len, int advance, int spacing)
+  {
+    float *p=Append(len);
+    int i;
+    for (i = 0; i < len; i ++)
+    {
+      p[i*m_nch]=in[i*advance];
+      if (m_nch==2) p[i*m_nch+1]=in[i*advance+spacing];
+    }
+  }
+
+  // silence after the last input sample lets it be resampled
+  void WriteFlush()
+  {
+    memset(Append(HALF_TAPS),0,HALF_TAPS*m_nch*sizeof(float));
+  }
+
+  // returns false when more input is needed for the next output frame
+  bool Read(float *out)
+  {
+    int len=m_buf.GetSize()/(m_nch*sizeof(float));
+    if (m_pos+HALF_TAPS >= len)
+    {
+      Compact();
+      return false;
+    }
+
+    const float *h=(const float *)m_filter.Get()+m_phase*2*HALF_TAPS;
+    const float *x=(const float *)m_buf.Get()+(m_pos-HALF_TAPS+1)*m_nch;
+    int c,k;
+    for (c = 0; c < m_nch; c ++)
+    {
+      float acc=0;
+      for (k = 0; k < 2*HALF_TAPS; k ++) acc+=x[k*m_nch+c]*h[k];
+      out[c]=acc;
+    }
+
+    m_phase+=m_step;
+    m_pos+=m_phase/m_phases;
+    m_phase%=m_phases;
+    return true;
+  }
+
+  // output sample frames for len input sample frames after WriteFlush()
+  ogg_int64_t OutputLength(ogg_int64_t len) const
+  {
+    return (len*m_phases+m_step-1)/m_step;
+  }
+
+private:
+  float *Append(int len)
+  {
+    int old=m_buf.GetSize();
+    return (float *)((char *)m_buf.Resize(old+len*m_nch*sizeof(float),false)+old);
+  }
+
+  // drops input that no longer falls under the filter
+  void Compact()
+  {
+    int drop=m_pos-HALF_TAPS+1;
+    if (drop <= 0) return;
+    int keep=m_buf.GetSize()-drop*m_nch*sizeof(float);
+    char *p=(char *)m_buf.Get();
+    memmove(p,p+drop*m_nch*sizeof(float),keep);
+    m_buf.Resize(keep,false);
+    m_pos-=drop;
+  }
+
+  WDL_HeapBuf m_filter; // 2*HALF_TAPS coefficients per phase
+  WDL_HeapBuf m_buf; // interleaved input still under the filter
+  int m_pos; // input sample frame of the next output frame
+  int m_phase, m_phases, m_step; // m_phases output frames per m_step input frames
+  int m_nch;
+};
+
+
+class OggOpusEncoder : public I_NJEncoder
+{
+public:
+  static bool IsNativeSampleRate(int srate)
+  {
+    return srate == 8000 || srate == 12000 || srate == 16000 ||
+           srate == 24000 || srate == 48000;
+  }
+
+  // other rates are resampled to 48 kHz
+  static bool IsSampleRateSupported(int srate)
+  {
+    return IsNativeSampleRate(srate) || OpusResampler::NumPhases(srate) > 0;
+  }
+
+  // bitrate is in kbps for all channels together
+  OggOpusEncoder(int srate, int nch, int bitrate, int serno)
+  {
+    int encrate=IsNativeSampleRate(srate) ? srate : 48000;
+    m_nch=nch;
+    m_frame_len=encrate/50; // 20 ms
+    m_frame_used=0;
+    m_mult=48000/encrate;
+    m_resampler=0;
+    m_resampled_in=0;
+    m_in_total=m_real_total=0;
+    m_granule=0;
+    m_packetno=0;
+    m_header_npages=0;
+    m_lookahead=0;
+
+    memset(&os,0,sizeof(os));
+    ogg_stream_init(&os,m_ser=serno);
+
+    int err=OPUS_BAD_ARG;
+    m_enc=IsSampleRateSupported(srate) && nch >= 1 && nch <= 2 ?
+          opus_encoder_create(encrate,nch,OPUS_APPLICATION_AUDIO,&err) : 0;
+    m_err=err != OPUS_OK || !m_enc;
+    if (m_err) return;
+
+    if (encrate != srate) m_resampler=new OpusResampler(srate,nch);
+
+    opus_encoder_ctl(m_enc,OPUS_SET_BITRATE(bitrate*1000));
+    opus_int32 lookahead=0;
+    opus_encoder_ctl(m_enc,OPUS_GET_LOOKAHEAD(&lookahead));
+    m_lookahead=lookahead;
+
+    m_frame.Resize(m_frame_len*nch*sizeof(float),false);
+
+    // OpusHead and OpusTags, replayed by reinit()
+    unsigned char head[19];
+    memcpy(head,"OpusHead",8);
+    head[8]=1; // version
+    head[9]=nch;
+    opus_write_le16(head+10,m_lookahead*m_mult); // pre-skip at 48 kHz
+    opus_write_le32(head+12,srate);
+    opus_write_le16(head+16,0); // output gain
+    head[18]=0; // channel mapping family
+    AddHeaderPacket(head,sizeof(head));
+
+    static const char vendor[]="Wahjam";
+    unsigned char tags[8+4+sizeof(vendor)-1+4];
+    memcpy(tags,"OpusTags",8);
+    opus_write_le32(tags+8,sizeof(vendor)-1);
+    memcpy(tags+12,vendor,sizeof(vendor)-1);
+    opus_write_le32(tags+12+sizeof(vendor)-1,0); // no comments
+    AddHeaderPacket(tags,sizeof(tags));
+
+    outqueue.Add(m_header_pages.Get(),m_header_pages.GetSize());
+  }
+
+  ~OggOpusEncoder()
+  {
+    if (m_enc) opus_encoder_destroy(m_enc);
+    delete m_resampler;
+    ogg_stream_clear(&os);
+  }
+
+  unsigned int GetFourcc() { return NJ_OPUS_FOURCC; }
+  int isError() { return m_err; }
+
+  void Encode(float *in, int inlen, int advance=1, int spacing=1) // length in sample (PAIRS)
+  {
+    if (m_err) return;
+
+    if (inlen == 0)
+    {
+      Finish();
+      return;
+    }
+
+    if (m_resampler)
+    {
+      m_resampler->Write(in,inlen,advance,spacing);
+      m_resampled_in+=inlen;
+      EncodeResampled();
+      return;
+    }
+
+    float *frame=(float *)m_frame.Get();
+    int i,i2=0;
+    for (i = 0; i < inlen; i ++)
+    {
+      frame[m_frame_used*m_nch]=in[i2];
+      if (m_nch==2) frame[m_frame_used*m_nch+1]=in[i2+spacing];
+      i2+=advance;
+
+      if (++m_frame_used == m_frame_len) EncodeFrame(false);
+    }
+    m_in_total+=inlen;
+    m_real_total+=inlen;
+  }
+
+  // Opus encoders restart cheaply, the headers are cached
+  void reinit()
+  {
+    if (m_err) return;
+
+    opus_encoder_ctl(m_enc,OPUS_RESET_STATE);
+    if (m_resampler) m_resampler->Reset();
+    m_resampled_in=0;
+    m_frame_used=0;
+    m_in_total=m_real_total=0;
+    m_granule=0;
+    m_packetno=2;
+
+    // The stream resumes at the page after the cached headers
+    ogg_stream_reset(&os);
+    os.pageno=m_header_npages;
+    os.b_o_s=1;
+
+    outqueue.Advance(outqueue.Available());
+    outqueue.Compact();
+    outqueue.Add(m_header_pages.Get(),m_header_pages.GetSize());
+  }
+
+  bool SetBitrate(int bitrate)
+  {
+    if (!m_err) opus_encoder_ctl(m_enc,OPUS_SET_BITRATE(bitrate*1000));
+    return true;
+  }
+
+private:
+  enum { MAX_PACKET = 4000 }; // recommended by the libopus documentation
+
+  void AddHeaderPacket(unsigned char *buf, int len)
+  {
+    ogg_packet hp;
+    memset(&hp,0,sizeof(hp));
+    hp.packet=buf;
+    hp.bytes=len;
+    hp.b_o_s=m_packetno==0;
+    hp.packetno=m_packetno++;
+    ogg_stream_packetin(&os,&hp);
+
+    // each header goes in its own page
+    for (;;)
+    {
+      ogg_page og;
+      if (!ogg_stream_flush(&os,&og)) break;
+      m_header_pages.Add(og.header,og.header_len);
+      m_header_pages.Add(og.body,og.body_len);
+      m_header_npages++;
+    }
+  }
+
+  // Pad with silence until the encoder's lookahead has been flushed out and
+  // end the stream. The last page's granule position trims the padding.
+  void Finish()
+  {
+    if (m_resampler)
+    {
+      m_resampler->WriteFlush();
+      EncodeResampled();
+      m_real_total=m_resampler->OutputLength(m_resampled_in);
+    }
+
+    for (;;)
+    {
+      int pad=m_frame_len-m_frame_used;
+      memset((float *)m_frame.Get()+m_frame_used*m_nch,0,pad*m_nch*sizeof(float));
+      m_frame_used=m_frame_len;
+      m_in_total+=pad;
+
+      bool last=m_in_total >= m_real_total+m_lookahead;
+      EncodeFrame(last);
+      if (last || m_err) break;
+    }
+  }
+
+  void EncodeResampled()
+  {
+    float *frame=(float *)m_frame.Get();
+    while (!m_err && m_resampler->Read(frame+m_frame_used*m_nch))
+    {
+      m_in_total++;
+      if (++m_frame_used == m_frame_len) EncodeFrame(false);
+    }
+  }
+
+  void EncodeFrame(bool eos)
+  {
+    unsigned char packet[MAX_PACKET];
+    int n=opus_encode_float(m_enc,(float *)m_frame.Get(),m_frame_len,packet,sizeof(packet));
+    m_frame_used=0;
+    if (n < 0)
+    {
+      m_err=1;
+      return;
+    }
+
+    m_granule+=(ogg_int64_t)m_frame_len*m_mult;
+
+    ogg_packet op;
+    memset(&op,0,sizeof(op));
+    op.packet=packet;
+    op.bytes=n;
+    op.e_o_s=eos;
+    op.granulepos=eos ? (ogg_int64_t)(m_real_total+m_lookahead)*m_mult : m_granule;
+    op.packetno=m_packetno++;
+    ogg_stream_packetin(&os,&op);
+
+    // full pages only, the last one is flushed at the end of the stream
+    for (;;)
+    {
+      ogg_page og;
+      if (!(eos ? ogg_stream_flush(&os,&og) : ogg_stream_pageout(&os,&og))) break;
+      outqueue.Add(og.header,og.header_len);
+      outqueue.Add(og.body,og.body_len);
+    }
+  }
+
+  OpusEncoder *m_enc;
+  int m_err,m_nch;
+  int m_mult; // 48 kHz granule positions per encoded sample
+  int m_lookahead; // at the encoder's sample rate
+
+  OpusResampler *m_resampler; // when the input rate isn't native to Opus
+  ogg_int64_t m_resampled_in; // input sample frames given to m_resampler
+
+  WDL_HeapBuf m_frame; // interleaved input of the frame being filled
+  int m_frame_len, m_frame_used; // sample frames
+
+  ogg_int64_t m_in_total, m_real_total; // encoded sample frames including/excluding padding
+  ogg_int64_t m_granule;
+  ogg_int64_t m_packetno;
+
+  ogg_stream_state os;
+  int m_ser;
+
+  WDL_Queue m_header_pages;
+  int m_header_npages;
+};
+
+#endif//_OPUSENCDEC_H_
@@ -10,7 +10,9 @@ version=${2:-$(grep 'VERSION =' qtclient/qtclient.pro | awk '{ print $3 }')}
 spc_file="qtclient/installer/windows/$target.spc"
 pvk_file="qtclient/installer/windows/$target.pvk"
 
-common_dlls=(bin/libogg-0.dll
+common_dlls=(bin/libFLAC-8.dll
+	     bin/libogg-0.dll
+	     bin/libopus-0.dll
 	     bin/libportaudio-2.dll
 	     bin/libportmidi.dll
 	     bin/libqt5keychain.dll
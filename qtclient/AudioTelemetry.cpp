@@ -0,0 +1,241 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+
+#include "AudioTelemetry.h"
+#include "qtclient.h"
+
+AudioTelemetry::AudioTelemetry(QObject *parent)
+  : QObject(parent), writeIdx(0), xruns(0), sampleRate(44100),
+    currentStage(STAGE_OTHER), stageStartNs(0), lastXruns(0)
+{
+  ring = new Record[RING_SIZE];
+  memset(ring, 0, sizeof(ring[0]) * RING_SIZE);
+  memset(&current, 0, sizeof(current));
+  resetCounters();
+  timer.start();
+
+  pollTimer = new QTimer(this);
+  connect(pollTimer, SIGNAL(timeout()), this, SLOT(pollXruns()));
+  pollTimer->start(1000);
+}
+
+AudioTelemetry::~AudioTelemetry()
+{
+  delete [] ring;
+}
+
+const char *AudioTelemetry::stageName(int stage)
+{
+  static const char *names[NUM_STAGES] = {
+    "other", "input", "effects", "decode", "mix", "metronome",
+  };
+  return stage >= 0 && stage < NUM_STAGES ? names[stage] : "unknown";
+}
+
+void AudioTelemetry::setSampleRate(int sampleRate_)
+{
+  sampleRate = sampleRate_;
+}
+
+void AudioTelemetry::beginCallback(unsigned long frames,
+                                   PaStreamCallbackFlags flags)
+{
+  qint64 now = timer.nsecsElapsed();
+
+  memset(current.stageNs, 0, sizeof(current.stageNs));
+  memset(current.workerNs, 0, sizeof(current.workerNs));
+  current.timestampNs = now;
+  current.frames = frames;
+  current.flags = flags;
+  currentStage = STAGE_OTHER;
+  stageStartNs = now;
+}
+
+void AudioTelemetry::endCallback()
+{
+  qint64 now = timer.nsecsElapsed();
+  current.stageNs[currentStage] += now - stageStartNs;
+  current.durationNs = now - current.timestampNs;
+
+  counters[COUNTER_CALLBACKS].fetchAndAddRelaxed(1);
+
+  bool xrun = false;
+  if (current.flags & paInputUnderflow) {
+    counters[COUNTER_INPUT_UNDERFLOWS].fetchAndAddRelaxed(1);
+    xrun = true;
+  }
+  if (current.flags & paInputOverflow) {
+    counters[COUNTER_INPUT_OVERFLOWS].fetchAndAddRelaxed(1);
+    xrun = true;
+  }
+  if (current.flags & paOutputUnderflow) {
+    counters[COUNTER_OUTPUT_UNDERFLOWS].fetchAndAddRelaxed(1);
+    xrun = true;
+  }
+  if (current.flags & paOutputOverflow) {
+    counters[COUNTER_OUTPUT_OVERFLOWS].fetchAndAddRelaxed(1);
+    xrun = true;
+  }
+
+  if (sampleRate > 0 && current.frames > 0) {
+    qint64 deadlineNs = (qint64)current.frames * 1000000000 / sampleRate;
+    qint64 bucket = current.durationNs * (NUM_LOAD_BUCKETS - 1) / deadlineNs;
+    if (bucket >= NUM_LOAD_BUCKETS) {
+      bucket = NUM_LOAD_BUCKETS - 1;
+    }
+    loadBuckets[bucket].fetchAndAddRelaxed(1);
+
+    if (current.durationNs > deadlineNs) {
+      counters[COUNTER_DEADLINE_MISSES].fetchAndAddRelaxed(1);
+      xrun = true;
+    }
+  }
+
+  unsigned int w = writeIdx.load();
+  ring[w & (RING_SIZE - 1)] = current;
+  writeIdx.storeRelease(w + 1);
+
+  if (xrun) {
+    xruns.fetchAndAddRelease(1);
+  }
+}
+
+QVector<AudioTelemetry::Record> AudioTelemetry::records() const
+{
+  unsigned int w = writeIdx.loadAcquire();
+  unsigned int n = w < RING_SIZE ? w : RING_SIZE;
+  unsigned int first = w - n;
+
+  QVector<Record> result(n);
+  for (unsigned int i = 0; i < n; i++) {
+    result[i] = ring[(first + i) & (RING_SIZE - 1)];
+  }
+
+  /* Drop records that the audio thread may have overwritten while copying */
+  unsigned int w2 = writeIdx.loadAcquire();
+  if (w2 + 1 - first > RING_SIZE) {
+    unsigned int overwritten = w2 + 1 - first - RING_SIZE;
+    result.remove(0, overwritten < n ? overwritten : n);
+  }
+
+  if (!result.isEmpty()) {
+    qint64 oldestNs = result.last().timestampNs -
+                      (qint64)RECORD_SECONDS * 1000000000;
+    int skip = 0;
+    while (skip < result.size() && result[skip].timestampNs < oldestNs) {
+      skip++;
+    }
+    result.remove(0, skip);
+  }
+  return result;
+}
+
+bool AudioTelemetry::saveRecords(const QString &filename) const
+{
+  QFile file(filename);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+    return false;
+  }
+
+  QTextStream out(&file);
+  out << "time_ms,frames,flags,duration_us,deadline_us";
+  for (int i = 0; i < NUM_STAGES; i++) {
+    out << "," << stageName(i) << "_us";
+  }
+  for (int i = 0; i < MAX_WORKERS; i++) {
+    out << ",worker" << i + 1 << "_us";
+  }
+  out << "\n";
+
+  QVector<Record> recs = records();
+  qint64 startNs = recs.isEmpty() ? 0 : recs.first().timestampNs;
+  for (const Record &rec : recs) {
+    out << (rec.timestampNs - startNs) / 1000000.0 << ","
+        << rec.frames << ","
+        << rec.flags << ","
+        << rec.durationNs / 1000.0 << ","
+        << (sampleRate > 0 ? rec.frames * 1000000.0 / sampleRate : 0.0);
+    for (int i = 0; i < NUM_STAGES; i++) {
+      out << "," << rec.stageNs[i] / 1000.0;
+    }
+    for (int i = 0; i < MAX_WORKERS; i++) {
+      out << "," << rec.workerNs[i] / 1000.0;
+    }
+    out << "\n";
+  }
+  return out.status() == QTextStream::Ok;
+}
+
+void AudioTelemetry::resetCounters()
+{
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    counters[i].store(0);
+  }
+  for (int i = 0; i < NUM_LOAD_BUCKETS; i++) {
+    loadBuckets[i].store(0);
+  }
+}
+
+void AudioTelemetry::pollXruns()
+{
+  unsigned int n = xruns.loadAcquire();
+  if (n == lastXruns) {
+    return;
+  }
+
+  /* Don't fill up the disk if xruns happen all the time */
+  if (lastDumpTimer.isValid() && lastDumpTimer.elapsed() < DUMP_INTERVAL_MS) {
+    return;
+  }
+
+  lastXruns = n;
+  dumpRecords();
+}
+
+void AudioTelemetry::dumpRecords()
+{
+  QDir dir = QFileInfo(logFilePath).absoluteDir();
+  QString filename = dir.filePath(QString("xrun-%1.csv").arg(
+        QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss")));
+
+  lastDumpTimer.start();
+  if (!saveRecords(filename)) {
+    qWarning("Failed to write xrun recording to %s",
+             filename.toLocal8Bit().constData());
+    return;
+  }
+  qWarning("Audio xrun, wrote recording to %s",
+           filename.toLocal8Bit().constData());
+  lastDump = filename;
+
+  /* Only keep the latest recordings */
+  QStringList dumps = dir.entryList(QStringList("xrun-*.csv"), QDir::Files,
+                                    QDir::Name);
+  while (dumps.size() > MAX_DUMPS) {
+    dir.remove(dumps.takeFirst());
+  }
+
+  emit xrunDumped(filename);
+}
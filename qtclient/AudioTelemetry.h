@@ -0,0 +1,186 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _AUDIOTELEMETRY_H_
+#define _AUDIOTELEMETRY_H_
+
+#include <portaudio.h>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+#include <QVector>
+
+/* Audio callback telemetry and xrun flight recorder
+ *
+ * The audio thread times each callback and the processing stages within it.
+ * Counters and a load histogram are updated without locking and every
+ * callback is appended to a ring buffer that holds the last few seconds.
+ *
+ * When a callback misses its deadline or PortAudio reports an underflow or
+ * overflow the client event loop dumps the ring buffer to a CSV file next to
+ * the log file.
+ */
+class AudioTelemetry : public QObject
+{
+  Q_OBJECT
+
+public:
+  /* Time is charged to the current stage, see AudioStage */
+  enum Stage {
+    STAGE_OTHER,
+    STAGE_INPUT,
+    STAGE_EFFECTS,
+    STAGE_DECODE,
+    STAGE_MIX,
+    STAGE_METRONOME,
+    NUM_STAGES,
+  };
+
+  enum Counter {
+    COUNTER_CALLBACKS,
+    COUNTER_DEADLINE_MISSES,
+    COUNTER_INPUT_UNDERFLOWS,
+    COUNTER_INPUT_OVERFLOWS,
+    COUNTER_OUTPUT_UNDERFLOWS,
+    COUNTER_OUTPUT_OVERFLOWS,
+    COUNTER_EFFECT_JOIN_MISSES,
+    COUNTER_RECLAIMER_OVERFLOWS, /* objects destroyed on the audio thread */
+    NUM_COUNTERS,
+  };
+
+  enum {
+    NUM_LOAD_BUCKETS = 11, /* 10% steps of the deadline, last one is >= 100% */
+    RECORD_SECONDS = 10,
+    MAX_WORKERS = 4,       /* effect worker threads, see EffectWorkers */
+  };
+
+  struct Record {
+    qint64 timestampNs;
+    unsigned int frames;
+    unsigned int flags; /* PaStreamCallbackFlags */
+    unsigned int durationNs;
+    unsigned int stageNs[NUM_STAGES];
+    unsigned int workerNs[MAX_WORKERS]; /* in parallel with the stages */
+  };
+
+  AudioTelemetry(QObject *parent = 0);
+  ~AudioTelemetry();
+
+  static const char *stageName(int stage);
+
+  /* Call before starting the stream */
+  void setSampleRate(int sampleRate);
+  int getSampleRate() const { return sampleRate; }
+
+  /* Audio thread only */
+  void beginCallback(unsigned long frames, PaStreamCallbackFlags flags);
+  void endCallback();
+  Stage switchStage(Stage stage)
+  {
+    qint64 now = timer.nsecsElapsed();
+    current.stageNs[currentStage] += now - stageStartNs;
+    stageStartNs = now;
+
+    Stage old = currentStage;
+    currentStage = stage;
+    return old;
+  }
+  void addWorkerTime(int worker, unsigned int ns)
+  {
+    current.workerNs[worker] += ns;
+  }
+  void countEffectJoinMiss()
+  {
+    counters[COUNTER_EFFECT_JOIN_MISSES].fetchAndAddRelaxed(1);
+  }
+  void countReclaimerOverflows(unsigned int n)
+  {
+    counters[COUNTER_RECLAIMER_OVERFLOWS].fetchAndAddRelaxed(n);
+  }
+
+  /* Client event loop only */
+  unsigned int counter(Counter c) const { return counters[c].load(); }
+  unsigned int loadBucket(int i) const { return loadBuckets[i].load(); }
+  QVector<Record> records() const; /* oldest first, last RECORD_SECONDS only */
+  bool saveRecords(const QString &filename) const;
+  void resetCounters();
+  QString lastDumpFilename() const { return lastDump; }
+
+signals:
+  void xrunDumped(const QString &filename);
+
+private slots:
+  void pollXruns();
+
+private:
+  enum {
+    RING_SIZE = 16384, /* power of two */
+    MAX_DUMPS = 10,
+    DUMP_INTERVAL_MS = 10000,
+  };
+
+  /* Shared between audio thread and client event loop */
+  Record *ring;
+  QAtomicInteger<unsigned int> writeIdx;
+  QAtomicInteger<unsigned int> counters[NUM_COUNTERS];
+  QAtomicInteger<unsigned int> loadBuckets[NUM_LOAD_BUCKETS];
+  QAtomicInteger<unsigned int> xruns;
+  QElapsedTimer timer;
+  int sampleRate;
+
+  /* Audio thread state */
+  Record current;
+  Stage currentStage;
+  qint64 stageStartNs;
+
+  /* Client event loop state */
+  QTimer *pollTimer;
+  unsigned int lastXruns;
+  QElapsedTimer lastDumpTimer;
+  QString lastDump;
+
+  void dumpRecords();
+};
+
+/* Charges audio thread time to a stage while in scope.  telemetry may be NULL. */
+class AudioStage
+{
+public:
+  AudioStage(AudioTelemetry *telemetry_, AudioTelemetry::Stage stage)
+    : telemetry(telemetry_)
+  {
+    if (telemetry) {
+      oldStage = telemetry->switchStage(stage);
+    }
+  }
+
+  ~AudioStage()
+  {
+    if (telemetry) {
+      telemetry->switchStage(oldStage);
+    }
+  }
+
+private:
+  AudioTelemetry *telemetry;
+  AudioTelemetry::Stage oldStage;
+};
+
+#endif /* _AUDIOTELEMETRY_H_ */
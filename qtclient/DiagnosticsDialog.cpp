@@ -0,0 +1,265 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <QDialogButtonBox>
+#include <QFileDialog>
+#include <QFormLayout>
+#include <QGroupBox>
+#include <QHBoxLayout>
+#include <QHeaderView>
+#include <QMessageBox>
+#include <QPushButton>
+#include <QVBoxLayout>
+
+#include "DiagnosticsDialog.h"
+
+DiagnosticsDialog::DiagnosticsDialog(AudioTelemetry *telemetry_,
+                                     NJClient *client_, QWidget *parent)
+  : QDialog(parent), telemetry(telemetry_), client(client_)
+{
+  static const char *counterNames[AudioTelemetry::NUM_COUNTERS] = {
+    QT_TR_NOOP("Callbacks:"),
+    QT_TR_NOOP("Missed deadlines:"),
+    QT_TR_NOOP("Input underflows:"),
+    QT_TR_NOOP("Input overflows:"),
+    QT_TR_NOOP("Output underflows:"),
+    QT_TR_NOOP("Output overflows:"),
+    QT_TR_NOOP("Late effect workers:"),
+    QT_TR_NOOP("Reclaimer overflows:"),
+  };
+
+  QFormLayout *countersLayout = new QFormLayout;
+  for (int i = 0; i < AudioTelemetry::NUM_COUNTERS; i++) {
+    counterLabels[i] = new QLabel;
+    countersLayout->addRow(tr(counterNames[i]), counterLabels[i]);
+  }
+  QGroupBox *countersGroupBox = new QGroupBox(tr("Counters"));
+  countersGroupBox->setLayout(countersLayout);
+
+  QFormLayout *loadLayout = new QFormLayout;
+  for (int i = 0; i < AudioTelemetry::NUM_LOAD_BUCKETS; i++) {
+    loadBars[i] = new QProgressBar;
+    loadBars[i]->setRange(0, 1000);
+    loadBars[i]->setTextVisible(false);
+
+    QString label;
+    if (i == AudioTelemetry::NUM_LOAD_BUCKETS - 1) {
+      label = tr("Over 100%:");
+    } else {
+      label = tr("%1-%2%:").arg(i * 10).arg(i * 10 + 10);
+    }
+    loadLayout->addRow(label, loadBars[i]);
+  }
+  QGroupBox *loadGroupBox = new QGroupBox(tr("Callback duration (of deadline)"));
+  loadGroupBox->setLayout(loadLayout);
+
+  QHBoxLayout *hBoxLayout = new QHBoxLayout;
+  hBoxLayout->addWidget(countersGroupBox);
+  hBoxLayout->addWidget(loadGroupBox);
+
+  stageTable = new QTableWidget(AudioTelemetry::NUM_STAGES +
+                                AudioTelemetry::MAX_WORKERS + 2, 2);
+  stageTable->setHorizontalHeaderLabels(QStringList() << tr("Average (us)")
+                                                      << tr("Maximum (us)"));
+  QStringList rowLabels;
+  for (int i = 0; i < AudioTelemetry::NUM_STAGES; i++) {
+    rowLabels << AudioTelemetry::stageName(i);
+  }
+  for (int i = 0; i < AudioTelemetry::MAX_WORKERS; i++) {
+    rowLabels << tr("effect worker %1").arg(i + 1);
+  }
+  rowLabels << tr("total") << tr("deadline");
+  stageTable->setVerticalHeaderLabels(rowLabels);
+  stageTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
+  stageTable->setSelectionMode(QAbstractItemView::NoSelection);
+  stageTable->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
+
+  channelTable = new QTableWidget(0, 3);
+  channelTable->setHorizontalHeaderLabels(QStringList()
+      << tr("Encoding (% of real-time)")
+      << tr("Prebuffer (ms)")
+      << tr("Underruns"));
+  channelTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
+  channelTable->setSelectionMode(QAbstractItemView::NoSelection);
+  channelTable->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
+
+  lastDumpLabel = new QLabel;
+  lastDumpLabel->setWordWrap(true);
+  lastDumpLabel->setTextInteractionFlags(Qt::TextSelectableByMouse);
+
+  QDialogButtonBox *dialogButtonBox = new QDialogButtonBox(QDialogButtonBox::Close);
+  QPushButton *saveButton = dialogButtonBox->addButton(tr("Save recording..."),
+      QDialogButtonBox::ActionRole);
+  QPushButton *resetButton = dialogButtonBox->addButton(tr("Reset"),
+      QDialogButtonBox::ResetRole);
+  connect(saveButton, SIGNAL(clicked()), this, SLOT(saveRecording()));
+  connect(resetButton, SIGNAL(clicked()), this, SLOT(resetCounters()));
+  connect(dialogButtonBox, SIGNAL(rejected()), this, SLOT(reject()));
+
+  QVBoxLayout *vBoxLayout = new QVBoxLayout;
+  vBoxLayout->addLayout(hBoxLayout);
+  vBoxLayout->addWidget(new QLabel(tr("Processing time over the last %1 seconds:")
+                                   .arg(AudioTelemetry::RECORD_SECONDS)));
+  vBoxLayout->addWidget(stageTable);
+  vBoxLayout->addWidget(new QLabel(tr("Channels:")));
+  vBoxLayout->addWidget(channelTable);
+  vBoxLayout->addWidget(lastDumpLabel);
+  vBoxLayout->addWidget(dialogButtonBox);
+  setLayout(vBoxLayout);
+  setWindowTitle(tr("Audio diagnostics"));
+
+  refreshTimer = new QTimer(this);
+  connect(refreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+  refreshTimer->start(1000);
+
+  refresh();
+}
+
+void DiagnosticsDialog::refresh()
+{
+  if (!isVisible()) {
+    return;
+  }
+
+  for (int i = 0; i < AudioTelemetry::NUM_COUNTERS; i++) {
+    counterLabels[i]->setText(QString::number(
+          telemetry->counter((AudioTelemetry::Counter)i)));
+  }
+
+  unsigned int total = 0;
+  for (int i = 0; i < AudioTelemetry::NUM_LOAD_BUCKETS; i++) {
+    total += telemetry->loadBucket(i);
+  }
+  for (int i = 0; i < AudioTelemetry::NUM_LOAD_BUCKETS; i++) {
+    unsigned int n = telemetry->loadBucket(i);
+    loadBars[i]->setValue(total ? (qint64)n * 1000 / total : 0);
+    loadBars[i]->setToolTip(tr("%n callback(s)", "", n));
+  }
+
+  /* Per-stage statistics over the recording window */
+  enum {
+    ROW_WORKERS = AudioTelemetry::NUM_STAGES,
+    ROW_TOTAL = ROW_WORKERS + AudioTelemetry::MAX_WORKERS,
+    ROW_DEADLINE,
+    NUM_ROWS,
+  };
+  double sum[NUM_ROWS] = {};
+  double max[NUM_ROWS] = {};
+  QVector<AudioTelemetry::Record> records = telemetry->records();
+  int sampleRate = telemetry->getSampleRate();
+
+  for (const AudioTelemetry::Record &rec : records) {
+    double values[NUM_ROWS];
+    for (int i = 0; i < AudioTelemetry::NUM_STAGES; i++) {
+      values[i] = rec.stageNs[i] / 1000.0;
+    }
+    for (int i = 0; i < AudioTelemetry::MAX_WORKERS; i++) {
+      values[ROW_WORKERS + i] = rec.workerNs[i] / 1000.0;
+    }
+    values[ROW_TOTAL] = rec.durationNs / 1000.0;
+    values[ROW_DEADLINE] = sampleRate > 0 ? rec.frames * 1000000.0 / sampleRate : 0;
+
+    for (int i = 0; i < NUM_ROWS; i++) {
+      sum[i] += values[i];
+      if (values[i] > max[i]) {
+        max[i] = values[i];
+      }
+    }
+  }
+
+  for (int i = 0; i < NUM_ROWS; i++) {
+    double avg = records.isEmpty() ? 0 : sum[i] / records.size();
+    stageTable->setItem(i, 0, new QTableWidgetItem(QString::number(avg, 'f', 1)));
+    stageTable->setItem(i, 1, new QTableWidgetItem(QString::number(max[i], 'f', 1)));
+  }
+
+  refreshChannels();
+
+  QString lastDump = telemetry->lastDumpFilename();
+  if (lastDump.isEmpty()) {
+    lastDumpLabel->setText(tr("No xruns recorded."));
+  } else {
+    lastDumpLabel->setText(tr("Last xrun recording: %1").arg(lastDump));
+  }
+}
+
+void DiagnosticsDialog::refreshChannels()
+{
+  QStringList rowLabels;
+  QList<QStringList> rows;
+
+  int ch;
+  for (int i = 0; (ch = client->EnumLocalChannels(i)) != -1; i++) {
+    const char *name = client->GetLocalChannelInfo(ch, NULL, NULL, NULL);
+    rowLabels << QString::fromUtf8(name ? name : "");
+    rows << (QStringList() << QString::number(
+          client->GetLocalChannelEncodeLoad(ch) * 100, 'f', 1)
+                           << QString() << QString());
+  }
+
+  /* Remote channels adapt their prebuffer to the download jitter */
+  for (int useridx = 0; useridx < client->GetNumUsers(); useridx++) {
+    QString user = QString::fromUtf8(client->GetUserState(useridx));
+    int channelidx;
+    for (int i = 0; (channelidx = client->EnumUserChannels(useridx, i)) != -1; i++) {
+      const char *name = client->GetUserChannelState(useridx, channelidx);
+      unsigned int underruns;
+      int prebufferMs = client->GetUserChannelPrebuffer(useridx, channelidx,
+                                                        &underruns);
+      rowLabels << QString("%1: %2").arg(user, QString::fromUtf8(name ? name : ""));
+      rows << (QStringList() << QString()
+                             << (prebufferMs < 0 ? QString() :
+                                 QString::number(prebufferMs))
+                             << QString::number(underruns));
+    }
+  }
+
+  channelTable->setRowCount(rows.size());
+  channelTable->setVerticalHeaderLabels(rowLabels);
+  for (int i = 0; i < rows.size(); i++) {
+    for (int j = 0; j < rows[i].size(); j++) {
+      channelTable->setItem(i, j, new QTableWidgetItem(rows[i][j]));
+    }
+  }
+}
+
+void DiagnosticsDialog::showEvent(QShowEvent *event)
+{
+  QDialog::showEvent(event);
+  refresh();
+}
+
+void DiagnosticsDialog::saveRecording()
+{
+  QString filename = QFileDialog::getSaveFileName(this, tr("Save recording"),
+      "audio-recording.csv", tr("CSV files (*.csv)"));
+  if (filename.isEmpty()) {
+    return;
+  }
+
+  if (!telemetry->saveRecords(filename)) {
+    QMessageBox::critical(this, tr("Failed to save recording"),
+        tr("The recording could not be written to %1.").arg(filename));
+  }
+}
+
+void DiagnosticsDialog::resetCounters()
+{
+  telemetry->resetCounters();
+  refresh();
+}
@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _DIAGNOSTICSDIALOG_H_
+#define _DIAGNOSTICSDIALOG_H_
+
+#include <QDialog>
+#include <QLabel>
+#include <QProgressBar>
+#include <QTableWidget>
+#include <QTimer>
+
+#include "AudioTelemetry.h"
+#include "NJClient.h"
+
+/* Shows audio callback telemetry and per-channel statistics so users can
+ * troubleshoot dropouts
+ */
+class DiagnosticsDialog : public QDialog
+{
+  Q_OBJECT
+
+public:
+  DiagnosticsDialog(AudioTelemetry *telemetry, NJClient *client,
+                    QWidget *parent = 0);
+
+private slots:
+  void refresh();
+  void saveRecording();
+  void resetCounters();
+
+private:
+  AudioTelemetry *telemetry;
+  NJClient *client;
+  QTimer *refreshTimer;
+  QLabel *counterLabels[AudioTelemetry::NUM_COUNTERS];
+  QProgressBar *loadBars[AudioTelemetry::NUM_LOAD_BUCKETS];
+  QTableWidget *stageTable;
+  QTableWidget *channelTable;
+  QLabel *lastDumpLabel;
+
+  void refreshChannels();
+  void showEvent(QShowEvent *event) override;
+};
+
+#endif /* _DIAGNOSTICSDIALOG_H_ */
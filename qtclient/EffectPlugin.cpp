@@ -19,7 +19,7 @@
 #include "EffectPlugin.h"
 
 EffectPlugin::EffectPlugin()
-  : wetDryMix(1), receiveMidi(true), numOutputEvents(0)
+  : wetDryMix(1), receiveMidi(true), timeLeftNs(0), numOutputEvents(0)
 {
 }
 
@@ -43,6 +43,11 @@ void EffectPlugin::setReceiveMidi(bool receive)
   receiveMidi = receive;
 }
 
+void EffectPlugin::setTimeLeft(qint64 ns)
+{
+  timeLeftNs = ns;
+}
+
 void EffectPlugin::processOutputEvents(std::function<void (const PmEvent *event)> fn)
 {
   if (numOutputEvents == 0) {
@@ -95,6 +95,11 @@ public:
   virtual void processEvents(VstEvents *vstEvents) = 0;
   virtual void process(float **inbuf, float **outbuf, int ns) = 0;
 
+  /* Time left in the audio callback for the next process() call, for plugins
+   * that wait on something else.  Set by EffectProcessor.
+   */
+  void setTimeLeft(qint64 ns);
+
 signals:
   void onResizeEditor(int width, int height);
   void onIdle();
@@ -107,6 +112,8 @@ private:
   bool receiveMidi;
 
 protected:
+  qint64 timeLeftNs;
+
   /* MIDI output events are stored in a buffer until they are written out by
    * the EffectProcessor. This allows the plugin to add events from any thread.
    */
@@ -16,24 +16,75 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#include <string.h>
 #include "EffectProcessor.h"
 
-void vstProcessorCallback(float *buf, int ns, void *inst)
+enum {
+  SCRATCH_ALIGN = 64, /* bytes, enough for any SIMD width we build for */
+  MAX_CHANNELS = 2,   /* of a local channel */
+};
+
+/* What the audio thread runs, see EffectProcessor::publishChain() */
+struct EffectChain
+{
+  unsigned int generation;
+  unsigned int retiredBy; /* generation that replaced this chain */
+  int numPlugins;
+  EffectPlugin **plugins;
+  QList<EffectPlugin*> orphans; /* deleted along with the chain */
+
+  /* Plugins may have differing numbers of inputs/outputs, we keep around
+   * scratch buffers that we fill with silence.  They are sized for the
+   * largest block the audio stream delivers and only the audio thread
+   * touches them once the chain has been published.
+   */
+  float *scratch;       /* one aligned allocation */
+  float **scratchBufs;  /* 2 * maxInputsOutputs pointers into scratch */
+  float **inputBufs;    /* maxInputsOutputs pointers handed to plugins */
+  float *downmix;       /* input of a mono plugin in a stereo chain */
+  int maxInputsOutputs;
+  int blockSize;
+};
+
+/* out = in * dry + out * wet
+ *
+ * Kept free of aliasing and branches so the compiler vectorizes it.
+ */
+static void mixWetDry(float * __restrict out, const float * __restrict in,
+                      float dry, float wet, int ns)
+{
+  for (int i = 0; i < ns; i++) {
+    out[i] = in[i] * dry + out[i] * wet;
+  }
+}
+
+static void scale(float *buf, float gain, int ns)
+{
+  for (int i = 0; i < ns; i++) {
+    buf[i] *= gain;
+  }
+}
+
+void vstProcessorCallback(float **bufs, int nch, int ns, qint64 timeLeftNs,
+                          void *inst)
 {
   EffectProcessor *this_ = static_cast<EffectProcessor*>(inst);
-  this_->process(buf, ns);
+  this_->process(bufs, nch, ns, timeLeftNs);
 }
 
 EffectProcessor::EffectProcessor(PortMidiStreamer *midiStreamer_,
                                  QObject *parent)
-  : QObject(parent), client(NULL), localChannel(-1), blockSize(512),
-    scratchBufs(NULL), maxInputsOutputs(0), midiStreamer(midiStreamer_)
+  : QObject(parent), client(NULL), chainBusy(0), chainAck(0),
+    chainGeneration(0), localChannel(-1), blockSize(512), deadline(0),
+    midiStreamer(midiStreamer_)
 {
+  timer.start();
   connect(&idleTimer, SIGNAL(timeout()),
           this, SLOT(idleTimerTick()));
 
   memset(vstEventBuffer, 0, sizeof vstEventBuffer);
   allocVstEvents();
+  publishChain();
 }
 
 EffectProcessor::~EffectProcessor()
@@ -44,25 +95,50 @@ EffectProcessor::~EffectProcessor()
     removePlugin(0);
   }
 
-  deleteScratchBufs(scratchBufs, 2 * maxInputsOutputs);
+  reclaimChains(true);
+  deleteChain(chain.load());
   free(vstEvents);
 }
 
-float **EffectProcessor::newScratchBufs(int nbufs)
+/* Allocates scratch buffers for the chain's plugins up front so process()
+ * never has to
+ */
+void EffectProcessor::allocScratch(EffectChain *ch)
 {
-  float **bufs = new float*[nbufs];
+  int nbufs = 2 * ch->maxInputsOutputs;
+  size_t stride = (size_t)ch->blockSize;
+
+  /* Keep every buffer aligned, not just the first one */
+  stride = (stride + SCRATCH_ALIGN / sizeof(float) - 1) &
+           ~(SCRATCH_ALIGN / sizeof(float) - 1);
+
+  ch->scratch = NULL;
+  ch->scratchBufs = new float*[qMax(nbufs, 1)];
+  ch->inputBufs = new float*[qMax(ch->maxInputsOutputs, 1)];
+  ch->downmix = NULL;
+  if (nbufs == 0) {
+    return;
+  }
+
+  /* One more for the downmix */
+  ch->scratch = static_cast<float*>(qMallocAligned((nbufs + 1) * stride *
+                                                   sizeof(float),
+                                                   SCRATCH_ALIGN));
+  memset(ch->scratch, 0, (nbufs + 1) * stride * sizeof(float));
   for (int i = 0; i < nbufs; i++) {
-    bufs[i] = new float[blockSize];
+    ch->scratchBufs[i] = ch->scratch + i * stride;
   }
-  return bufs;
+  ch->downmix = ch->scratch + nbufs * stride;
 }
 
-void EffectProcessor::deleteScratchBufs(float **bufs, int nbufs)
+void EffectProcessor::deleteChain(EffectChain *ch)
 {
-  for (int i = 0; i < nbufs; i++) {
-    delete [] bufs[i];
-  }
-  delete [] bufs;
+  qDeleteAll(ch->orphans);
+  qFreeAligned(ch->scratch);
+  delete [] ch->scratchBufs;
+  delete [] ch->inputBufs;
+  delete [] ch->plugins;
+  delete ch;
 }
 
 void EffectProcessor::allocVstEvents()
@@ -81,55 +157,113 @@ void EffectProcessor::allocVstEvents()
   }
 }
 
-bool EffectProcessor::insertPlugin(int idx, EffectPlugin *plugin)
+/* Hand the current plugin list to the audio thread.  The previous chain stays
+ * around until reclaimChains() finds the audio thread has moved past it.
+ */
+void EffectProcessor::publishChain()
 {
-  QMutexLocker locker(&pluginsLock);
+  EffectChain *next = new EffectChain;
+  next->generation = ++chainGeneration;
+  next->retiredBy = 0;
+  next->numPlugins = plugins.size();
+  next->plugins = new EffectPlugin*[qMax(next->numPlugins, 1)];
+  next->maxInputsOutputs = 0;
+  for (int i = 0; i < next->numPlugins; i++) {
+    EffectPlugin *plugin = plugins.at(i);
+    next->plugins[i] = plugin;
+    next->maxInputsOutputs = qMax(qMax(plugin->numInputs(),
+                                       plugin->numOutputs()),
+                                  next->maxInputsOutputs);
+  }
 
-  // TODO check compatible with inputs/outputs of other plugins
+  /* Stereo channels need room even when all plugins are mono */
+  if (next->numPlugins > 0) {
+    next->maxInputsOutputs = qMax(next->maxInputsOutputs, (int)MAX_CHANNELS);
+  }
+  next->blockSize = blockSize;
+  allocScratch(next);
+
+  EffectChain *prev = chain.fetchAndStoreOrdered(next);
+  if (prev) {
+    prev->retiredBy = next->generation;
+    prev->orphans = orphans;
+    orphans.clear();
+    retiredChains.append(prev);
+  }
 
-  plugin->setParent(this);
-  plugins.insert(idx, plugin);
+  reclaimChains(!attached());
+  updateIdleTimer();
+}
+
+/* Free replaced chains and removed plugins once the audio thread has moved
+ * past them.  Use force only when process() is known not to run.
+ */
+void EffectProcessor::reclaimChains(bool force)
+{
+  /* process() sets busy before loading the chain, so when it is not busy the
+   * next call will see the latest chain
+   */
+  bool idle = force || !chainBusy.fetchAndAddOrdered(0);
+  unsigned int ack = chainAck.loadAcquire();
+
+  for (int i = 0; i < retiredChains.size(); i++) {
+    EffectChain *old = retiredChains.at(i);
+    if (!idle && (int)(ack - old->retiredBy) < 0) {
+      continue;
+    }
 
-  /* We may need to grow scratch buffers */
-  if (plugin->numInputs() > maxInputsOutputs ||
-      plugin->numOutputs() > maxInputsOutputs) {
-    deleteScratchBufs(scratchBufs, 2 * maxInputsOutputs);
-    maxInputsOutputs = qMax(qMax(plugin->numInputs(), plugin->numOutputs()),
-                            maxInputsOutputs);
-    scratchBufs = newScratchBufs(2 * maxInputsOutputs);
+    deleteChain(old);
+    retiredChains.removeAt(i--);
   }
+}
 
-  if (numPlugins() == 1) {
-    idleTimer.setSingleShot(false);
-    idleTimer.start(100 /* ms */);
+/* The idle timer also finishes reclaiming chains after the last plugin is
+ * removed
+ */
+void EffectProcessor::updateIdleTimer()
+{
+  if (numPlugins() > 0 || !retiredChains.isEmpty()) {
+    if (!idleTimer.isActive()) {
+      idleTimer.setSingleShot(false);
+      idleTimer.start(100 /* ms */);
+    }
+  } else {
+    idleTimer.stop();
   }
+}
+
+bool EffectProcessor::insertPlugin(int idx, EffectPlugin *plugin)
+{
+  // TODO check compatible with inputs/outputs of other plugins
+
+  plugin->setParent(this);
+  plugins.insert(idx, plugin);
 
+  /* Activate before the audio thread can see the plugin */
   if (attached()) {
     activatePlugin(plugin);
   }
+
+  publishChain();
   return true;
 }
 
 bool EffectProcessor::removePlugin(int idx)
 {
-  QMutexLocker locker(&pluginsLock);
   EffectPlugin *plugin = getPlugin(idx);
   if (!plugin) {
     return false;
   }
-  delete plugin;
   plugins.removeAt(idx);
 
-  if (numPlugins() == 0) {
-    idleTimer.stop();
-  }
+  /* The audio thread may still be running the plugin */
+  orphans.append(plugin);
+  publishChain();
   return true;
 }
 
 void EffectProcessor::moveUp(int idx)
 {
-  QMutexLocker locker(&pluginsLock);
-
   if (idx <= 0 || idx >= numPlugins()) {
     return;
   }
@@ -139,12 +273,11 @@ void EffectProcessor::moveUp(int idx)
 #else
   plugins.swap(idx, idx - 1);
 #endif
+  publishChain();
 }
 
 void EffectProcessor::moveDown(int idx)
 {
-  QMutexLocker locker(&pluginsLock);
-
   if (idx < 0 || idx + 1 >= numPlugins()) {
     return;
   }
@@ -154,6 +287,7 @@ void EffectProcessor::moveDown(int idx)
 #else
   plugins.swap(idx, idx + 1);
 #endif
+  publishChain();
 }
 
 int EffectProcessor::numPlugins()
@@ -183,11 +317,18 @@ void EffectProcessor::attach(NJClient *client_, int ch)
   client = client_;
   lastTempo = client->GetActualBPM();
 
+  /* Size scratch buffers for the stream before process() can be called */
+  if (client->GetBlockSize() > 0) {
+    blockSize = client->GetBlockSize();
+  }
+
   EffectPlugin *plugin;
   foreach (plugin, plugins) {
     activatePlugin(plugin);
   }
 
+  publishChain();
+
   localChannel = ch;
   client->SetLocalChannelProcessor(ch, vstProcessorCallback, this);
 }
@@ -207,6 +348,10 @@ void EffectProcessor::detach()
   }
 
   client = NULL;
+
+  /* process() can no longer be called */
+  reclaimChains(true);
+  updateIdleTimer();
 }
 
 bool EffectProcessor::attached()
@@ -222,6 +367,7 @@ void EffectProcessor::fillVstEvents()
   size_t i;
 
   for (i = 0;
+       midiStreamer &&
        i < sizeof(vstEventBuffer) / sizeof(vstEventBuffer[0]) &&
        midiStreamer->read(&pmEvent);
        i++) {
@@ -244,61 +390,141 @@ void EffectProcessor::fillVstEvents()
   vstEvents->numEvents = i;
 }
 
-void EffectProcessor::process(float *buf, int ns)
+void EffectProcessor::process(float **bufs, int nch, int ns, qint64 timeLeftNs)
 {
-  // Skip if no processing is necessary.  The variable-length array below
-  // requires a non-zero length.
-  if (maxInputsOutputs == 0) {
+  /* Being busy first tells reclaimChains() that older chains may still be in
+   * use
+   */
+  chainBusy.fetchAndStoreOrdered(1);
+  EffectChain *ch = chain.loadAcquire();
+  chainAck.storeRelease(ch->generation);
+
+  // Skip if no processing is necessary
+  if (ch->maxInputsOutputs == 0) {
+    chainBusy.fetchAndStoreOrdered(0);
     return;
   }
 
-  QMutexLocker locker(&pluginsLock);
   int tempo = client->GetActualBPM();
 
   if (tempo != lastTempo) {
-    foreach (EffectPlugin *plugin, plugins) {
-      plugin->setTempo(tempo);
+    for (int i = 0; i < ch->numPlugins; i++) {
+      ch->plugins[i]->setTempo(tempo);
     }
     lastTempo = tempo;
   }
 
   fillVstEvents();
-
-  if ((size_t)ns > blockSize) {
-    deleteScratchBufs(scratchBufs, 2 * maxInputsOutputs);
-    blockSize = ns;
-    scratchBufs = newScratchBufs(2 * maxInputsOutputs);
+  deadline = timer.nsecsElapsed() + timeLeftNs;
+
+  /* Scratch buffers only hold blockSize samples.  NJClient never passes more
+   * than that, but split larger buffers rather than reallocate here.
+   */
+  nch = qMin(nch, (int)MAX_CHANNELS);
+  for (int offs = 0; offs < ns; offs += ch->blockSize) {
+    float *block[MAX_CHANNELS];
+    for (int i = 0; i < nch; i++) {
+      block[i] = bufs[i] + offs;
+    }
+    processBlock(ch, block, nch, qMin(ns - offs, ch->blockSize), offs == 0);
   }
 
-  float *inputs[maxInputsOutputs];
-  float **a = inputs;
-  float **b = &scratchBufs[maxInputsOutputs];
+  chainBusy.fetchAndStoreOrdered(0);
+}
 
-  memcpy(inputs, scratchBufs, sizeof(float*) * maxInputsOutputs);
-  a[0] = buf; // TODO real stereo
-  for (int i = 1; i < maxInputsOutputs; i++) {
-    memset(a[i], 0, sizeof(float) * ns);
-  }
-  for (int i = 0; i < maxInputsOutputs; i++) {
-    memset(b[i], 0, sizeof(float) * ns);
+/* Runs the chain over a mono or stereo block.  Channels are routed by each
+ * plugin's number of inputs and outputs: a mono signal is upmixed when it
+ * reaches the first plugin with stereo inputs, and a mono plugin in a stereo
+ * chain processes (L+R)/2 and its output goes to both sides.
+ */
+void EffectProcessor::processBlock(EffectChain *ch, float **bufs, int nch,
+                                   int ns, bool sendEvents)
+{
+  float **a = ch->inputBufs;
+  float **b = &ch->scratchBufs[ch->maxInputsOutputs];
+
+  memcpy(a, ch->scratchBufs, sizeof(float*) * ch->maxInputsOutputs);
+  for (int i = 0; i < nch; i++) {
+    a[i] = bufs[i];
   }
 
-  foreach (EffectPlugin *plugin, plugins) {
-    if (plugin->getReceiveMidi()) {
+  /* Channels of a beyond nvalid are treated as silence.  They are only
+   * cleared when a plugin is about to read them.
+   */
+  int nvalid = nch;
+
+  for (int p = 0; p < ch->numPlugins; p++) {
+    EffectPlugin *plugin = ch->plugins[p];
+    int nin = plugin->numInputs();
+    int nout = plugin->numOutputs();
+
+    if (nvalid == 1 && nin > 1) {
+      memcpy(a[1], a[0], sizeof(float) * ns);
+      nvalid = 2;
+    }
+    for (int i = nvalid; i < nin; i++) {
+      memset(a[i], 0, sizeof(float) * ns);
+    }
+    nvalid = qMax(nvalid, nin);
+
+    /* a[0] stays the left channel for the wet/dry mix below */
+    float *left = a[0];
+    if (nin == 1 && nvalid > 1) {
+      for (int j = 0; j < ns; j++) {
+        ch->downmix[j] = (a[0][j] + a[1][j]) * 0.5f;
+      }
+      a[0] = ch->downmix;
+    }
+
+    if (sendEvents && plugin->getReceiveMidi()) {
       plugin->processEvents(vstEvents);
     }
+    plugin->setTimeLeft(deadline - timer.nsecsElapsed());
     plugin->process(a, b, ns);
+    a[0] = left;
 
     plugin->processOutputEvents([=](const PmEvent *event) {
-        midiStreamer->write(event);
+        if (midiStreamer) {
+          midiStreamer->write(event);
+        }
     });
 
-    float dry = qMin(2 * (1.0f - plugin->getWetDryMix()), 1.0f);
-    float wet = qMin(2 * plugin->getWetDryMix(), 1.0f);
-    for (int i = 0; i < maxInputsOutputs; i++) {
-      for (int j = 0; j < ns; j++) {
-        b[i][j] = a[i][j] * dry + b[i][j] * wet;
+    float mix = plugin->getWetDryMix();
+    float dry = qMin(2 * (1.0f - mix), 1.0f);
+    float wet = qMin(2 * mix, 1.0f);
+
+    /* Fully dry, the plugin only ran to keep its state going */
+    if (mix == 0.0f) {
+      continue;
+    }
+
+    /* Fully wet needs no mixing, otherwise blend channels both sides have.
+     * Channels the plugin does not output get its last output channel, as
+     * when fully wet, so a mono plugin is mixed into both sides of a stereo
+     * chain.  Those go first while b still holds the unmixed output.
+     */
+    if (mix != 1.0f) {
+      for (int i = nout; i < nvalid; i++) {
+        if (nout > 0) {
+          memcpy(b[i], b[nout - 1], sizeof(float) * ns);
+          mixWetDry(b[i], a[i], dry, wet, ns);
+        } else {
+          memcpy(b[i], a[i], sizeof(float) * ns);
+          if (dry != 1.0f) {
+            scale(b[i], dry, ns);
+          }
+        }
+      }
+      for (int i = 0; i < nout; i++) {
+        if (i < nvalid) {
+          mixWetDry(b[i], a[i], dry, wet, ns);
+        } else if (wet != 1.0f) {
+          scale(b[i], wet, ns);
+        }
       }
+      nvalid = qMax(nout, nvalid);
+    } else {
+      nvalid = nout;
     }
 
     float **swap = a;
@@ -306,9 +532,24 @@ void EffectProcessor::process(float *buf, int ns)
     b = swap;
   }
 
-  /* Copy final result back into buf */
-  if (a[0] != buf) {
-    memcpy(buf, a[0], sizeof(float) * ns);
+  /* Copy final result back into bufs, a mono channel gets a stereo result
+   * folded down and a stereo channel gets a mono result on both sides
+   */
+  if (nvalid == 0) {
+    for (int i = 0; i < nch; i++) {
+      memset(bufs[i], 0, sizeof(float) * ns);
+    }
+  } else if (nch == 1 && nvalid > 1) {
+    for (int j = 0; j < ns; j++) {
+      bufs[0][j] = (a[0][j] + a[1][j]) * 0.5f;
+    }
+  } else {
+    for (int i = 0; i < nch; i++) {
+      float *src = a[qMin(i, nvalid - 1)];
+      if (src != bufs[i]) {
+        memcpy(bufs[i], src, sizeof(float) * ns);
+      }
+    }
   }
 }
 
@@ -316,6 +557,11 @@ void EffectProcessor::idleTimerTick()
 {
   EffectPlugin *plugin;
 
+  reclaimChains();
+  if (numPlugins() == 0) {
+    updateIdleTimer();
+  }
+
   foreach (plugin, plugins) {
     plugin->idle();
   }
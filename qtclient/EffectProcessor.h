@@ -19,18 +19,25 @@
 #ifndef _EFFECTPROCESSOR_H_
 #define _EFFECTPROCESSOR_H_
 
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QElapsedTimer>
 #include <QList>
 #include <QTimer>
-#include <QMutex>
 #include "PortMidiStreamer.h"
 #include "NJClient.h"
 #include "EffectPlugin.h"
 
+struct EffectChain;
+
 class EffectProcessor : public QObject
 {
   Q_OBJECT
 
 public:
+  /* midiStreamer may be NULL for no MIDI input and output.  Only one
+   * processor may use it since processors run in parallel.
+   */
   EffectProcessor(PortMidiStreamer *midiStreamer,
                   QObject *parent = NULL);
   ~EffectProcessor();
@@ -45,7 +52,7 @@ public:
   void attach(NJClient *client, int ch);
   void detach();
 
-  void process(float *buf, int ns);
+  void process(float **bufs, int nch, int ns, qint64 timeLeftNs);
 
 private slots:
   void idleTimerTick();
@@ -53,37 +60,43 @@ private slots:
 private:
   NJClient *client;
 
-  /* The plugins are accessed from the GUI and audio threads.  The audio thread
-   * only traverses the list.  The audio thread may also modify the list.  This
-   * lock protects the audio thread against GUI thread list modifications - it
-   * is not used for read accesses from the GUI thread since they do not
-   * interfere with audio thread read accesses.
+  /* The GUI thread edits the plugin list and publishes an immutable copy for
+   * the audio thread after every change.  Replaced chains are kept until the
+   * audio thread has moved past them, along with the plugins that were
+   * removed, so the audio thread never waits for the GUI thread and nothing is
+   * freed on it.
    */
-  QMutex pluginsLock;
   QList<EffectPlugin*> plugins;
+  QAtomicPointer<EffectChain> chain;
+  QAtomicInteger<int> chainBusy;         /* audio thread is in process() */
+  QAtomicInteger<unsigned int> chainAck; /* generation the audio thread uses */
+  unsigned int chainGeneration;
+  QList<EffectChain*> retiredChains;
+  QList<EffectPlugin*> orphans; /* removed since the last publishChain() */
 
   QTimer idleTimer;
   int localChannel;
 
-  size_t blockSize;
+  int blockSize; /* largest ns passed to process() */
+  QElapsedTimer timer;
+  qint64 deadline; /* of the current process() call, on timer */
   int lastTempo; /* used for signalling BPM changes */
 
-  /* Plugins may have differing numbers of inputs/outputs, we keep around
-   * scratch buffers that we fill with silence.
-   */
-  float **scratchBufs;
-  int maxInputsOutputs;
-
   PortMidiStreamer *midiStreamer;
   VstEvent vstEventBuffer[128];
   VstEvents *vstEvents;
 
   bool attached();
-  float **newScratchBufs(int nbufs);
-  void deleteScratchBufs(float **bufs, int nbufs);
+  void allocScratch(EffectChain *ch);
+  void deleteChain(EffectChain *ch);
+  void publishChain();
+  void reclaimChains(bool force = false);
+  void updateIdleTimer();
   void allocVstEvents();
   void fillVstEvents();
   void activatePlugin(EffectPlugin *plugin);
+  void processBlock(EffectChain *ch, float **bufs, int nch, int ns,
+                    bool sendEvents);
 };
 
 #endif /* _EFFECTPROCESSOR_H_ */
@@ -18,17 +18,23 @@
 
 #include <QVBoxLayout>
 #include <QHBoxLayout>
+#include <QLabel>
 #include <QDialogButtonBox>
 #include "qtclient.h"
 #ifdef Q_OS_MAC
 #include "AudioUnitPlugin.h"
 #endif
 #include "VSTPlugin.h"
+#ifdef Q_OS_LINUX
+#include "SandboxPlugin.h"
+#endif
 #include "EffectPluginRoutingDialog.h"
 #include "EffectSettingsPage.h"
 
-EffectSettingsPage::EffectSettingsPage(EffectProcessor *processor_, QWidget *parent)
-  : QWidget(parent), processor(processor_), addPluginDialog(this)
+EffectSettingsPage::EffectSettingsPage(const QList<EffectProcessor*> &processors_,
+                                       QWidget *parent)
+  : QWidget(parent), processors(processors_), processor(processors_.first()),
+    addPluginDialog(this)
 {
   int i;
   QString defaultSearchPath;
@@ -52,6 +58,24 @@ EffectSettingsPage::EffectSettingsPage(EffectProcessor *processor_, QWidget *par
   QVBoxLayout *vBoxLayout = new QVBoxLayout;
   QHBoxLayout *hBoxLayout = new QHBoxLayout;
 
+  /* Only the first channel is used unless inputs are sent as separate
+   * channels.  Its plugins get MIDI input.
+   */
+  QHBoxLayout *channelLayout = new QHBoxLayout;
+  channelList = new QComboBox;
+  channelList->setEditable(false);
+  for (i = 0; i < processors.size(); i++) {
+    channelList->addItem(tr("Channel %1").arg(i + 1));
+  }
+  connect(channelList, SIGNAL(currentIndexChanged(int)),
+          this, SLOT(channelChanged(int)));
+  QLabel *channelLabel = new QLabel(tr("&Local channel:"));
+  channelLabel->setBuddy(channelList);
+  channelLayout->addWidget(channelLabel);
+  channelLayout->addWidget(channelList);
+  channelLayout->addStretch(1);
+  vBoxLayout->addLayout(channelLayout);
+
   pluginList = new QListWidget;
   connect(pluginList, SIGNAL(itemSelectionChanged()),
           this, SLOT(itemSelectionChanged()));
@@ -90,10 +114,34 @@ EffectSettingsPage::EffectSettingsPage(EffectProcessor *processor_, QWidget *par
 
   vBoxLayout->addLayout(hBoxLayout);
 
+#ifdef Q_OS_LINUX /* see sandboxWait() */
+  sandboxCheckBox = new QCheckBox(tr("Run new VST plugins in a separate process"));
+  sandboxCheckBox->setToolTip(tr("A plugin that crashes or hangs cannot take "
+                                 "down the jam session, at the cost of a "
+                                 "little processing time."));
+  sandboxCheckBox->setChecked(settings->value("vst/sandbox", false).toBool());
+  vBoxLayout->addWidget(sandboxCheckBox);
+#endif
+
   setLayout(vBoxLayout);
   itemSelectionChanged();
 }
 
+void EffectSettingsPage::channelChanged(int index)
+{
+  if (index < 0) {
+    return;
+  }
+
+  processor = processors.at(index);
+
+  pluginList->clear();
+  for (int i = 0; i < processor->numPlugins(); i++) {
+    pluginList->addItem(processor->getPlugin(i)->getName());
+  }
+  itemSelectionChanged();
+}
+
 void EffectSettingsPage::itemSelectionChanged()
 {
   bool selected = pluginList->currentItem();
@@ -112,11 +160,22 @@ void EffectSettingsPage::addPlugin()
   }
   settings->setValue("vst/searchPath", addPluginDialog.searchPath());
   settings->setValue("vst/plugins", addPluginDialog.plugins());
+#ifdef Q_OS_LINUX
+  settings->setValue("vst/sandbox", sandboxCheckBox->isChecked());
+#endif
 
   EffectPlugin *plugin = NULL;
   QString name = addPluginDialog.selectedPlugin();
   if (name.endsWith(" [VST]")) {
-    plugin = new VSTPlugin(name.left(name.size() - QString(" [VST]").size()));
+    QString filename = name.left(name.size() - QString(" [VST]").size());
+#ifdef Q_OS_LINUX
+    if (sandboxCheckBox->isChecked()) {
+      plugin = new SandboxPlugin(filename);
+    }
+#endif
+    if (!plugin) {
+      plugin = new VSTPlugin(filename);
+    }
   }
 #ifdef Q_OS_MAC
   if (name.endsWith(" [AudioUnit]")) {
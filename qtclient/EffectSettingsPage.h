@@ -20,6 +20,8 @@
 #define _EFFECTSETTINGSPAGE_H_
 
 #include <QWidget>
+#include <QCheckBox>
+#include <QComboBox>
 #include <QListWidget>
 #include <QPushButton>
 #include "EffectProcessor.h"
@@ -30,9 +32,12 @@ class EffectSettingsPage : public QWidget
   Q_OBJECT
 
 public:
-  EffectSettingsPage(EffectProcessor *processor, QWidget *parent = NULL);
+  /* One processor per local channel */
+  EffectSettingsPage(const QList<EffectProcessor*> &processors,
+                     QWidget *parent = NULL);
 
 private slots:
+  void channelChanged(int index);
   void itemSelectionChanged();
   void addPlugin();
   void removePlugin();
@@ -42,14 +47,19 @@ private slots:
   void routeClicked();
 
 private:
-  EffectProcessor *processor;
+  QList<EffectProcessor*> processors;
+  EffectProcessor *processor; /* of the selected channel */
   AddEffectPluginDialog addPluginDialog;
+  QComboBox *channelList;
   QListWidget *pluginList;
   QPushButton *removeButton;
   QPushButton *upButton;
   QPushButton *downButton;
   QPushButton *editButton;
   QPushButton *routeButton;
+#ifdef Q_OS_LINUX
+  QCheckBox *sandboxCheckBox;
+#endif
 };
 
 #endif /* _EFFECTSETTINGSPAGE_H_ */
@@ -0,0 +1,276 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+#include <QThread>
+
+#include "EffectWorkers.h"
+#include "RTSafety.h"
+
+class EffectWorker : public QThread
+{
+public:
+  EffectWorker(EffectWorkers *pool_, int idx_)
+    : pool(pool_), idx(idx_)
+  {
+  }
+
+protected:
+  void run()
+  {
+    pool->workerLoop(idx);
+  }
+
+private:
+  EffectWorkers *pool;
+  int idx;
+};
+
+EffectWorkers::EffectWorkers()
+  : stopping(0), numSlots(0), joinWaiting(0), serialCallbacks(0)
+{
+  slotBufs = static_cast<float*>(qMallocAligned(MAX_JOBS * 2 * MAX_BLOCK *
+                                                sizeof(float), 64));
+  for (int i = 0; i < MAX_JOBS; i++) {
+    slots[i].bufs[0] = slotBufs + (i * 2) * MAX_BLOCK;
+    slots[i].bufs[1] = slotBufs + (i * 2 + 1) * MAX_BLOCK;
+    slots[i].claimed.store(1);
+    slots[i].done.store(1);
+    slots[i].abandoned = false;
+  }
+  for (int i = 0; i < MAX_WORKERS; i++) {
+    busyNs[i].store(0);
+    lastWorkerNs[i] = 0;
+  }
+  timer.start();
+
+  /* The audio thread takes jobs too */
+  nworkers = qBound(0, QThread::idealThreadCount() - 1, (int)MAX_WORKERS);
+  for (int i = 0; i < nworkers; i++) {
+    workers[i] = new EffectWorker(this, i);
+    workers[i]->start(QThread::TimeCriticalPriority);
+  }
+}
+
+EffectWorkers::~EffectWorkers()
+{
+  stopping.storeRelease(1);
+  wake.release(nworkers);
+  for (int i = 0; i < nworkers; i++) {
+    workers[i]->wait();
+    delete workers[i];
+  }
+  qFreeAligned(slotBufs);
+}
+
+/* Claims and runs one job of the current run, worker is -1 for the audio
+ * thread.  Returns false if there was nothing left to claim.
+ */
+bool EffectWorkers::runOne(int worker)
+{
+  int n = numSlots.loadAcquire();
+
+  for (int i = 0; i < n; i++) {
+    Slot *slot = &slots[i];
+    if (!slot->claimed.testAndSetAcquire(0, 1)) {
+      continue;
+    }
+
+    qint64 start = timer.nsecsElapsed();
+    slot->job.fn(slot->bufs, slot->job.nch, slot->ns,
+                 slot->deadline - start, slot->job.inst);
+
+    /* Account before signalling so run() sees the time */
+    if (worker >= 0) {
+      busyNs[worker].fetchAndAddRelaxed(timer.nsecsElapsed() - start);
+    }
+
+    /* Both sides use ordered operations so either this sees joinWaiting or
+     * run() sees the job done before it sleeps
+     */
+    slot->done.fetchAndStoreOrdered(1);
+    if (joinWaiting.fetchAndAddOrdered(0)) {
+      joined.release();
+    }
+    return true;
+  }
+  return false;
+}
+
+void EffectWorkers::workerLoop(int worker)
+{
+  for (;;) {
+    wake.acquire();
+    if (stopping.loadAcquire()) {
+      return;
+    }
+
+    RTSAFETY_AUDIO_THREAD();
+    while (runOne(worker)) {
+    }
+  }
+}
+
+/* Whether an abandoned job still runs inst, which can't be run again until
+ * it returns
+ */
+bool EffectWorkers::isBusy(void *inst) const
+{
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (slots[i].abandoned && slots[i].job.inst == inst) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool EffectWorkers::allDone(const int *used, int n)
+{
+  for (int i = 0; i < n; i++) {
+    if (!slots[used[i]].done.fetchAndAddOrdered(0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void silence(const EffectWorkers::Job &job, int ns)
+{
+  for (int c = 0; c < job.nch; c++) {
+    memset(job.bufs[c], 0, sizeof(float) * ns);
+  }
+}
+
+bool EffectWorkers::run(const Job *jobs, int njobs, int ns, qint64 deadlineNs)
+{
+  for (int i = 0; i < nworkers; i++) {
+    lastWorkerNs[i] = 0;
+  }
+
+  qint64 start = timer.nsecsElapsed();
+  qint64 deadline = start + deadlineNs;
+  qint64 limit = start + deadlineNs * ABANDON_PCT / 100;
+
+  /* Abandoned jobs that have returned free their slot and inst again */
+  int nfree = 0;
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (slots[i].abandoned && slots[i].done.loadAcquire()) {
+      slots[i].abandoned = false;
+    }
+    if (!slots[i].abandoned) {
+      nfree++;
+    }
+  }
+
+  bool serial = njobs < 2 || njobs > nfree || nworkers == 0 ||
+                ns > MAX_BLOCK;
+  if (serialCallbacks > 0) {
+    serialCallbacks--;
+    serial = true;
+  }
+  if (serial) {
+    for (int i = 0; i < njobs; i++) {
+      Job job = jobs[i];
+      if (isBusy(job.inst)) {
+        silence(job, ns);
+        continue;
+      }
+      job.fn(job.bufs, job.nch, ns, deadline - timer.nsecsElapsed(), job.inst);
+    }
+    return true;
+  }
+
+  /* Every free slot is claimed since the last run finished, so workers that
+   * wake up late can't see a job until it has been filled in
+   */
+  int used[MAX_JOBS];
+  int jobOf[MAX_JOBS];
+  int nused = 0;
+  int next = 0;
+  for (int i = 0; i < njobs; i++) {
+    if (isBusy(jobs[i].inst)) {
+      silence(jobs[i], ns);
+      continue;
+    }
+    while (slots[next].abandoned) {
+      next++;
+    }
+
+    Slot *slot = &slots[next];
+    slot->job = jobs[i];
+    for (int c = 0; c < jobs[i].nch; c++) {
+      memcpy(slot->bufs[c], jobs[i].bufs[c], sizeof(float) * ns);
+    }
+    slot->ns = ns;
+    slot->deadline = deadline;
+    slot->done.store(0);
+    slot->claimed.storeRelease(0);
+    used[nused] = next;
+    jobOf[nused++] = i;
+    next++;
+  }
+  numSlots.storeRelease(next);
+  wake.release(qMin(nused - 1, nworkers));
+
+  while (runOne(-1)) {
+  }
+
+  bool late = false;
+  while (!allDone(used, nused)) {
+    if (timer.nsecsElapsed() > deadline) {
+      late = true;
+      break;
+    }
+  }
+
+  if (late) {
+    /* Releases left over from earlier jobs only cost another check */
+    joinWaiting.fetchAndStoreOrdered(1);
+    for (;;) {
+      if (allDone(used, nused)) {
+        break;
+      }
+      qint64 left = limit - timer.nsecsElapsed();
+      if (left <= 0) {
+        break;
+      }
+      joined.tryAcquire(left);
+    }
+    joinWaiting.fetchAndStoreOrdered(0);
+
+    serialCallbacks = SERIAL_CALLBACKS;
+  }
+
+  for (int i = 0; i < nused; i++) {
+    Slot *slot = &slots[used[i]];
+    const Job &job = jobs[jobOf[i]];
+    if (slot->done.loadAcquire()) {
+      for (int c = 0; c < job.nch; c++) {
+        memcpy(job.bufs[c], slot->bufs[c], sizeof(float) * ns);
+      }
+    } else {
+      slot->abandoned = true;
+      silence(job, ns);
+    }
+  }
+
+  for (int i = 0; i < nworkers; i++) {
+    lastWorkerNs[i] = busyNs[i].fetchAndStoreRelaxed(0);
+  }
+  return !late;
+}
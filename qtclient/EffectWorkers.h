@@ -0,0 +1,114 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _EFFECTWORKERS_H_
+#define _EFFECTWORKERS_H_
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include "RTSemaphore.h"
+
+class EffectWorker;
+
+/* Runs the effect processors of several local channels in parallel
+ *
+ * Heavy plugin chains on more than one local channel can take longer than an
+ * audio callback allows even though other cores are idle.  The audio thread
+ * hands each channel's processor to run() as a job.  High priority worker
+ * threads and the audio thread itself claim jobs until none are left, so a
+ * job never waits for a worker that is slow to wake up.
+ *
+ * Each job runs on its own copy of the channel's buffers.  The audio thread
+ * spins for running jobs until the join deadline.  After that the workers are
+ * not keeping up, for example because the system does not give them
+ * real-time priority, so the audio thread sleeps rather than compete with
+ * them for a core, and run() processes jobs serially for a while.  A job
+ * still running at the abandon limit, such as a hung plugin, is left to its
+ * worker and its channel is silent until it returns.
+ */
+class EffectWorkers
+{
+public:
+  enum {
+    MAX_WORKERS = 4,
+    MAX_JOBS = 32,           /* one per local channel */
+    SERIAL_CALLBACKS = 1000, /* after missing the join deadline */
+    ABANDON_PCT = 200,       /* of the join deadline */
+    MAX_BLOCK = 4096,        /* frames, larger blocks are run serially */
+  };
+
+  struct Job {
+    void (*fn)(float **bufs, int nch, int ns, qint64 timeLeftNs, void *inst);
+    void *inst;
+    float *bufs[2];
+    int nch;
+  };
+
+  EffectWorkers();
+  ~EffectWorkers();
+
+  int numWorkers() const { return nworkers; }
+
+  /* Audio thread only.  Returns once all jobs are done or abandoned, false
+   * if that was more than deadlineNs after the call.  Jobs are told how much
+   * of deadlineNs is left when they start.  The buffers of abandoned jobs, and
+   * of jobs whose inst is still busy with an abandoned job, are silenced.
+   */
+  bool run(const Job *jobs, int njobs, int ns, qint64 deadlineNs);
+
+  /* Time a worker spent on jobs during the last run(), audio thread only */
+  unsigned int workerNs(int i) const { return lastWorkerNs[i]; }
+
+private:
+  friend class EffectWorker;
+
+  struct Slot {
+    Job job;
+    float *bufs[2]; /* what the job runs on, copied from and to job.bufs */
+    int ns;
+    qint64 deadline; /* on timer */
+    QAtomicInteger<int> claimed;
+    QAtomicInteger<int> done;
+    bool abandoned; /* audio thread only, a worker still runs the job */
+  };
+
+  EffectWorker *workers[MAX_WORKERS];
+  int nworkers;
+  RTSemaphore wake;
+  RTSemaphore joined; /* released for each job done during joinWaiting */
+  QAtomicInteger<int> stopping;
+  QElapsedTimer timer;
+
+  /* Shared between the audio thread and workers */
+  Slot slots[MAX_JOBS];
+  float *slotBufs; /* one aligned allocation for all Slot::bufs */
+  QAtomicInteger<int> numSlots; /* slots of the current run are below this */
+  QAtomicInteger<int> joinWaiting; /* audio thread sleeps on joined */
+  QAtomicInteger<unsigned int> busyNs[MAX_WORKERS];
+
+  /* Audio thread state */
+  int serialCallbacks;
+  unsigned int lastWorkerNs[MAX_WORKERS];
+
+  bool runOne(int worker);
+  void workerLoop(int worker);
+  bool isBusy(void *inst) const;
+  bool allDone(const int *used, int n);
+};
+
+#endif /* _EFFECTWORKERS_H_ */
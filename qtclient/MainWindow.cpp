@@ -38,7 +38,9 @@
 #include "EffectProcessor.h"
 #include "EffectSettingsPage.h"
 #include "UISettingsPage.h"
+#include "WaveFile.h"
 #include "PortAudioStreamer.h"
+#include "DiagnosticsDialog.h"
 #include "screensleep.h"
 #include "common/njmisc.h"
 #include "common/UserPrivs.h"
@@ -85,6 +87,10 @@ MainWindow::MainWindow(QWidget *parent)
   client.SetLocalChannelMonitoring(0, false, 0.0f, false, 0.0f, false, false, false, false);
   client.SetMidiStreamer(&portMidiStreamer);
 
+  audioTelemetry = new AudioTelemetry(this);
+  client.SetTelemetry(audioTelemetry);
+  portAudioStreamer.SetTelemetry(audioTelemetry);
+
   /* Certificate verification can be disabled for local testing */
   if (!settings->value("ssl/verify", true).toBool()) {
     QSslConfiguration sslConfig = QSslConfiguration::defaultConfiguration();
@@ -111,6 +117,8 @@ MainWindow::MainWindow(QWidget *parent)
   setupPortAudioSettingsPage();
   setupPortMidiSettingsPage();
 
+  diagnosticsDialog = new DiagnosticsDialog(audioTelemetry, &client, this);
+
 #ifdef Q_OS_MAC
   /* Mac applications use a global menu not associated with a particular window */
   QMenuBar *theMenuBar = globalMenuBar = new QMenuBar;
@@ -161,6 +169,8 @@ MainWindow::MainWindow(QWidget *parent)
   QMenu *helpMenu = theMenuBar->addMenu(tr("&Help"));
   QAction *logAction = helpMenu->addAction(tr("Show &log"));
   connect(logAction, SIGNAL(triggered()), this, SLOT(ShowLog()));
+  QAction *diagnosticsAction = helpMenu->addAction(tr("Audio &diagnostics..."));
+  connect(diagnosticsAction, SIGNAL(triggered()), diagnosticsDialog, SLOT(show()));
 #ifndef Q_OS_MAC
   /* Skip on Mac since the About menu item goes into a different menu */
   helpMenu->addSeparator();
@@ -211,6 +221,7 @@ MainWindow::MainWindow(QWidget *parent)
 
   BeatsPerIntervalChanged(0);
   BeatsPerMinuteChanged(0);
+  UploadBitrateChanged(0);
 
   /* Connection State */
   connectionStateMachine = new QStateMachine(this);
@@ -261,6 +272,8 @@ MainWindow::MainWindow(QWidget *parent)
           this, SLOT(BeatsPerMinuteChanged(int)));
   connect(&client, SIGNAL(beatsPerIntervalChanged(int)),
           this, SLOT(BeatsPerIntervalChanged(int)));
+  connect(&client, SIGNAL(uploadBitrateChanged(int)),
+          this, SLOT(UploadBitrateChanged(int)));
   connect(&client, SIGNAL(beatsPerIntervalChanged(int)),
           metronomeBar, SLOT(setBeatsPerInterval(int)));
   connect(&client, SIGNAL(currentBeatChanged(int)),
@@ -269,10 +282,15 @@ MainWindow::MainWindow(QWidget *parent)
   connect(&portAudioStreamer, SIGNAL(StoppedUnexpectedly()),
           this, SLOT(AudioStoppedUnexpectedly()));
 
-  effectProcessor = new EffectProcessor(&portMidiStreamer, this);
+  /* MIDI goes to and from the first channel's plugins */
+  for (int i = 0; i < MAX_EFFECT_CHANNELS; i++) {
+    effectProcessors.append(new EffectProcessor(i == 0 ? &portMidiStreamer :
+                                                NULL, this));
+  }
   settingsDialog->addPage(tr("Effect plugins"),
-                          new EffectSettingsPage(effectProcessor));
+                          new EffectSettingsPage(effectProcessors));
   setupUISettingsPage();
+  setupMetronomeSettingsPage();
 
   restoreGeometry(settings->value("main/geometry").toByteArray());
   restoreState(settings->value("main/windowState").toByteArray());
@@ -335,6 +353,12 @@ void MainWindow::setupStatusBar()
   bpiLabel->setToolTip(tr("Beats per interval"));
   bpiLabel->setFrameStyle(QFrame::Panel | QFrame::Sunken);
   statusBar()->addPermanentWidget(bpiLabel);
+
+  bitrateLabel = new QLabel(this);
+  bitrateLabel->setToolTip(tr("Bitrate your audio is sent at, lowered "
+                              "automatically when your connection can't keep up"));
+  bitrateLabel->setFrameStyle(QFrame::Panel | QFrame::Sunken);
+  statusBar()->addPermanentWidget(bitrateLabel);
 }
 
 void MainWindow::setupPortAudioSettingsPage()
@@ -351,6 +375,11 @@ void MainWindow::setupPortAudioSettingsPage()
   } else {
     settings->setValue("audio/inputChannels", portAudioSettingsPage->inputChannels());
   }
+  portAudioSettingsPage->setInputMode(settings->value("audio/inputMode", "mono").toString());
+  portAudioSettingsPage->setCodec(settings->value("audio/codec", "vorbis").toString());
+  portAudioSettingsPage->setBitrate(settings->value("audio/bitrate", 64).toInt());
+  portAudioSettingsPage->setMinBitrate(settings->value("audio/minBitrate", 32).toInt());
+  portAudioSettingsPage->setSimulcast(settings->value("audio/simulcast", false).toBool());
   portAudioSettingsPage->setOutputDevice(settings->value("audio/outputDevice").toString());
   if (settings->contains("audio/outputChannels")) {
     portAudioSettingsPage->setOutputChannels(settings->value("audio/outputChannels").toList());
@@ -390,6 +419,40 @@ void MainWindow::setupUISettingsPage()
   updateChatFontSize(chatFontSize);
 }
 
+void MainWindow::setupMetronomeSettingsPage()
+{
+  metronomeSettingsPage = new MetronomeSettingsPage;
+  metronomeSettingsPage->setAccentSample(settings->value("metronome/accentSample").toString());
+  metronomeSettingsPage->setNormalSample(settings->value("metronome/normalSample").toString());
+
+  settingsDialog->addPage(tr("Metronome"), metronomeSettingsPage);
+
+  loadMetronomeSamples();
+}
+
+/* Hand the metronome click samples to the client, falling back to the
+ * built-in click when a file cannot be read
+ */
+void MainWindow::loadMetronomeSamples()
+{
+  for (int i = 0; i < 2; i++) {
+    bool accent = i == 0;
+    QString filename = accent ? metronomeSettingsPage->accentSample() :
+                                metronomeSettingsPage->normalSample();
+    QVector<float> samples;
+    int sampleRate = 0;
+
+    if (!filename.isEmpty() &&
+        !readWaveFile(filename, &samples, &sampleRate)) {
+      qWarning("Unable to load metronome sample %s",
+               filename.toLocal8Bit().constData());
+      samples.clear();
+    }
+    client.SetMetronomeSample(accent, samples.constData(), samples.size(),
+                              sampleRate);
+  }
+}
+
 /* Idle processing once event loop has started */
 void MainWindow::Startup()
 {
@@ -466,6 +529,11 @@ void MainWindow::Connect(const QString &host, const QString &user, const QString
   QString inputDevice = settings->value("audio/inputDevice").toString();
   bool unmuteLocalChannels = settings->value("audio/unmuteLocalChannels", true).toBool();
   QList<QVariant> inputChannels = settings->value("audio/inputChannels").toList();
+  QString inputMode = settings->value("audio/inputMode", "mono").toString();
+  QString codec = settings->value("audio/codec", "vorbis").toString();
+  int bitrate = settings->value("audio/bitrate", 64).toInt();
+  int minBitrate = settings->value("audio/minBitrate", 32).toInt();
+  bool simulcast = settings->value("audio/simulcast", false).toBool();
   QString outputDevice = settings->value("audio/outputDevice").toString();
   QList<QVariant> outputChannels = settings->value("audio/outputChannels").toList();
   double sampleRate = settings->value("audio/sampleRate").toDouble();
@@ -506,13 +574,21 @@ void MainWindow::Connect(const QString &host, const QString &user, const QString
     return;
   }
 
+  if (portAudioStreamer.GetFramesPerBuffer() > 0) {
+    client.SetBlockSize(portAudioStreamer.GetFramesPerBuffer());
+  }
+
+  setupLocalChannels(inputMode, codec, bitrate, minBitrate, simulcast,
+                     portAudioStreamer.GetNumInputChannels());
+
   int i, ch;
   for (i = 0; (ch = client.EnumLocalChannels(i)) != -1; i++) {
     client.SetLocalChannelMonitoring(ch, false, 0, false, 0, true, !unmuteLocalChannels, false, false);
+    if (ch < effectProcessors.size()) {
+      effectProcessors.at(ch)->attach(&client, ch);
+    }
   }
 
-  effectProcessor->attach(&client, 0);
-
   setWindowTitle(tr(APPNAME " - %1").arg(host));
 
   screenPreventSleep();
@@ -529,7 +605,9 @@ void MainWindow::Disconnect()
   portAudioStreamer.Stop();
   loudNoiseDetected = false;
   client.Disconnect();
-  effectProcessor->detach();
+  foreach (EffectProcessor *effectProcessor, effectProcessors) {
+    effectProcessor->detach();
+  }
   portMidiStreamer.stop();
 
   chatOutput->addInfoMessage(tr("Disconnected"));
@@ -539,6 +617,7 @@ void MainWindow::Disconnect()
 
   BeatsPerMinuteChanged(0);
   BeatsPerIntervalChanged(0);
+  UploadBitrateChanged(0);
   emit Disconnected();
 }
 
@@ -756,12 +835,17 @@ void MainWindow::OnSamples(float **inbuf, int innch,
                            int len,
                            const PaStreamCallbackTimeInfo *timeInfo)
 {
-  if (detectLoudNoises && innch > 0 &&
-      loudNoiseDetector.process(inbuf[0], len, client.GetSampleRate())) {
-    loudNoiseDetected = true;
-
-    /* Schedule an asynchronous slot invocation in the GUI thread */
-    QMetaObject::invokeMethod(this, "LoudNoiseDetected", Qt::QueuedConnection);
+  if (detectLoudNoises) {
+    AudioStage stage(audioTelemetry, AudioTelemetry::STAGE_INPUT);
+    for (int i = 0; i < innch && i < MAX_LOUD_NOISE_INPUTS; i++) {
+      if (loudNoiseDetectors[i].process(inbuf[i], len, client.GetSampleRate())) {
+        loudNoiseDetected = true;
+
+        /* Schedule an asynchronous slot invocation in the GUI thread */
+        QMetaObject::invokeMethod(this, "LoudNoiseDetected", Qt::QueuedConnection);
+        break;
+      }
+    }
   }
 
   /* Zero output buffers while we're waiting to stop after a loud noise */
@@ -863,6 +947,15 @@ void MainWindow::BeatsPerIntervalChanged(int bpi)
   }
 }
 
+void MainWindow::UploadBitrateChanged(int kbps)
+{
+  if (kbps > 0) {
+    bitrateLabel->setText(tr("Upload: %1 kbps").arg(kbps));
+  } else {
+    bitrateLabel->setText(tr("Upload: N/A"));
+  }
+}
+
 void MainWindow::ChatMessageCallback(char **charparms, int nparms)
 {
   QString *parms;
@@ -1100,6 +1193,66 @@ void MainWindow::KickMenuAboutToShow()
   }
 }
 
+/* Map audio inputs to local channels, see PortAudioSettingsPage::inputMode
+ * and PortAudioSettingsPage::codec.  The bitrate is lowered towards minBitrate
+ * while the upload is congested.  With simulcast lower bitrate copies are sent
+ * too so the server can pick one for listeners on slow connections.
+ */
+void MainWindow::setupLocalChannels(const QString &inputMode,
+                                    const QString &codec, int bitrate,
+                                    int minBitrate, bool simulcast,
+                                    int numInputs)
+{
+  unsigned int fourcc = NJ_VORBIS_FOURCC;
+  if (codec == "opus") {
+    fourcc = NJ_OPUS_FOURCC;
+  } else if (codec == "flac") {
+    fourcc = NJ_FLAC_FOURCC;
+  }
+  if (minBitrate <= 0 || minBitrate > bitrate) {
+    minBitrate = bitrate; /* never lower the bitrate */
+  }
+
+  int numChannels = 1;
+  if (inputMode == "separate" && numInputs > 1) {
+    numChannels = qMin(numInputs, client.GetMaxLocalChannels());
+  }
+
+  QList<int> extraChannels;
+  int i, ch;
+  for (i = 0; (ch = client.EnumLocalChannels(i)) != -1; i++) {
+    if (ch >= numChannels) {
+      extraChannels.append(ch);
+    }
+  }
+  foreach (ch, extraChannels) {
+    client.DeleteLocalChannel(ch);
+  }
+
+  bool broadcast = xmitButton->isChecked();
+
+  if (numChannels > 1) {
+    for (ch = 0; ch < numChannels; ch++) {
+      QByteArray name = QString("channel%1").arg(ch).toUtf8();
+      client.SetLocalChannelInfo(ch, name.data(), true, ch, true, bitrate, true, broadcast);
+      client.SetLocalChannelCodec(ch, fourcc);
+      client.SetLocalChannelMinBitrate(ch, minBitrate);
+      client.SetLocalChannelSimulcast(ch, simulcast);
+    }
+  } else {
+    int srcch = 0;
+    if (inputMode == "stereo" && numInputs > 1) {
+      srcch = 0 | NJ_SRCCH_STEREO;
+    } else if (numInputs > 1) {
+      srcch = NJ_SRCCH_MIX;
+    }
+    client.SetLocalChannelInfo(0, NULL, true, srcch, true, bitrate, true, broadcast);
+    client.SetLocalChannelCodec(0, fourcc);
+    client.SetLocalChannelMinBitrate(0, minBitrate);
+    client.SetLocalChannelSimulcast(0, simulcast);
+  }
+}
+
 void MainWindow::KickMenuTriggered(QAction *action)
 {
   SendChatMessage(QString("/kick %1").arg(action->text()));
@@ -1112,6 +1265,11 @@ void MainWindow::SettingsDialogClosed()
   settings->setValue("audio/inputDevice", portAudioSettingsPage->inputDevice());
   settings->setValue("audio/unmuteLocalChannels", portAudioSettingsPage->unmuteLocalChannels());
   settings->setValue("audio/inputChannels", portAudioSettingsPage->inputChannels());
+  settings->setValue("audio/inputMode", portAudioSettingsPage->inputMode());
+  settings->setValue("audio/codec", portAudioSettingsPage->codec());
+  settings->setValue("audio/bitrate", portAudioSettingsPage->bitrate());
+  settings->setValue("audio/minBitrate", portAudioSettingsPage->minBitrate());
+  settings->setValue("audio/simulcast", portAudioSettingsPage->simulcast());
   settings->setValue("audio/outputDevice", portAudioSettingsPage->outputDevice());
   settings->setValue("audio/outputChannels", portAudioSettingsPage->outputChannels());
   settings->setValue("audio/sampleRate", portAudioSettingsPage->sampleRate());
@@ -1128,6 +1286,11 @@ void MainWindow::SettingsDialogClosed()
   int chatFontSize = uiSettingsPage->chatFontSize();
   settings->setValue("ui/chatFontSize", chatFontSize);
   updateChatFontSize(chatFontSize);
+
+  /* Save metronome settings */
+  settings->setValue("metronome/accentSample", metronomeSettingsPage->accentSample());
+  settings->setValue("metronome/normalSample", metronomeSettingsPage->normalSample());
+  loadMetronomeSamples();
 }
 
 void MainWindow::updateChatFontSize(int size)
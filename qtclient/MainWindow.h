@@ -37,6 +37,8 @@
 #include "ChannelTreeWidget.h"
 #include "MetronomeBar.h"
 #include "ChatOutput.h"
+#include "AudioTelemetry.h"
+#include "DiagnosticsDialog.h"
 #include "SettingsDialog.h"
 #include "EffectProcessor.h"
 #include "LoudNoiseDetector.h"
@@ -46,6 +48,7 @@
 #include "PortMidiSettingsPage.h"
 #include "PortMidiStreamer.h"
 #include "UISettingsPage.h"
+#include "MetronomeSettingsPage.h"
 
 class MainWindow : public QMainWindow
 {
@@ -75,6 +78,7 @@ private slots:
   void ClientStatusChanged(int newStatus);
   void BeatsPerIntervalChanged(int bpm);
   void BeatsPerMinuteChanged(int bpi);
+  void UploadBitrateChanged(int kbps);
   void LoudNoiseDetected();
   void RemoteChannelMuteChanged(int useridx, int channelidx, bool mute);
   void ShowLog();
@@ -95,16 +99,21 @@ private slots:
 
 private:
   NJClient client;
-  LoudNoiseDetector loudNoiseDetector;
+  enum { MAX_LOUD_NOISE_INPUTS = 8 };
+  LoudNoiseDetector loudNoiseDetectors[MAX_LOUD_NOISE_INPUTS];
   QUrl jammrApiUrl;
   QString jammrAuthToken;
   PortAudioStreamer portAudioStreamer;
   PortMidiStreamer portMidiStreamer;
-  EffectProcessor *effectProcessor;
+  enum { MAX_EFFECT_CHANNELS = 8 };
+  QList<EffectProcessor*> effectProcessors; /* one per local channel */
   SettingsDialog *settingsDialog;
+  AudioTelemetry *audioTelemetry;
+  DiagnosticsDialog *diagnosticsDialog;
   PortAudioSettingsPage *portAudioSettingsPage;
   PortMidiSettingsPage *portMidiSettingsPage;
   UISettingsPage *uiSettingsPage;
+  MetronomeSettingsPage *metronomeSettingsPage;
   QNetworkAccessManager *netManager;
   ChatOutput *chatOutput;
   QLineEdit *chatInput;
@@ -122,6 +131,7 @@ private:
   QMenu *kickMenu;
   QLabel *bpmLabel;
   QLabel *bpiLabel;
+  QLabel *bitrateLabel;
   MetronomeBar *metronomeBar;
   QToolButton *xmitButton;
   QToolButton *metronomeButton;
@@ -141,6 +151,11 @@ private:
   void setupPortAudioSettingsPage();
   void setupPortMidiSettingsPage();
   void setupUISettingsPage();
+  void setupMetronomeSettingsPage();
+  void loadMetronomeSamples();
+  void setupLocalChannels(const QString &inputMode, const QString &codec,
+                          int bitrate, int minBitrate, bool simulcast,
+                          int numInputs);
   bool tryReconnect();
   void resetReconnect();
   void updateChatFontSize(int size);
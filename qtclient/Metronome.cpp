@@ -0,0 +1,191 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "Metronome.h"
+
+Metronome::Clicks::Clicks()
+{
+  accent.samples = NULL;
+  accent.len = 0;
+  normal.samples = NULL;
+  normal.len = 0;
+}
+
+Metronome::Clicks::~Clicks()
+{
+  delete [] accent.samples;
+  delete [] normal.samples;
+}
+
+Metronome::Metronome(Reclaimer *reclaimer_)
+  : sampleRate(48000), reclaimer(reclaimer_), clicks(NULL), sounding(NULL),
+    soundingPos(0), beatPos(0.0)
+{
+  userSampleRates[0] = userSampleRates[1] = 0;
+  clicks = new Clicks;
+}
+
+Metronome::~Metronome()
+{
+  delete pending.fetchAndStoreOrdered(NULL);
+  delete clicks;
+}
+
+void Metronome::renderClick(Click *click, int sampleRate, bool accent,
+                            const QVector<float> &userSample,
+                            int userSampleRate)
+{
+  if (userSample.isEmpty()) {
+    /* 10 millisecond sine tone, an octave higher and quieter on normal beats */
+    double sc = 6000.0 / sampleRate;
+    if (!accent) {
+      sc *= 2.0;
+    }
+    float vol = accent ? 1.0f : 0.25f;
+
+    click->len = sampleRate / 100 - 1;
+    if (click->len < 0) {
+      click->len = 0;
+    }
+    click->samples = new float[click->len > 0 ? click->len : 1];
+    for (int i = 0; i < click->len; i++) {
+      click->samples[i] = vol * sin((i + 1) * sc);
+    }
+    return;
+  }
+
+  /* Linear interpolation is fine for a click */
+  double step = (double)userSampleRate / sampleRate;
+  click->len = (int)((userSample.size() - 1) / step) + 1;
+  click->samples = new float[click->len];
+
+  const float *src = userSample.constData();
+  for (int i = 0; i < click->len; i++) {
+    double pos = i * step;
+    int ipos = (int)pos;
+    double frac = pos - ipos;
+    float s = src[ipos];
+    if (ipos + 1 < userSample.size()) {
+      s += (src[ipos + 1] - s) * frac;
+    }
+    click->samples[i] = s;
+  }
+}
+
+/* Build wavetables and hand them to the audio thread */
+void Metronome::publish()
+{
+  Clicks *newClicks = new Clicks;
+  renderClick(&newClicks->accent, sampleRate, true,
+              userSamples[0], userSampleRates[0]);
+  renderClick(&newClicks->normal, sampleRate, false,
+              userSamples[1], userSampleRates[1]);
+
+  /* If the audio thread has not picked up the last ones they were never used */
+  delete pending.fetchAndStoreOrdered(newClicks);
+}
+
+void Metronome::setSampleRate(int sampleRate_)
+{
+  sampleRate = sampleRate_;
+  publish();
+}
+
+void Metronome::setSample(bool accent, const float *samples, int count,
+                          int sampleRate_)
+{
+  int idx = accent ? 0 : 1;
+
+  userSamples[idx].clear();
+  if (count > 0 && sampleRate_ > 0) {
+    userSamples[idx].resize(count);
+    for (int i = 0; i < count; i++) {
+      userSamples[idx][i] = samples[i];
+    }
+  }
+  userSampleRates[idx] = sampleRate_;
+  publish();
+}
+
+void Metronome::restart()
+{
+  beatPos = 0.0;
+}
+
+void Metronome::process(float *left, float *right, int len, int intervalPos,
+                        int beatLength, float leftVol, float rightVol)
+{
+  if (pending.load()) {
+    Clicks *newClicks = pending.fetchAndStoreAcquire(NULL);
+    if (newClicks) {
+      reclaimer->retire(clicks);
+      clicks = newClicks;
+      sounding = NULL;
+    }
+  }
+
+  if (beatLength <= 0) {
+    return;
+  }
+
+  bool audible = leftVol != 0.0f || (right && rightVol != 0.0f);
+  int x = 0;
+  while (x < len) {
+    if (beatPos <= 0.0) {
+      sounding = intervalPos + x < beatLength ? &clicks->accent : &clicks->normal;
+      soundingPos = 0;
+      beatPos += beatLength;
+    }
+
+    /* Samples until the next beat or the end of the buffer */
+    int n = (int)ceil(beatPos);
+    if (n > len - x) {
+      n = len - x;
+    }
+
+    if (sounding) {
+      int m = sounding->len - soundingPos;
+      if (m > n) {
+        m = n;
+      }
+
+      if (audible) {
+        const float *src = sounding->samples + soundingPos;
+        for (int i = 0; i < m; i++) {
+          left[x + i] += src[i] * leftVol;
+        }
+        if (right) {
+          for (int i = 0; i < m; i++) {
+            right[x + i] += src[i] * rightVol;
+          }
+        }
+      }
+
+      soundingPos += m;
+      if (soundingPos >= sounding->len) {
+        sounding = NULL;
+      }
+    }
+
+    beatPos -= n;
+    x += n;
+  }
+}
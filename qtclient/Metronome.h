@@ -0,0 +1,99 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _METRONOME_H_
+#define _METRONOME_H_
+
+#include <QAtomicPointer>
+#include <QVector>
+
+#include "Reclaimer.h"
+
+/* Metronome click generator
+ *
+ * Clicks are rendered ahead of time into wavetables, one for the first beat
+ * of the interval (accent) and one for the other beats.  The audio thread
+ * only copies wavetable samples into the output while a click is sounding
+ * and skips straight to the next beat otherwise.
+ *
+ * Wavetables are built by the client event loop and handed to the audio
+ * thread without locking.  The audio thread retires replaced wavetables to a
+ * Reclaimer.
+ */
+class Metronome
+{
+public:
+  Metronome(Reclaimer *reclaimer);
+  ~Metronome();
+
+  /* Client event loop only */
+  void setSampleRate(int sampleRate);
+
+  /* Use a mono sample for the accent or normal click instead of the built-in
+   * one.  An empty sample restores the built-in click.  Client event loop
+   * only.
+   */
+  void setSample(bool accent, const float *samples, int count,
+                 int sampleRate);
+
+  /* Audio thread only.  Start counting beats from the current sample. */
+  void restart();
+
+  /* Audio thread only.  Mix clicks into left and right (may be NULL).
+   * intervalPos is the interval position of the first sample and beatLength
+   * is the number of samples per beat.
+   */
+  void process(float *left, float *right, int len, int intervalPos,
+               int beatLength, float leftVol, float rightVol);
+
+private:
+  struct Click {
+    float *samples;
+    int len;
+  };
+
+  struct Clicks {
+    Click accent;
+    Click normal;
+
+    Clicks();
+    ~Clicks();
+  };
+
+  /* Client event loop state */
+  int sampleRate;
+  QVector<float> userSamples[2]; /* accent, normal */
+  int userSampleRates[2];
+
+  /* Handover between client event loop and audio thread */
+  QAtomicPointer<Clicks> pending;
+  Reclaimer *reclaimer;
+
+  /* Audio thread state */
+  Clicks *clicks;
+  const Click *sounding; /* NULL when silent */
+  int soundingPos;
+  double beatPos; /* samples until the next beat */
+
+  void publish();
+  static void renderClick(Click *click, int sampleRate, bool accent,
+                          const QVector<float> &userSample,
+                          int userSampleRate);
+};
+
+#endif /* _METRONOME_H_ */
@@ -0,0 +1,99 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <QFileDialog>
+#include <QFormLayout>
+#include <QHBoxLayout>
+#include <QPushButton>
+#include "MetronomeSettingsPage.h"
+
+MetronomeSettingsPage::MetronomeSettingsPage(QWidget *parent)
+  : QWidget(parent)
+{
+  accentSampleEdit = new QLineEdit;
+  normalSampleEdit = new QLineEdit;
+
+  QFormLayout *formLayout = new QFormLayout;
+  formLayout->setSpacing(5);
+  formLayout->setContentsMargins(2, 2, 2, 2);
+  formLayout->addRow(tr("&First beat sample:"),
+                     createSampleRow(accentSampleEdit,
+                                     SLOT(browseAccentSample())));
+  formLayout->addRow(tr("&Other beats sample:"),
+                     createSampleRow(normalSampleEdit,
+                                     SLOT(browseNormalSample())));
+  setLayout(formLayout);
+}
+
+QWidget *MetronomeSettingsPage::createSampleRow(QLineEdit *edit,
+                                                const char *browseSlot)
+{
+  edit->setPlaceholderText(tr("Built-in click"));
+  edit->setClearButtonEnabled(true);
+
+  QPushButton *browseButton = new QPushButton(tr("Browse..."));
+  connect(browseButton, SIGNAL(clicked()), this, browseSlot);
+
+  QWidget *row = new QWidget;
+  QHBoxLayout *layout = new QHBoxLayout;
+  layout->setContentsMargins(0, 0, 0, 0);
+  layout->addWidget(edit);
+  layout->addWidget(browseButton);
+  row->setLayout(layout);
+  return row;
+}
+
+void MetronomeSettingsPage::browseSample(QLineEdit *edit)
+{
+  QString filename = QFileDialog::getOpenFileName(this,
+      tr("Choose metronome sample"), edit->text(),
+      tr("WAV files (*.wav)"));
+  if (!filename.isEmpty()) {
+    edit->setText(filename);
+  }
+}
+
+void MetronomeSettingsPage::browseAccentSample()
+{
+  browseSample(accentSampleEdit);
+}
+
+void MetronomeSettingsPage::browseNormalSample()
+{
+  browseSample(normalSampleEdit);
+}
+
+QString MetronomeSettingsPage::accentSample() const
+{
+  return accentSampleEdit->text();
+}
+
+void MetronomeSettingsPage::setAccentSample(const QString &filename)
+{
+  accentSampleEdit->setText(filename);
+}
+
+QString MetronomeSettingsPage::normalSample() const
+{
+  return normalSampleEdit->text();
+}
+
+void MetronomeSettingsPage::setNormalSample(const QString &filename)
+{
+  normalSampleEdit->setText(filename);
+}
@@ -0,0 +1,52 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _METRONOMESETTINGSPAGE_H_
+#define _METRONOMESETTINGSPAGE_H_
+
+#include <QWidget>
+#include <QLineEdit>
+
+/* Metronome click sounds, an empty filename selects the built-in click */
+class MetronomeSettingsPage : public QWidget
+{
+  Q_OBJECT
+  Q_PROPERTY(QString accentSample READ accentSample WRITE setAccentSample)
+  Q_PROPERTY(QString normalSample READ normalSample WRITE setNormalSample)
+
+public:
+  MetronomeSettingsPage(QWidget *parent = 0);
+
+  QString accentSample() const;
+  void setAccentSample(const QString &filename);
+  QString normalSample() const;
+  void setNormalSample(const QString &filename);
+
+private slots:
+  void browseAccentSample();
+  void browseNormalSample();
+
+private:
+  QLineEdit *accentSampleEdit;
+  QLineEdit *normalSampleEdit;
+
+  QWidget *createSampleRow(QLineEdit *edit, const char *browseSlot);
+  void browseSample(QLineEdit *edit);
+};
+
+#endif /* _METRONOMESETTINGSPAGE_H_ */
@@ -35,6 +35,9 @@
 #include <QFile>
 #include <QDir>
 #include <QMutex>
+#include <QQueue>
+#include <QRunnable>
+#include <QElapsedTimer>
 #include "../WDL/pcmfmtcvt.h"
 #include "common/mpb.h"
 #include "common/njmisc.h"
@@ -46,16 +49,31 @@ enum {
   MIDI_STOP = Pm_Message(0xfc, 0, 0),
 };
 
-// todo: make an interface base class for vorbis enc/dec
-#define VorbisEncoder I_NJEncoder 
-#define VorbisDecoder I_NJDecoder 
-#define NJ_ENCODER_FMT_TYPE MAKE_NJ_FOURCC('O','G','G','v')
 #include "../WDL/vorbisencdec.h"
-#undef VorbisEncoder
-#undef VorbisDecoder
+#include "../common/opusencdec.h"
+#include "../common/flacencdec.h"
 
+// Returns NULL if the codec is not supported
+static I_NJDecoder *CreateNJDecoder(unsigned int fourcc)
+{
+  switch (fourcc)
+  {
+    case NJ_VORBIS_FOURCC: return new VorbisDecoder;
+    case NJ_OPUS_FOURCC: return new OggOpusDecoder;
+    case NJ_FLAC_FOURCC: return new FlacDecoder;
+  }
+  return NULL;
+}
 
-#define MAKE_NJ_FOURCC(A,B,C,D) ((A) | ((B)<<8) | ((C)<<16) | ((D)<<24))
+// Falls back to Vorbis if the codec does not support the sample rate
+static I_NJEncoder *CreateNJEncoder(unsigned int fourcc, int srate, int nch, int bitrate)
+{
+  if (fourcc == NJ_OPUS_FOURCC && OggOpusEncoder::IsSampleRateSupported(srate))
+    return new OggOpusEncoder(srate,nch,bitrate,0);
+  if (fourcc == NJ_FLAC_FOURCC)
+    return new FlacEncoder(srate,nch);
+  return new VorbisEncoder(srate,nch,bitrate,0);
+}
 
 // Compressed audio data buffer. Written to by client event loop and read from
 // by audio processing thread.
@@ -112,38 +130,149 @@ class DecodeBuffer
       return len;
     }
 
+    // Called by the writer once no more data will arrive
+    void finish()
+    {
+      finished.storeRelease(1);
+    }
+
+    bool isFinished()
+    {
+      return finished.loadAcquire();
+    }
+
   private:
     QAtomicInteger<int> refcount;
+    QAtomicInteger<int> finished;
 
     QMutex lock; // protects data
     QByteArray data;
 
     // Only allocated on the heap using DecodeBuffer::create()
     DecodeBuffer()
-      : refcount(1)
+      : refcount(1), finished(0)
     {
       data.reserve(4096);
     }
 };
 
+// Idle decoders of a remote channel. Decoders are Reset() when they come back
+// so the next interval reuses their sample buffer, and their parsed setup too
+// if the stream headers have not changed. Intervals may outlive the channel so
+// this is reference counted. Used from the decoder pool, the reclaimer and
+// the client event loop. The audio thread only gets here, taking the lock and
+// resetting the decoder, when it destroys a DecodeState itself because the
+// reclaimer queue is full; see the reclaimer overflow telemetry counter.
+class DecoderPool
+{
+  public:
+    enum { MAX_IDLE = 4 }; // a couple of intervals in flight plus queued ones
+
+    // Create a new instance with refcount set to 1
+    static DecoderPool *createAndRef()
+    {
+      return new DecoderPool;
+    }
+
+    void ref()
+    {
+      refcount.fetchAndAddOrdered(1);
+    }
+
+    void unref()
+    {
+      if (refcount.fetchAndSubOrdered(1) == 1) {
+        delete this;
+      }
+    }
+
+    // Returns NULL if the codec is not supported
+    I_NJDecoder *get(unsigned int fourcc)
+    {
+      {
+        QMutexLocker locker(&lock);
+
+        for (int i = idle.GetSize() - 1; i >= 0; i--) {
+          I_NJDecoder *dec = idle.Get(i);
+          if (dec->GetFourcc() == fourcc) {
+            idle.Delete(i);
+            return dec;
+          }
+        }
+      }
+      return CreateNJDecoder(fourcc);
+    }
+
+    void put(I_NJDecoder *dec)
+    {
+      if (!dec) {
+        return;
+      }
+
+      dec->Reset();
+
+      {
+        QMutexLocker locker(&lock);
+
+        if (idle.GetSize() < MAX_IDLE) {
+          idle.Add(dec);
+          return;
+        }
+      }
+      delete dec;
+    }
+
+  private:
+    QAtomicInteger<int> refcount;
+
+    QMutex lock; // protects idle
+    WDL_PtrList<I_NJDecoder> idle;
+
+    // Only allocated on the heap using DecoderPool::createAndRef()
+    DecoderPool()
+      : refcount(1)
+    {
+    }
+
+    ~DecoderPool()
+    {
+      idle.Empty(true);
+    }
+};
+
 class DecodeState
 {
   public:
-    DecodeState(DecodeBuffer *decodeBuffer_)
+    // fourcc selects the codec. maxlen is the longest mix in sample frames
+    // at srate, used to size the decoder's sample buffer so the audio thread
+    // never reallocates it. The decoder comes from pool and goes back there,
+    // if given.
+    DecodeState(DecodeBuffer *decodeBuffer_, unsigned int fourcc = 0,
+                int maxlen = 0, int srate = 0, DecoderPool *pool_ = 0)
       : decode_peak_vol(0.0), decode_codec(0),
-        decode_samplesout(0), dump_samples(0), resample_state(0.0),
-        decodeBuffer(decodeBuffer_)
+        decode_samplesout(0), dump_frames(0), resample_state(0.0),
+        decodeBuffer(decodeBuffer_), decode_ended(false), pool(pool_)
     {
       if (!decodeBuffer) {
+        pool = 0;
         return;
       }
 
       decodeBuffer->ref();
 
-      decode_codec = new I_NJDecoder;
+      if (pool) {
+        pool->ref();
+        decode_codec = pool->get(fourcc);
+      } else {
+        decode_codec = CreateNJDecoder(fourcc);
+      }
+      if (!decode_codec) {
+        return; // unsupported codec, play silence
+      }
+      decode_codec->DecodeSetMaxReadLength(maxlen, srate);
 
       // run some decoding
-      while (decode_codec->m_samples_used <= 0)
+      while (decode_codec->DecodeGetAvailable() <= 0)
       {
         if (!fillDecodeBuffer(128)) {
           break;
@@ -152,7 +281,13 @@ class DecodeState
     }
     ~DecodeState()
     {
-      delete decode_codec;
+      if (pool) {
+        pool->put(decode_codec);
+        pool->unref();
+        pool = 0;
+      } else {
+        delete decode_codec;
+      }
       decode_codec=0;
 
       if (decodeBuffer) {
@@ -163,14 +298,29 @@ class DecodeState
 
     bool fillDecodeBuffer(int nbytes)
     {
+      // decode anything left over from when the sample buffer was full
+      int avail = decode_codec->DecodeGetAvailable();
+      decode_codec->DecodeWrote(0);
+      if (decode_codec->DecodeGetAvailable() > avail) {
+        return true;
+      }
+
       void *buffer = decode_codec->DecodeGetSrcBuffer(nbytes);
 
       int l = 0;
+      bool finished = false;
       if (decodeBuffer) {
+        finished = decodeBuffer->isFinished();
         l = decodeBuffer->read(buffer, nbytes);
       }
       if (!l)
       {
+        if (finished && !decode_ended) {
+          // the download is complete, let the codec decode its last frame
+          decode_ended = true;
+          decode_codec->DecodeEnd();
+          return true;
+        }
         return false;
       }
 
@@ -182,11 +332,99 @@ class DecodeState
 
     I_NJDecoder *decode_codec;
     int decode_samplesout;
-    int dump_samples;
+    int dump_frames; // sample frames to skip after an underrun
     double resample_state;
     DecodeBuffer *decodeBuffer;
+
+  private:
+    bool decode_ended;
+    DecoderPool *pool;
+};
+
+
+// Intervals of a remote channel. The client event loop queues upcoming
+// intervals and the audio thread moves them into ds at interval boundaries.
+// Freed by the client event loop once the audio thread can no longer see it,
+// see NJClient::retireDecodeQueue().
+class DecodeQueue
+{
+  public:
+    enum { MAX_QUEUED = 2 };
+
+    DecodeQueue() : ds(NULL), underruns(0), next_read(0), next_write(0) { }
+    ~DecodeQueue()
+    {
+      int x;
+      for (x = 0; x < MAX_QUEUED; x ++) delete next_ds[x].load();
+      delete ds.load();
+    }
+
+    // Client event loop only. When the audio thread is not keeping up the
+    // newest queued interval is replaced, so playback stays as close to
+    // real time as before. Returns the replaced interval for the caller to
+    // free.
+    DecodeState *queueNext(DecodeState *next)
+    {
+      unsigned int w=next_write.load();
+      if (w-next_read.loadAcquire() >= MAX_QUEUED)
+      {
+        DecodeState *old=next_ds[(w-1)%MAX_QUEUED].fetchAndStoreOrdered(next);
+        if (old) return old;
+
+        // the audio thread took the newest one meanwhile, so queue normally
+        next_ds[(w-1)%MAX_QUEUED].store(NULL);
+      }
+      next_ds[w%MAX_QUEUED].storeRelease(next);
+      next_write.storeRelease(w+1);
+      return NULL;
+    }
+
+    // Audio thread only, NULL if nothing is queued
+    DecodeState *takeNext()
+    {
+      unsigned int r=next_read.load();
+      if (next_write.loadAcquire() == r) return NULL;
+      DecodeState *next=next_ds[r%MAX_QUEUED].fetchAndStoreAcquire(NULL);
+      next_read.storeRelease(r+1);
+      return next;
+    }
+
+    QAtomicPointer<DecodeState> ds; // playing, only changed by audio thread
+    QAtomicInteger<unsigned int> underruns; // ran out of downloaded data, counted by audio thread
+
+  private:
+    // Ring of prepared intervals. Slots are swapped atomically so the
+    // client event loop can replace the newest one in place.
+    QAtomicPointer<DecodeState> next_ds[MAX_QUEUED];
+    QAtomicInteger<unsigned int> next_read, next_write;
 };
 
+// Adaptive prebuffer for a remote channel. Tracks how far behind real time
+// each interval's data arrives and how many compressed bytes a second of
+// audio takes, then works out how much to wait for before queueing an
+// interval for playback. Client event loop only.
+class JitterBuffer
+{
+  public:
+    JitterBuffer();
+
+    void downloadStarted(double now);
+    void dataArrived(double now, int bytes_before);
+    void downloadFinished(int bytes, double interval_secs, unsigned int underruns);
+
+    // bytes to buffer before playing, fallback until the byte rate is known
+    int prebufferBytes(int fallback);
+
+    double target_secs;
+    double bytes_per_sec; // 0 until the first complete interval
+    unsigned int underruns; // total seen on this channel
+
+  private:
+    double m_start;
+    double m_maxlag; // of the current download
+    double m_lag_avg, m_lag_dev;
+    unsigned int m_underruns_seen;
+};
 
 class RemoteUser_Channel
 {
@@ -198,9 +436,12 @@ class RemoteUser_Channel
 
     WDL_String name;
 
-    // decode/mixer state, used by mixer
-    DecodeState *ds;
-    DecodeState *next_ds[2]; // prepared by main thread, for audio thread
+    // decode/mixer state, used by mixer. NULL if the channel is not present.
+    DecodeQueue *dq;
+
+    DecoderPool *decoders; // reused from one interval to the next
+
+    JitterBuffer jitter;
 
 };
 
@@ -221,6 +462,73 @@ public:
   RemoteUser_Channel channels[MAX_USER_CHANNELS];
 };
 
+// Remote channels as the audio thread mixes them. A new one is published by
+// NJClient::publishMixState() whenever something changes and it is never
+// modified afterwards, so the audio thread reads it without taking locks.
+// Only present channels are listed and their mute/solo state and gains are
+// worked out up front.
+class RemoteMixState
+{
+public:
+  struct Channel {
+    DecodeQueue *dq;
+    bool subscribed;
+    bool muted;
+    float vol; // for the VU meter
+    double vol1, vol2; // left/right gains, including pan
+    double vol0; // gain for mono output
+  };
+
+  RemoteMixState(unsigned int generation_, WDL_PtrList<RemoteUser> &remoteusers,
+                 bool issoloactive)
+    : generation(generation_), numchannels(0), retired_by(0)
+  {
+    int u, ch;
+    for (u = 0; u < remoteusers.GetSize(); u ++)
+    {
+      RemoteUser *user=remoteusers.Get(u);
+      for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+        if (user->channels[ch].dq) numchannels++;
+    }
+    channels = new Channel[numchannels > 0 ? numchannels : 1];
+
+    Channel *dst=channels;
+    for (u = 0; u < remoteusers.GetSize(); u ++)
+    {
+      RemoteUser *user=remoteusers.Get(u);
+      for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+      {
+        RemoteUser_Channel *src=&user->channels[ch];
+        if (!src->dq) continue;
+
+        dst->dq=src->dq;
+        dst->subscribed=!!(user->submask & (1<<ch));
+        if (issoloactive) dst->muted = !(user->solomask & (1<<ch));
+        else dst->muted=(user->mutedmask & (1<<ch)) || user->muted;
+        dst->vol=user->volume * src->volume;
+        mixFloatsPanGains(dst->vol, user->pan+src->pan, &dst->vol1, &dst->vol2);
+        mixFloatsPanGains(dst->vol, 0.0f, &dst->vol0, &dst->vol0);
+        dst++;
+      }
+    }
+  }
+  ~RemoteMixState()
+  {
+    int x;
+    for (x = 0; x < orphans.GetSize(); x ++) delete orphans.Get(x);
+    delete [] channels;
+  }
+
+  unsigned int generation;
+  int numchannels;
+  Channel *channels;
+
+  // set when replaced, with the generation of the replacement
+  unsigned int retired_by;
+  // queues that only this state (and older ones) still refer to
+  WDL_PtrList<DecodeQueue> orphans;
+};
+
 
 class RemoteDownload
 {
@@ -236,9 +544,11 @@ public:
   time_t last_time;
   unsigned char guid[16];
 
-  int chidx;
+  int chidx; // -1 once queued for playback
+  int jitter_chidx; // for JitterBuffer stats, stays set
   WDL_String username;
   int playtime;
+  int bytes; // received so far
 
 private:
   unsigned int m_fourcc;
@@ -246,46 +556,81 @@ private:
   DecodeBuffer *decodeBuffer;
 };
 
-/* Sentinel WDL_HeapBuf for silent intervals */
-static WDL_HeapBuf silence_buf;
-
+// Audio samples waiting to be encoded. Written to by the audio processing
+// thread and read from by the client event loop. Blocks are preallocated and
+// handed over through a single-producer single-consumer ring so neither side
+// ever waits for the other.
 class BufferQueue
 {
   public:
-    BufferQueue() { }
-    ~BufferQueue() 
-    { 
-      Clear();
-    }
+    enum {
+      BLOCK_LEN = 1024, // samples per block
+      NUM_BLOCKS = 128,
+      MAX_PENDING_MARKERS = 8,
+    };
 
-    void AddBlock(float *samples, int len, float *samples2=NULL);
-    int GetBlock(WDL_HeapBuf **b); // return 0 if got one, 1 if none avail
-    void DisposeBlock(WDL_HeapBuf *b);
+    BufferQueue();
+    ~BufferQueue();
 
-    void Clear()
-    {
-      int x;
-      for (x = 0; x < m_emptybufs.GetSize(); x ++)
-        delete m_emptybufs.Get(x);
-      m_emptybufs.Empty();
-      int l=m_samplequeue.Available()/sizeof(WDL_HeapBuf *);
-      WDL_HeapBuf **bufs=(WDL_HeapBuf **)m_samplequeue.Get();
-      if (bufs) while (l--)
-      {
-        if (*bufs && *bufs != &silence_buf) delete *bufs;
-        bufs++;
-      }
-      m_samplequeue.Advance(m_samplequeue.Available());
-      m_samplequeue.Compact();
-    }
+    // Audio thread only. samples has nch planar buffers of len sample
+    // frames. len 0 ends the interval, -1 queues a silent interval.
+    void AddBlock(float **samples, int nch, int len);
+
+    // Client event loop only. Returns 0 if got one, 1 if none avail. Samples
+    // are interleaved and len is in sample frames. The block stays valid
+    // until DisposeBlock() is called.
+    int GetBlock(float **samples, int *len, int *nch);
+    void DisposeBlock();
+
+    // Client event loop only, discards all queued blocks
+    void Clear();
+
+    // Number of times audio was dropped because the queue was full
+    int GetOverflowCount() { return m_overflows.loadAcquire(); }
+
+    // Number of interval markers dropped because MAX_PENDING_MARKERS were
+    // already waiting for room, the encoder then misses interval boundaries
+    int GetLostMarkerCount() { return m_lost_markers.loadAcquire(); }
 
   private:
-    WDL_Queue m_samplequeue; // a list of pointers, with NULL to define spaces
-    WDL_PtrList<WDL_HeapBuf> m_emptybufs;
-    WDL_Mutex m_cs;
+    struct Block {
+      float *samples;
+      int len;
+      int nch;
+    };
+
+    Block m_blocks[NUM_BLOCKS];
+    float *m_samplebuf;
+
+    // Free-running counters, the ring index is the counter modulo NUM_BLOCKS
+    QAtomicInteger<unsigned int> m_read, m_write;
+
+    // Interval markers that did not fit, owned by the audio thread
+    int m_pending_markers[MAX_PENDING_MARKERS];
+    int m_num_pending_markers;
+
+    QAtomicInteger<int> m_overflows;
+    QAtomicInteger<int> m_lost_markers;
+
+    unsigned int numFree();
+    void push(float **samples, int nch, int offset, int len);
+
+  public:
+    bool HasBlocks() { return m_read.loadAcquire() != m_write.loadAcquire(); }
 };
 
 
+// Bitrate to encode at, pct percent of bitrate but at least min_bitrate.
+// Rounded so that small steps don't rebuild the encoder every interval.
+static int effectiveBitrate(int bitrate, int min_bitrate, int pct)
+{
+  int br=bitrate*pct/100;
+  br-=br%8;
+  if (br < min_bitrate) br=min_bitrate;
+  if (br > bitrate) br=bitrate;
+  return br;
+}
+
 class Local_Channel
 {
 public:
@@ -294,8 +639,11 @@ public:
 
   int channel_idx;
 
-  int src_channel; // 0 or 1
+  int src_channel; // input index, see NJ_SRCCH_STEREO and NJ_SRCCH_MIX
   int bitrate;
+  int min_bitrate; // lowest bitrate when the upload is congested
+  unsigned int codec; // fourcc
+  bool simulcast; // also upload lower bitrate variants, if the server supports them
 
   float volume;
   float pan;
@@ -312,17 +660,96 @@ public:
   bool bcast_active;
 
 
-  void (*cbf)(float *, int ns, void *);
+  void (*cbf)(float **, int nch, int ns, qint64 timeLeftNs, void *);
   void *cbf_inst;
 
   BufferQueue m_bq;
+  int m_bq_overflows_seen, m_bq_lost_markers_seen; // only used by the client event loop
+
+  // Set while an encode job owns m_bq's consumer side and the m_enc* state
+  QAtomicInteger<int> m_encoding;
+
+  // Messages produced by the encode job, sent by the client event loop
+  void queueSend(Net_Message *msg)
+  {
+    QMutexLocker locker(&m_sendq_lock);
+    m_sendq.enqueue(msg);
+  }
+
+  Net_Message *takeSend()
+  {
+    QMutexLocker locker(&m_sendq_lock);
+    return m_sendq.isEmpty() ? NULL : m_sendq.dequeue();
+  }
+
+  void clearSendQueue()
+  {
+    Net_Message *msg;
+    while ((msg = takeSend())) {
+      delete msg;
+    }
+  }
+
+  // Smoothed fraction of real-time spent encoding this channel
+  void updateEncodeLoad(double load)
+  {
+    QMutexLocker locker(&m_sendq_lock);
+    m_encode_load = m_encode_load * 0.9 + load * 0.1;
+  }
+
+  double getEncodeLoad()
+  {
+    QMutexLocker locker(&m_sendq_lock);
+    return m_encode_load;
+  }
+
+  // Copy of the encoder settings above for the encode job, which can't take
+  // m_locchan_cs. Only written by NJClient::Run() while no job is running.
+  struct EncodeParams
+  {
+    int bitrate;
+    int min_bitrate;
+    unsigned int codec;
+    bool simulcast;
+  };
+  EncodeParams m_enc_params;
 
   double decode_peak_vol;
   bool m_need_header;
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
   I_NJEncoder  *m_enc;
   int m_enc_bitrate_used;
+  int m_enc_nch_used;
+  int m_enc_srate_used;
+  unsigned int m_enc_codec_used; // requested, m_enc may have fallen back to another
   Net_Message *m_enc_header_needsend;
+
+  // lower bitrate copies of the current interval, see NJClient::setupVariants()
+  struct Variant
+  {
+    I_NJEncoder *enc;
+    int bitrate;
+    int nch;
+    int srate;
+    unsigned int codec;
+    unsigned char guid[16];
+  };
+  Variant m_variants[MAX_INTERVAL_VARIANTS-1];
+  int m_num_variants; // in use this interval
+
+  void freeEncoders()
+  {
+    delete m_enc;
+    m_enc=0;
+    delete m_enc_header_needsend;
+    m_enc_header_needsend=0;
+
+    int v;
+    for (v = 0; v < MAX_INTERVAL_VARIANTS-1; v ++)
+      delete m_variants[v].enc;
+    memset(m_variants,0,sizeof(m_variants));
+    m_num_variants=0;
+  }
 #endif
   
   WDL_String name;
@@ -330,6 +757,106 @@ public:
   unsigned char guid[16]; // current interval GUID
 
   //DecodeState too, eventually
+
+private:
+  QMutex m_sendq_lock; // protects m_sendq and m_encode_load
+  QQueue<Net_Message*> m_sendq;
+  double m_encode_load;
+};
+
+// Encodes whatever a local channel has queued, runs on NJClient's encoder pool
+class LocalChannelEncodeJob : public QRunnable
+{
+public:
+  LocalChannelEncodeJob(NJClient *client_, Local_Channel *lc_, bool discard_)
+    : client(client_), lc(lc_), discard(discard_)
+  {
+  }
+
+  void run()
+  {
+    client->encodeLocalChannel(lc, discard);
+    lc->m_encoding.storeRelease(0);
+
+    // Pick up the encoded data without waiting for the next tick
+    QMetaObject::invokeMethod(client, "encoderFinished", Qt::QueuedConnection);
+  }
+
+private:
+  NJClient *client;
+  Local_Channel *lc;
+  bool discard;
+};
+
+// Sets up the decoder for a remote interval and decodes its first samples on
+// NJClient's decoder pool. The client event loop owns the job and queues the
+// result for the audio thread, see NJClient::queueDecodedIntervals().
+class DecodeStateJob : public QRunnable
+{
+public:
+  // decodeBuffer may be NULL for a silent interval, which is ready right away
+  DecodeStateJob(NJClient *client_, const char *username_, int chidx_,
+                 DecodeBuffer *decodeBuffer_, unsigned int fourcc_,
+                 DecoderPool *pool_)
+    : client(client_), chidx(chidx_), ds(NULL), decodeBuffer(decodeBuffer_),
+      fourcc(fourcc_), pool(pool_), maxlen(client_->m_blocksize),
+      srate(client_->m_srate), done(0)
+  {
+    setAutoDelete(false);
+    username.Set(username_);
+
+    if (decodeBuffer)
+    {
+      // the download or channel may go away first
+      decodeBuffer->ref();
+      if (pool) pool->ref();
+    }
+    else
+    {
+      ds=new DecodeState(0);
+      done.store(1);
+    }
+  }
+  ~DecodeStateJob()
+  {
+    delete ds;
+  }
+
+  void run()
+  {
+    ds=new DecodeState(decodeBuffer, fourcc, maxlen, srate, pool);
+    decodeBuffer->unref();
+    decodeBuffer=NULL;
+    if (pool) pool->unref();
+    pool=NULL;
+
+    // the job may be freed once done is set
+    NJClient *c=client;
+    done.storeRelease(1);
+    QMetaObject::invokeMethod(c, "decoderFinished", Qt::QueuedConnection);
+  }
+
+  bool isDone() { return !!done.loadAcquire(); }
+
+  // Hand over the result, the caller becomes responsible for freeing it
+  DecodeState *takeDecodeState()
+  {
+    DecodeState *tmp=ds;
+    ds=NULL;
+    return tmp;
+  }
+
+  WDL_String username;
+  int chidx;
+
+private:
+  NJClient *client;
+  DecodeState *ds;
+  DecodeBuffer *decodeBuffer;
+  unsigned int fourcc;
+  DecoderPool *pool;
+  int maxlen, srate;
+  QAtomicInteger<int> done;
 };
 
 
@@ -340,10 +867,26 @@ public:
 
 #define MIN_ENC_BLOCKSIZE 2048
 #define MAX_ENC_BLOCKSIZE (8192+1024)
+#define SIMULCAST_MIN_BITRATE 24 // kbps, lower variants aren't worth sending
+
+#define UPLOAD_CHECK_MS 1000
+#define UPLOAD_MIN_STEP 0.75 // bitrate cuts per check, encoders only adjust between intervals
+#define UPLOAD_MAX_STEP 0.95
+
+#define EFFECT_JOIN_DEADLINE_PCT 50 // of the callback period, see EffectWorkers
+
+Q_STATIC_ASSERT((int)EffectWorkers::MAX_WORKERS <= (int)AudioTelemetry::MAX_WORKERS);
+Q_STATIC_ASSERT((int)EffectWorkers::MAX_JOBS >= MAX_LOCAL_CHANNELS);
 
 
 #define NJ_PORT 2049
 
+// adaptive prebuffer limits, in seconds of audio
+#define JITTER_MIN_TARGET 0.02
+#define JITTER_INITIAL_TARGET 0.25
+#define JITTER_MAX_TARGET 4.0
+#define JITTER_UNDERRUN_BACKOFF 0.1
+
 static unsigned char zero_guid[16];
 
 
@@ -352,6 +895,11 @@ static void guidtostr(unsigned char *guid, char *str)
   int x;
   for (x = 0; x < 16; x ++) sprintf(str+x*2,"%02x",guid[x]);
 }
+static char *guidtostr_buf(unsigned char *guid, char *buf)
+{
+  guidtostr(guid,buf);
+  return buf;
+}
 static char *guidtostr_tmp(unsigned char *guid)
 {
   static char tmp[64];
@@ -360,9 +908,12 @@ static char *guidtostr_tmp(unsigned char *guid)
 }
 
 NJClient::NJClient(QObject *parent)
-  : QObject(parent)
+  : QObject(parent), m_metronome(&m_reclaimer),
+    m_upload_rate(UPLOAD_CHECK_MS,UPLOAD_MIN_STEP,UPLOAD_MAX_STEP)
 {
   m_srate=48000;
+  SetBlockSize(4096);
+  m_metronome.setSampleRate(m_srate);
 
   config_autosubscribe=1;
   config_metronome=0.5f;
@@ -383,8 +934,19 @@ NJClient::NJClient(QObject *parent)
 
   m_issoloactive=0;
   m_netcon=0;
+  m_upload_bitrate_pct.store(100);
+  m_upload_bitrate_shown=0;
+  m_server_simulcast.store(0);
+
+  m_mix_generation=0;
+  m_mix_state.storeRelease(new RemoteMixState(m_mix_generation, m_remoteusers,
+                                              false));
+  m_mix_current=m_mix_state.load();
 
   midiStreamer = NULL;
+  m_telemetry = NULL;
+  m_reclaimer_overflows = 0;
+  m_jitter_clock.start();
   sendMidiBeatClock = false;
   sendMidiStartOnInterval = false;
   midiStarted = false;
@@ -417,9 +979,6 @@ void NJClient::_reinit()
   m_active_bpi=32;
   m_interval_length=1000;
   m_interval_pos=-1;
-  m_metronome_pos=0.0;
-  m_metronome_state=0;
-  m_metronome_tmp=0;
   m_metronome_interval=0;
 
   lastBpm = -1;
@@ -438,21 +997,51 @@ void NJClient::_reinit()
 
 NJClient::~NJClient()
 {
+  m_encode_pool.waitForDone();
+  discardDecodeJobs();
+
   delete m_netcon;
   m_netcon=0;
 
   int x;
-  for (x = 0; x < m_remoteusers.GetSize(); x ++) delete m_remoteusers.Get(x);
+  for (x = 0; x < m_remoteusers.GetSize(); x ++)
+  {
+    RemoteUser *user=m_remoteusers.Get(x);
+    int ch;
+    for (ch = 0; ch < MAX_USER_CHANNELS; ch ++) retireDecodeQueue(user->channels[ch].dq);
+    delete user;
+  }
   m_remoteusers.Empty();
   for (x = 0; x < m_downloads.GetSize(); x ++) delete m_downloads.Get(x);
   m_downloads.Empty();
   for (x = 0; x < m_locchannels.GetSize(); x ++) delete m_locchannels.Get(x);
   m_locchannels.Empty();
+
+  // the audio stream is stopped by now
+  publishMixState();
+  reclaimMixState(true);
+  delete m_mix_state.load();
 }
 
 void NJClient::SetSampleRate(int srate)
 {
   m_srate = srate;
+  m_metronome.setSampleRate(srate);
+}
+
+void NJClient::SetMetronomeSample(bool accent, const float *samples, int len, int srate)
+{
+  m_metronome.setSample(accent, samples, len, srate);
+}
+
+// Also sizes the channel scratch buffers so AudioProc() doesn't reallocate
+// them, the old buffer would be freed on the audio thread
+void NJClient::SetBlockSize(int len)
+{
+  m_locchan_cs.Enter();
+  m_blocksize = len;
+  tmpblock.Resize(len*2*MAX_LOCAL_CHANNELS*(int)sizeof(float));
+  m_locchan_cs.Leave();
 }
 
 void NJClient::updateBPMinfo(int bpm, int bpi)
@@ -528,6 +1117,23 @@ void NJClient::updateInterval(int nsamples)
 void NJClient::AudioProc(float **inbuf, int innch, float **outbuf, int outnch,
                          int len, const PaStreamCallbackTimeInfo *timeInfo)
 {
+  // Pick up the latest remote user settings. Being busy first tells
+  // reclaimMixState() that older states may still be in use.
+  m_mix_busy.fetchAndStoreOrdered(1);
+  m_mix_current=m_mix_state.loadAcquire();
+  m_mix_ack.storeRelease(m_mix_current->generation);
+
+  // objects the audio thread had to destroy itself since the last callback
+  if (m_telemetry)
+  {
+    unsigned int overflows=m_reclaimer.overflowCount();
+    if (overflows != m_reclaimer_overflows)
+    {
+      m_telemetry->countReclaimerOverflows(overflows-m_reclaimer_overflows);
+      m_reclaimer_overflows=overflows;
+    }
+  }
+
   // zero output
   int x;
   for (x = 0; x < outnch; x ++) memset(outbuf[x],0,sizeof(float)*len);
@@ -541,6 +1147,7 @@ void NJClient::AudioProc(float **inbuf, int innch, float **outbuf, int outnch,
   if (!m_audio_enable)
   {
     process_samples(outbuf, outnch, len, 0, 1, timeInfo->outputBufferDacTime);
+    m_mix_busy.fetchAndStoreOrdered(0);
     return;
   }
 
@@ -555,12 +1162,19 @@ void NJClient::AudioProc(float **inbuf, int innch, float **outbuf, int outnch,
       x = len;
     }
 
+    // Decoders are sized for this, see DecodeState
+    if (x > m_blocksize) {
+      x = m_blocksize;
+    }
+
     process_samples(outbuf, outnch, x, offs, 0, timeInfo->outputBufferDacTime);
 
     updateInterval(x);
     offs += x;
     len -= x;
   }
+
+  m_mix_busy.fetchAndStoreOrdered(0);
 }
 
 
@@ -576,22 +1190,34 @@ void NJClient::Disconnect()
   }
 
   int x;
-  for (x=0;x<m_remoteusers.GetSize(); x++) delete m_remoteusers.Get(x);
+  for (x=0;x<m_remoteusers.GetSize(); x++)
+  {
+    RemoteUser *user=m_remoteusers.Get(x);
+    int ch;
+    for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+    {
+      retireDecodeQueue(user->channels[ch].dq);
+      user->channels[ch].dq=NULL;
+    }
+    delete user;
+  }
   m_remoteusers.Empty();
   bool removedUsers = x;
+  publishMixState();
 
   for (x = 0; x < m_downloads.GetSize(); x ++) delete m_downloads.Get(x);
   m_downloads.Empty();
 
+  m_encode_pool.waitForDone();
+  discardDecodeJobs();
+
   for (x = 0; x < m_locchannels.GetSize(); x ++) 
   {
     Local_Channel *c=m_locchannels.Get(x);
+    c->clearSendQueue();
 
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
-    delete c->m_enc;
-    c->m_enc=0;
-    delete c->m_enc_header_needsend;
-    c->m_enc_header_needsend=0;
+    c->freeEncoders();
 #endif
 
     c->m_bq.Clear();
@@ -625,6 +1251,9 @@ void NJClient::Connect(char *host, char *user, char *pass)
   QTcpSocket *sock = new QTcpSocket;
   sock->connectToHost(tmp.Get(), port);
   m_netcon = new Net_Connection(sock);
+  m_upload_rate.Reset();
+  m_upload_bitrate_pct.store(100);
+  m_server_simulcast.store(0);
   connect(m_netcon, SIGNAL(disconnected()),
           this, SLOT(netconDisconnected()));
   connect(m_netcon, SIGNAL(messagesReady()),
@@ -687,6 +1316,7 @@ void NJClient::processMessage(Net_Message *msg)
           repl.client_version = ver_cur; // client version number
 
           m_connection_keepalive=(cha.server_caps>>8)&0xff;
+          m_server_simulcast.storeRelease((cha.server_caps&SERVER_CAP_SIMULCAST) ? 1 : 0);
 
           //              printf("Got keepalive of %d\n",m_connection_keepalive);
 
@@ -798,8 +1428,6 @@ void NJClient::processMessage(Net_Message *msg)
               {
                 int submask = 0;
 
-                m_users_cs.Enter();
-
                 if (x == m_remoteusers.GetSize())
                 {
                   theuser=new RemoteUser;
@@ -809,13 +1437,15 @@ void NJClient::processMessage(Net_Message *msg)
 
                 theuser->channels[cid].name.Set(chn);
                 theuser->chanpresentmask |= 1<<cid;
+                if (!theuser->channels[cid].dq)
+                  theuser->channels[cid].dq=new DecodeQueue;
 
                 if (config_autosubscribe)
                 {
                   submask = theuser->submask |= 1<<cid;
                 }
 
-                m_users_cs.Leave();
+                publishMixState();
 
                 if (config_autosubscribe)
                 {
@@ -828,8 +1458,6 @@ void NJClient::processMessage(Net_Message *msg)
               {
                 if (x < m_remoteusers.GetSize())
                 {
-                  m_users_cs.Enter();
-
                   theuser->channels[cid].name.Set("");
                   theuser->chanpresentmask &= ~(1<<cid);
                   theuser->submask &= ~(1<<cid);
@@ -837,12 +1465,8 @@ void NJClient::processMessage(Net_Message *msg)
                   int chksolo=theuser->solomask == (1<<cid);
                   theuser->solomask &= ~(1<<cid);
 
-                  delete theuser->channels[cid].ds;
-                  delete theuser->channels[cid].next_ds[0];
-                  delete theuser->channels[cid].next_ds[1];
-                  theuser->channels[cid].ds=0;
-                  theuser->channels[cid].next_ds[0]=0;
-                  theuser->channels[cid].next_ds[1]=0;
+                  retireDecodeQueue(theuser->channels[cid].dq);
+                  theuser->channels[cid].dq=NULL;
 
                   if (!theuser->chanpresentmask) // user no longer exists, it seems
                   {
@@ -860,7 +1484,7 @@ void NJClient::processMessage(Net_Message *msg)
                     else m_issoloactive&=~1;
                   }
 
-                  m_users_cs.Leave();
+                  publishMixState();
                 }
               }
             }
@@ -882,12 +1506,7 @@ void NJClient::processMessage(Net_Message *msg)
             //printf("Getting interval for %s, channel %d\n",dib.username,dib.chidx);
             if (!memcmp(dib.guid,zero_guid,sizeof(zero_guid)))
             {
-              m_users_cs.Enter();
-              int useidx=!!theuser->channels[dib.chidx].next_ds[0];
-              DecodeState *tmp=theuser->channels[dib.chidx].next_ds[useidx];
-              theuser->channels[dib.chidx].next_ds[useidx]=0;
-              m_users_cs.Leave();
-              delete tmp;
+              // nothing to queue, the channel is silent for an interval
             }
             else if (dib.fourcc) // download coming
             {                
@@ -896,21 +1515,20 @@ void NJClient::processMessage(Net_Message *msg)
               memcpy(ds->guid,dib.guid,sizeof(ds->guid));
               ds->Open(this,dib.fourcc);
 
-              ds->playtime=config_play_prebuffer;
-              ds->chidx=dib.chidx;
+              JitterBuffer *jitter=&theuser->channels[dib.chidx].jitter;
+              jitter->downloadStarted(m_jitter_clock.elapsed()/1000.0);
+
+              ds->playtime=config_play_prebuffer > 0 ? jitter->prebufferBytes(config_play_prebuffer) : config_play_prebuffer;
+              ds->chidx=ds->jitter_chidx=dib.chidx;
               ds->username.Set(dib.username);
 
               m_downloads.Add(ds);
             }
             else
             {
-              DecodeState *tmp = new DecodeState(0);
-              m_users_cs.Enter();
-              int useidx=!!theuser->channels[dib.chidx].next_ds[0];
-              DecodeState *t2=theuser->channels[dib.chidx].next_ds[useidx];
-              theuser->channels[dib.chidx].next_ds[useidx]=tmp;
-              m_users_cs.Leave();
-              delete t2;
+              // goes through the decoder pool to stay in order with
+              // intervals that are still being prepared
+              startDecodeState(dib.username,dib.chidx,NULL,0);
             }
           }
         }
@@ -934,12 +1552,22 @@ void NJClient::processMessage(Net_Message *msg)
                 if (config_debug_level>1) printf("RECV BLOCK DATA %s%s %d bytes\n",guidtostr_tmp(diw.guid),diw.flags&1?":end":"",diw.audio_data_len);
 
                 ds->last_time=now;
+                RemoteUser_Channel *chan=findUserChannel(ds->username.Get(),ds->jitter_chidx);
+                if (chan) chan->jitter.dataArrived(m_jitter_clock.elapsed()/1000.0, ds->bytes);
+
                 if (diw.audio_data_len > 0 && diw.audio_data)
                 {
                   ds->Write(diw.audio_data,diw.audio_data_len);
                 }
                 if (diw.flags & 1)
                 {
+                  if (chan)
+                  {
+                    double interval_secs=m_bpm > 0 ? m_bpi*60.0/m_bpm : 0.0;
+                    chan->jitter.downloadFinished(ds->bytes, interval_secs,
+                                                  chan->dq ? chan->dq->underruns.load() : 0);
+                    if (config_debug_level>1) printf("PREBUFFER %s:%d %.0fms\n",ds->username.Get(),ds->jitter_chidx,chan->jitter.target_secs*1000.0);
+                  }
                   delete ds;
                   m_downloads.Delete(x);
                 }
@@ -1008,158 +1636,404 @@ int NJClient::Run() // nonzero if sleep ok
   for (u = 0; u < m_locchannels.GetSize(); u ++)
   {
     Local_Channel *lc=m_locchannels.Get(u);
-    WDL_HeapBuf *p=0;
-    while (!lc->m_bq.GetBlock(&p))
+    int overflows=lc->m_bq.GetOverflowCount();
+    if (overflows != lc->m_bq_overflows_seen)
     {
-      wantsleep=0;
-      if (u >= m_max_localch)
-      {
-        if (p && p != &silence_buf)
-          lc->m_bq.DisposeBlock(p);
-        p=0;
-        continue;
-      }
+      qWarning("Local channel %d upload queue overflowed %d times, audio was dropped",
+               lc->channel_idx, overflows - lc->m_bq_overflows_seen);
+      lc->m_bq_overflows_seen=overflows;
+    }
+    int lost=lc->m_bq.GetLostMarkerCount();
+    if (lost != lc->m_bq_lost_markers_seen)
+    {
+      qWarning("Local channel %d upload queue discarded %d interval markers",
+               lc->channel_idx, lost - lc->m_bq_lost_markers_seen);
+      lc->m_bq_lost_markers_seen=lost;
+    }
 
-      if (p == &silence_buf)
+    // send what the encoder has finished so far
+    Net_Message *msg;
+    while ((msg=lc->takeSend()))
+    {
+      wantsleep=0;
+      if (m_netcon) m_netcon->Send(msg);
+      else delete msg;
+    }
+
+    // one encode job per channel at a time keeps its intervals in order
+    if (!lc->m_encoding.loadAcquire() && lc->m_bq.HasBlocks())
+    {
+      m_locchan_cs.Enter();
+      lc->m_enc_params.bitrate=lc->bitrate;
+      lc->m_enc_params.min_bitrate=lc->min_bitrate;
+      lc->m_enc_params.codec=lc->codec;
+      lc->m_enc_params.simulcast=lc->simulcast;
+      m_locchan_cs.Leave();
+
+      if (lc->m_enc_params.codec == NJ_FLAC_FOURCC)
       {
-        mpb_client_upload_interval_begin cuib;
-        cuib.chidx=lc->channel_idx;
-        memset(cuib.guid,0,sizeof(cuib.guid));
-        memset(lc->guid,0,sizeof(lc->guid));
-        cuib.fourcc=0;
-        cuib.estsize=0;
-        m_netcon->Send(cuib.build());
-        p=0;
+        // cheap enough to encode right here, sent on the next pass
+        encodeLocalChannel(lc, u >= m_max_localch);
+        wantsleep=0;
       }
-      else if (p)
+      else
       {
-        // encode data
-        if (!lc->m_enc)
-        {
-          lc->m_enc = new I_NJEncoder(m_srate,1,lc->m_enc_bitrate_used = lc->bitrate,0);
-        }
+        lc->m_encoding.storeRelease(1);
+        m_encode_pool.start(new LocalChannelEncodeJob(this, lc, u >= m_max_localch));
+      }
+    }
+  }
 
-        if (lc->m_need_header)
-        {
-          lc->m_need_header=false;
-          {
-            QUuid guid = QUuid::createUuid();
-            memcpy(lc->guid, guid.toRfc4122().constData(), sizeof(lc->guid));
-
-            mpb_client_upload_interval_begin cuib;
-            cuib.chidx=lc->channel_idx;
-            memcpy(cuib.guid, lc->guid, sizeof(cuib.guid));
-            cuib.fourcc=NJ_ENCODER_FMT_TYPE;
-            cuib.estsize=0;
-            delete lc->m_enc_header_needsend;
-            lc->m_enc_header_needsend=cuib.build();
-          }
-        }
+  updateUploadBitrate();
+#endif
 
-        if (lc->m_enc)
-        {
-          lc->m_enc->Encode((float*)p->Get(),p->GetSize()/sizeof(float));
+  return wantsleep;
 
-          int s;
-          while ((s=lc->m_enc->outqueue.Available())>(lc->m_enc_header_needsend?MIN_ENC_BLOCKSIZE*4:MIN_ENC_BLOCKSIZE))
-          {
-            if (s > MAX_ENC_BLOCKSIZE) s=MAX_ENC_BLOCKSIZE;
+}
 
-            {
-              mpb_client_upload_interval_write wh;
-              memcpy(wh.guid, lc->guid, sizeof(lc->guid));
-              wh.flags=0;
-              wh.audio_data=lc->m_enc->outqueue.Get();
-              wh.audio_data_len=s;
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+// Queues what enc has encoded for the upload guid, preceded by its begin
+// message in *header if that hasn't gone out yet (header may be NULL if it
+// always has). With finish set everything left goes out and the last write
+// ends the upload.
+static void queueEncoded(Local_Channel *lc, I_NJEncoder *enc,
+                         const unsigned char *guid, Net_Message **header,
+                         bool finish)
+{
+  char guidstr[64];
 
-              if (lc->m_enc_header_needsend)
-              {
-                if (config_debug_level>1)
-                {
-                  mpb_client_upload_interval_begin dib;
-                  dib.parse(lc->m_enc_header_needsend);
-                  printf("SEND BLOCK HEADER %s\n",guidtostr_tmp(dib.guid));
-                }
-                m_netcon->Send(lc->m_enc_header_needsend);
-                lc->m_enc_header_needsend=0;
-              }
+  do
+  {
+    int s=enc->outqueue.Available();
+    if (!finish && s <= (header && *header?MIN_ENC_BLOCKSIZE*4:MIN_ENC_BLOCKSIZE)) break;
+    if (s > MAX_ENC_BLOCKSIZE) s=MAX_ENC_BLOCKSIZE;
 
-              if (config_debug_level>1) printf("SEND BLOCK %s%s %d bytes\n",guidtostr_tmp(wh.guid),wh.flags&1?"end":"",wh.audio_data_len);
+    mpb_client_upload_interval_write wh;
+    memcpy(wh.guid, guid, sizeof(wh.guid));
+    wh.audio_data=enc->outqueue.Get();
+    wh.audio_data_len=s;
 
-              m_netcon->Send(wh.build());
-            }
+    enc->outqueue.Advance(s);
+    wh.flags=finish && enc->outqueue.GetSize() <= 0 ? 1 : 0;
 
-            lc->m_enc->outqueue.Advance(s);
-          }
-          lc->m_enc->outqueue.Compact();
-        }
-        lc->m_bq.DisposeBlock(p);
-        p=0;
-      }
-      else
+    if (header && *header)
+    {
+      if (config_debug_level>1)
       {
-        if (lc->m_enc)
-        {
-          // finish any encoding
-          lc->m_enc->Encode(NULL,0);
+        mpb_client_upload_interval_begin dib;
+        dib.parse(*header);
+        printf("SEND BLOCK HEADER %s\n",guidtostr_buf(dib.guid,guidstr));
+      }
+      lc->queueSend(*header);
+      *header=0;
+    }
 
-          // send any final message, with the last one with a flag 
-          // saying "we're done"
-          do
-          {
-            mpb_client_upload_interval_write wh;
-            int l=lc->m_enc->outqueue.Available();
-            if (l>MAX_ENC_BLOCKSIZE) l=MAX_ENC_BLOCKSIZE;
+    if (config_debug_level>1) printf("SEND BLOCK %s%s %d bytes\n",guidtostr_buf(wh.guid,guidstr),wh.flags&1?"end":"",wh.audio_data_len);
 
-            memcpy(wh.guid, lc->guid, sizeof(wh.guid));
-            wh.audio_data=lc->m_enc->outqueue.Get();
-            wh.audio_data_len=l;
+    lc->queueSend(wh.build());
+  }
+  while (enc->outqueue.Available()>0);
 
-            lc->m_enc->outqueue.Advance(l);
-            wh.flags=lc->m_enc->outqueue.GetSize()>0 ? 0 : 1;
+  enc->outqueue.Compact(); // free any memory left
+}
 
-            if (lc->m_enc_header_needsend)
-            {
-              if (config_debug_level>1)
-              {
-                mpb_client_upload_interval_begin dib;
-                dib.parse(lc->m_enc_header_needsend);
-                printf("SEND BLOCK HEADER %s\n",guidtostr_tmp(dib.guid));
-              }
-              m_netcon->Send(lc->m_enc_header_needsend);
-              lc->m_enc_header_needsend=0;
-            }
+// Called from an encoder pool thread, or the client event loop for FLAC
+void NJClient::encodeLocalChannel(Local_Channel *lc, bool discard)
+{
+  const Local_Channel::EncodeParams &params=lc->m_enc_params;
+  QElapsedTimer timer;
+  timer.start();
+  int nsamples=0;
+
+  float *samples;
+  int len, nch;
+  while (!lc->m_bq.GetBlock(&samples, &len, &nch))
+  {
+    if (discard)
+    {
+      lc->m_bq.DisposeBlock();
+      continue;
+    }
 
-            if (config_debug_level>1) printf("SEND BLOCK %s%s %d bytes\n",guidtostr_tmp(wh.guid),wh.flags&1?"end":"",wh.audio_data_len);
-            m_netcon->Send(wh.build());
-          }
-          while (lc->m_enc->outqueue.Available()>0);
-          lc->m_enc->outqueue.Compact(); // free any memory left
+    if (len < 0)
+    {
+      mpb_client_upload_interval_begin cuib;
+      cuib.chidx=lc->channel_idx;
+      memset(cuib.guid,0,sizeof(cuib.guid));
+      memset(lc->guid,0,sizeof(lc->guid));
+      cuib.fourcc=0;
+      cuib.estsize=0;
+      lc->queueSend(cuib.build());
+    }
+    else if (len > 0)
+    {
+      // encode data, switching between mono and stereo between intervals.
+      // The encoder is kept across intervals unless its settings change.
+      if (lc->m_enc && lc->m_need_header &&
+          (nch != lc->m_enc_nch_used || m_srate != lc->m_enc_srate_used ||
+           params.codec != lc->m_enc_codec_used))
+      {
+        delete lc->m_enc;
+        lc->m_enc=0;
+      }
+      if (!lc->m_enc)
+      {
+        lc->m_enc_srate_used = m_srate;
+        lc->m_enc_codec_used = params.codec;
+        lc->m_enc_bitrate_used = effectiveBitrate(params.bitrate,params.min_bitrate,m_upload_bitrate_pct.loadAcquire());
+        lc->m_enc = CreateNJEncoder(params.codec,m_srate,lc->m_enc_nch_used = nch,lc->m_enc_bitrate_used);
+      }
 
-          //delete m_enc;
-        //  m_enc=0;
-          lc->m_enc->reinit();
+      if (lc->m_need_header)
+      {
+        lc->m_need_header=false;
+        {
+          QUuid guid = QUuid::createUuid();
+          memcpy(lc->guid, guid.toRfc4122().constData(), sizeof(lc->guid));
+
+          mpb_client_upload_interval_begin cuib;
+          cuib.chidx=lc->channel_idx;
+          memcpy(cuib.guid, lc->guid, sizeof(cuib.guid));
+          cuib.fourcc=lc->m_enc->GetFourcc();
+          cuib.estsize=0;
+          delete lc->m_enc_header_needsend;
+          lc->m_enc_header_needsend=cuib.build();
+        }
+
+        if (params.simulcast && m_server_simulcast.loadAcquire() &&
+            params.codec != NJ_FLAC_FOURCC)
+        {
+          setupVariants(lc, nch);
         }
+      }
+
+      if (lc->m_enc)
+      {
+        // takes the first channel, or duplicates a mono one, if the
+        // source changed in the middle of an interval
+        lc->m_enc->Encode(samples,len,nch,nch > 1 ? 1 : 0);
+        nsamples+=len;
 
-        if (lc->m_enc && lc->bitrate != lc->m_enc_bitrate_used)
+        queueEncoded(lc, lc->m_enc, lc->guid, &lc->m_enc_header_needsend, false);
+      }
+
+      int v;
+      for (v = 0; v < lc->m_num_variants; v ++)
+      {
+        Local_Channel::Variant *var=&lc->m_variants[v];
+        var->enc->Encode(samples,len,nch,nch > 1 ? 1 : 0);
+        queueEncoded(lc, var->enc, var->guid, NULL, false);
+      }
+    }
+    else
+    {
+      if (lc->m_enc)
+      {
+        // finish any encoding, the last write says "we're done"
+        lc->m_enc->Encode(NULL,0);
+        queueEncoded(lc, lc->m_enc, lc->guid, &lc->m_enc_header_needsend, true);
+        lc->m_enc->reinit();
+      }
+
+      int v;
+      for (v = 0; v < lc->m_num_variants; v ++)
+      {
+        Local_Channel::Variant *var=&lc->m_variants[v];
+        var->enc->Encode(NULL,0);
+        queueEncoded(lc, var->enc, var->guid, NULL, true);
+        var->enc->reinit();
+      }
+      lc->m_num_variants=0;
+
+      // follow the upload bitrate between intervals, without rebuilding
+      // the encoder if it can change bitrate by itself
+      int bitrate=effectiveBitrate(params.bitrate,params.min_bitrate,m_upload_bitrate_pct.loadAcquire());
+      if (lc->m_enc && bitrate != lc->m_enc_bitrate_used)
+      {
+        if (lc->m_enc->SetBitrate(bitrate)) lc->m_enc_bitrate_used=bitrate;
+        else
         {
           delete lc->m_enc;
           lc->m_enc=0;
         }
-        lc->m_need_header=true;
-
-        // end the last encode
       }
+      lc->m_need_header=true;
+
+      // end the last encode
+    }
+    lc->m_bq.DisposeBlock();
+  }
+
+  // Everything is queued for sending, get the next interval's encoder state
+  // ready now rather than at the interval boundary
+  if (lc->m_enc) lc->m_enc->PrepareNext();
+  int v;
+  for (v = 0; v < MAX_INTERVAL_VARIANTS-1; v ++)
+  {
+    if (lc->m_variants[v].enc) lc->m_variants[v].enc->PrepareNext();
+  }
+
+  if (nsamples > 0)
+  {
+    // fraction of real-time spent encoding
+    double load=(double)timer.nsecsElapsed() * m_srate / (nsamples * 1000000000.0);
+    lc->updateEncodeLoad(load);
+    if (config_debug_level>1) printf("ENCODE channel %d %d samples %.1f%% of real-time\n",lc->channel_idx,nsamples,load*100.0);
+  }
+}
+
+// Starts lower bitrate copies of the interval that was just begun, halving
+// the bitrate each time, and tells the server they belong together so it can
+// forward whichever one each listener's connection keeps up with.
+void NJClient::setupVariants(Local_Channel *lc, int nch)
+{
+  const Local_Channel::EncodeParams &params=lc->m_enc_params;
+  mpb_client_upload_interval_variants civ;
+  civ.chidx=lc->channel_idx;
+  memcpy(civ.guids[0], lc->guid, sizeof(civ.guids[0]));
+  civ.bitrates[0]=lc->m_enc_bitrate_used;
+
+  int br=lc->m_enc_bitrate_used;
+  lc->m_num_variants=0;
+  while (lc->m_num_variants < MAX_INTERVAL_VARIANTS-1)
+  {
+    br/=2;
+    br-=br%8;
+    if (br < SIMULCAST_MIN_BITRATE) break;
+
+    Local_Channel::Variant *var=&lc->m_variants[lc->m_num_variants];
+    if (var->enc && (nch != var->nch || m_srate != var->srate ||
+                     params.codec != var->codec ||
+                     (br != var->bitrate && !var->enc->SetBitrate(br))))
+    {
+      delete var->enc;
+      var->enc=0;
     }
+    if (!var->enc)
+    {
+      var->nch=nch;
+      var->srate=m_srate;
+      var->codec=params.codec;
+      var->enc=CreateNJEncoder(params.codec,m_srate,nch,br);
+    }
+    var->bitrate=br;
+
+    QUuid guid = QUuid::createUuid();
+    memcpy(var->guid, guid.toRfc4122().constData(), sizeof(var->guid));
+
+    memcpy(civ.guids[1+lc->m_num_variants], var->guid, sizeof(var->guid));
+    civ.bitrates[1+lc->m_num_variants]=br;
+    lc->m_num_variants++;
   }
+
+  // goes out before any of the begin messages, and the server only knows
+  // a variant for what it is until the main upload ends, so the variant
+  // begin messages go out right away rather than with their first data
+  if (lc->m_num_variants)
+  {
+    civ.num_variants=1+lc->m_num_variants;
+    lc->queueSend(civ.build());
+
+    int v;
+    for (v = 0; v < lc->m_num_variants; v ++)
+    {
+      Local_Channel::Variant *var=&lc->m_variants[v];
+      mpb_client_upload_interval_begin cuib;
+      cuib.chidx=lc->channel_idx;
+      memcpy(cuib.guid, var->guid, sizeof(cuib.guid));
+      cuib.fourcc=var->enc->GetFourcc();
+      cuib.estsize=0;
+      lc->queueSend(cuib.build());
+    }
+  }
+}
+
+// Lower the bitrate of local channels when the connection to the server
+// can't send what they encode in time, and raise it again slowly once the
+// backlog is gone, see Net_SendRateEstimator. Encoders pick up the new
+// bitrate at the next interval.
+void NJClient::updateUploadBitrate()
+{
+  if (!m_netcon) return;
+
+  int pct=m_upload_rate.Update(m_netcon,m_upload_bitrate_pct.load());
+  if (pct != m_upload_bitrate_pct.load())
+  {
+    if (config_debug_level>0) printf("UPLOAD backlog %lld bytes, drain %.0f bytes/s, bitrate %d%%\n",(long long)m_upload_rate.GetBacklog(),m_upload_rate.GetDrainRate(),pct);
+    m_upload_bitrate_pct.storeRelease(pct);
+  }
+
+  int kbps=GetUploadBitrate();
+  if (kbps != m_upload_bitrate_shown)
+  {
+    m_upload_bitrate_shown=kbps;
+    emit uploadBitrateChanged(kbps);
+  }
+}
 #endif
 
-  return wantsleep;
+void NJClient::encoderFinished()
+{
+  while (!Run());
+}
+
+void NJClient::decoderFinished()
+{
+  queueDecodedIntervals();
+}
 
+// Prepare the next interval of a remote channel on the decoder pool. Decoder
+// setup and the first decode are too slow for the client event loop when
+// many channels start an interval at once.
+void NJClient::startDecodeState(const char *username, int chidx, DecodeBuffer *decodeBuffer, unsigned int fourcc)
+{
+  RemoteUser_Channel *chan=findUserChannel(username, chidx);
+  DecodeStateJob *job=new DecodeStateJob(this, username, chidx, decodeBuffer,
+                                         fourcc, chan ? chan->decoders : NULL);
+  m_decode_jobs.Add(job);
+  if (decodeBuffer) m_decode_pool.start(job);
+  else queueDecodedIntervals();
+}
+
+// Hand prepared intervals to the audio thread. A channel's intervals are
+// queued in the order they started, even if a later one finishes first.
+void NJClient::queueDecodedIntervals()
+{
+  int x;
+  for (x = 0; x < m_decode_jobs.GetSize(); x ++)
+  {
+    DecodeStateJob *job=m_decode_jobs.Get(x);
+    if (!job->isDone()) continue;
+
+    int y;
+    for (y = 0; y < x; y ++)
+    {
+      DecodeStateJob *prev=m_decode_jobs.Get(y);
+      if (prev->chidx == job->chidx && !strcmp(prev->username.Get(),job->username.Get())) break;
+    }
+    if (y < x) continue; // an earlier interval of this channel is not ready
+
+    RemoteUser_Channel *chan=findUserChannel(job->username.Get(),job->chidx);
+    DecodeState *ds=job->takeDecodeState();
+    if (!chan || !chan->dq) delete ds;
+    else delete chan->dq->queueNext(ds);
+
+    delete job;
+    m_decode_jobs.Delete(x--);
+  }
+}
+
+// Drop intervals that have not been queued yet, e.g. when disconnecting
+void NJClient::discardDecodeJobs()
+{
+  m_decode_pool.waitForDone();
+  m_decode_jobs.Empty(true);
 }
 
 void NJClient::tick()
 {
+  reclaimMixState();
+
   while (!Run());
 
   if (GetStatus() == NJClient::NJC_STATUS_OK) {
@@ -1209,35 +2083,105 @@ void NJClient::processInputChannels(float **inbuf, int innch,
                                     float **outbuf, int outnch,
                                     int len, bool justmonitor)
 {
+  AudioStage stage(m_telemetry, AudioTelemetry::STAGE_INPUT);
+
                      // -36dB/sec
   double decay = pow(.25*0.25*0.25, len / (double)m_srate);
   int u;
 
+  // Channel buffers stay around until all processors have run, see EffectWorkers
+  float *srcs[MAX_LOCAL_CHANNELS][2];
+  int nchs[MAX_LOCAL_CHANNELS];
+  EffectWorkers::Job jobs[MAX_LOCAL_CHANNELS];
+  int njobs=0;
+
   m_locchan_cs.Enter();
-  for (u = 0; u < m_locchannels.GetSize() && u < m_max_localch; u ++)
+  int numch=m_locchannels.GetSize();
+  if (numch > m_max_localch) numch=m_max_localch;
+  if (numch > MAX_LOCAL_CHANNELS) numch=MAX_LOCAL_CHANNELS;
+
+  for (u = 0; u < numch; u ++)
   {
     Local_Channel *lc=m_locchannels.Get(u);
     int sc=lc->src_channel;
-    float *src=NULL;
-    if (sc >= 0 && sc < innch) src=inbuf[sc];
+    int nch=(sc >= 0 && sc != NJ_SRCCH_MIX && (sc & NJ_SRCCH_STEREO)) ? 2 : 1;
+    float *src[2]={NULL,NULL};
+    if (sc == NJ_SRCCH_MIX)
+    {
+      if (innch == 1) src[0]=inbuf[0];
+    }
+    else if (sc >= 0)
+    {
+      sc&=NJ_SRCCH_STEREO-1;
+      if (sc < innch) src[0]=inbuf[sc];
+      if (nch > 1 && sc+1 < innch) src[1]=inbuf[sc+1];
+    }
 
-    if (lc->cbf || !src)
+    // inputs are used in place unless they need mixing or processing
+    if (lc->cbf || !src[0] || (nch > 1 && !src[1]))
     {
       int bytelen=len*(int)sizeof(float);
-      if (tmpblock.GetSize() < bytelen) tmpblock.Resize(bytelen);
+      if (tmpblock.GetSize() < bytelen*2*numch) tmpblock.Resize(bytelen*2*numch);
+
+      int ch;
+      for (ch = 0; ch < nch; ch ++)
+      {
+        float *buf=(float *)tmpblock.Get() + (u*2+ch)*len;
 
-      if (src) memcpy(tmpblock.Get(),src,bytelen);
-      else memset(tmpblock.Get(),0,bytelen);
+        if (src[ch]) memcpy(buf,src[ch],bytelen);
+        else if (lc->src_channel == NJ_SRCCH_MIX && innch > 0)
+        {
+          // mono mix of all inputs
+          int i,x;
+          memcpy(buf,inbuf[0],bytelen);
+          for (i = 1; i < innch; i ++)
+            for (x = 0; x < len; x ++) buf[x]+=inbuf[i][x];
+          float scale=1.0f/innch;
+          for (x = 0; x < len; x ++) buf[x]*=scale;
+        }
+        else memset(buf,0,bytelen);
 
-      src=(float* )tmpblock.Get();
+        src[ch]=buf;
+      }
 
-      // processor
       if (lc->cbf)
       {
-        lc->cbf(src,len,lc->cbf_inst);
+        EffectWorkers::Job *job=&jobs[njobs++];
+        job->fn=lc->cbf;
+        job->inst=lc->cbf_inst;
+        job->bufs[0]=src[0];
+        job->bufs[1]=src[1];
+        job->nch=nch;
       }
     }
 
+    srcs[u][0]=src[0];
+    srcs[u][1]=src[1];
+    nchs[u]=nch;
+  }
+
+  // processors, in parallel when several channels have one
+  if (njobs)
+  {
+    AudioStage stage(m_telemetry, AudioTelemetry::STAGE_EFFECTS);
+    qint64 deadline=m_srate > 0 ? (qint64)len*1000000000/m_srate*EFFECT_JOIN_DEADLINE_PCT/100 : 0;
+    bool ontime=m_effect_workers.run(jobs, njobs, len, deadline);
+
+    if (m_telemetry)
+    {
+      if (!ontime) m_telemetry->countEffectJoinMiss();
+      int w;
+      for (w = 0; w < m_effect_workers.numWorkers(); w ++)
+        m_telemetry->addWorkerTime(w, m_effect_workers.workerNs(w));
+    }
+  }
+
+  for (u = 0; u < numch; u ++)
+  {
+    Local_Channel *lc=m_locchannels.Get(u);
+    float *src[2]={srcs[u][0],srcs[u][1]};
+    int nch=nchs[u];
+
     if (!justmonitor)
     {
       // Samples to broadcast this interval
@@ -1249,7 +2193,7 @@ void NJClient::processInputChannels(float **inbuf, int innch,
       if (lc->bcast_active)
       {
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
-        lc->m_bq.AddBlock(src, thisLen);
+        lc->m_bq.AddBlock(src, nch, thisLen);
 #endif
       }
 
@@ -1259,12 +2203,12 @@ void NJClient::processInputChannels(float **inbuf, int innch,
         if (lc->bcast_active)
         {
           // End this interval
-          lc->m_bq.AddBlock(NULL,0);
+          lc->m_bq.AddBlock(NULL,0,0);
 
           // Silence next interval
           if (!lc->broadcasting)
           {
-            lc->m_bq.AddBlock(NULL,-1);
+            lc->m_bq.AddBlock(NULL,0,-1);
           }
         }
 
@@ -1276,7 +2220,8 @@ void NJClient::processInputChannels(float **inbuf, int innch,
 
       if (nextLen > 0 && lc->bcast_active) {
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
-        lc->m_bq.AddBlock(src + thisLen, nextLen);
+        float *next[2]={src[0]+thisLen,nch > 1 ? src[1]+thisLen : NULL};
+        lc->m_bq.AddBlock(next, nch, nextLen);
 #endif
       }
     }
@@ -1285,6 +2230,8 @@ void NJClient::processInputChannels(float **inbuf, int innch,
     if ((!m_issoloactive && !lc->muted) || lc->solo)
     {
       float *out1=outbuf[0];
+      float *src1=src[0];
+      float *src2=nch > 1 ? src[1] : src[0];
 
       float vol1=lc->volume;
       if (outnch > 1)
@@ -1299,7 +2246,7 @@ void NJClient::processInputChannels(float **inbuf, int innch,
         int x=len;
         while (x--) 
         {
-          float f=src[0] * vol1;
+          float f=*src1++ * vol1;
 
           if (f > maxf) maxf=f;
           else if (f < -maxf) maxf=-f;
@@ -1309,7 +2256,7 @@ void NJClient::processInputChannels(float **inbuf, int innch,
 
           *out1++ += f;
 
-          f=src[0]*vol2;
+          f=*src2++ * vol2;
 
           if (f > maxf) maxf=f;
           else if (f < -maxf) maxf=-f;
@@ -1318,17 +2265,18 @@ void NJClient::processInputChannels(float **inbuf, int innch,
           else if (f < -1.0) f=-1.0;
 
           *out2++ += f;
-          src++;
         }
         lc->decode_peak_vol=maxf;
       }
       else
       {
         float maxf=(float) (lc->decode_peak_vol*decay);
+        if (nch > 1) vol1*=0.5f;
         int x=len;
         while (x--) 
         {
-          float f=*src++ * vol1;
+          float f=*src1++ * vol1;
+          if (nch > 1) f+=*src2++ * vol1;
           if (f > maxf) maxf=f;
           else if (f < -maxf) maxf=-f;
 
@@ -1351,36 +2299,28 @@ void NJClient::process_samples(float **outbuf, int outnch,
                                double outputBufferDacTime)
 
 {
+  AudioStage stage(m_telemetry, AudioTelemetry::STAGE_MIX);
+
                    // -36dB/sec
   double decay = pow(.25*0.25*0.25, len / (double)m_srate);
 
   if (!justmonitor)
   {
     // mix in all active (subscribed) channels
-    m_users_cs.Enter();
-    for (int u = 0; u < m_remoteusers.GetSize(); u ++)
+    RemoteMixState *mix=m_mix_current;
+    for (int x = 0; x < mix->numchannels; x ++)
     {
-      RemoteUser *user=m_remoteusers.Get(u);
-      int ch;
-      if (!user) continue;
+      RemoteMixState::Channel *chan=&mix->channels[x];
+      if (!chan->subscribed) continue;
 
-      for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
-      {
-        float lpan=user->pan+user->channels[ch].pan;
-        if (lpan<-1.0)lpan=-1.0;
-        else if (lpan>1.0)lpan=1.0;
-
-        bool muteflag;
-        if (m_issoloactive) muteflag = !(user->solomask & (1<<ch));
-        else muteflag=(user->mutedmask & (1<<ch)) || user->muted;
-
-        if (user->channels[ch].ds)
-          mixInChannel(muteflag, user->volume * user->channels[ch].volume,
-                       lpan, user->channels[ch].ds, outbuf, len, outnch,
-                       offset, decay);
-      }
+      DecodeState *ds=chan->dq->ds.load();
+      if (!ds) continue;
+
+      if (mixInChannel(chan->muted, chan->vol,
+                       outnch > 1 ? chan->vol1 : chan->vol0, chan->vol2,
+                       ds, outbuf, len, outnch, offset, decay))
+        chan->dq->underruns.fetchAndAddRelaxed(1);
     }
-    m_users_cs.Leave();
   }
 
   // apply master volume, then
@@ -1421,15 +2361,11 @@ void NJClient::process_samples(float **outbuf, int outnch,
     output_peaklevel=maxf;
   }
 
-  // mix in (super shitty) metronome (fucko!!!!)
+  // mix in metronome
   if (!justmonitor)
   {
-    int metrolen = m_srate / 100;
-    double sc = 6000.0 / (double)m_srate;
-    int x;
-    int um=config_metronome>0.0001f;
-    double vol1=config_metronome_mute?0.0:config_metronome,vol2=vol1;
-    float *ptr1=outbuf[0]+offset;
+    AudioStage stage(m_telemetry, AudioTelemetry::STAGE_METRONOME);
+    float vol1=config_metronome_mute||config_metronome<=0.0001f?0.0f:config_metronome,vol2=vol1;
     float *ptr2=NULL;
     if (outnch > 1)
     {
@@ -1437,31 +2373,8 @@ void NJClient::process_samples(float **outbuf, int outnch,
         if (config_metronome_pan > 0.0f) vol1 *= 1.0f-config_metronome_pan;
         else if (config_metronome_pan< 0.0f) vol2 *= 1.0f+config_metronome_pan;
     }
-    for (x = 0; x < len; x ++)
-    {
-      if (m_metronome_pos <= 0.0)
-      {
-        m_metronome_state=1;
-        m_metronome_tmp=(m_interval_pos+x)<m_metronome_interval;
-        m_metronome_pos += (double)m_metronome_interval;
-      }
-      m_metronome_pos-=1.0;
-
-      if (m_metronome_state>0)
-      {
-        if (um)
-        {
-          double val=0.0;
-          if (!m_metronome_tmp) val = sin((double)m_metronome_state*sc*2.0) * 0.25;
-          else val = sin((double)m_metronome_state*sc);
-
-          ptr1[x]+=(float)(val*vol1);
-          if (ptr2) ptr2[x]+=(float)(val*vol2);
-        }
-        if (++m_metronome_state >= metrolen) m_metronome_state=0;
-
-      }
-    }   
+    m_metronome.process(outbuf[0]+offset, ptr2, len, m_interval_pos,
+                        m_metronome_interval, vol1, vol2);
   }
 
   /* MIDI Beat Clock */
@@ -1489,92 +2402,163 @@ void NJClient::process_samples(float **outbuf, int outnch,
   }
 }
 
-void NJClient::mixInChannel(bool muted, float vol, float pan, DecodeState *chan, float **outbuf, int len, int outnch, int offs, double vudecay)
+// Returns true if the channel just ran out of downloaded data
+bool NJClient::mixInChannel(bool muted, float vol, double vol1, double vol2, DecodeState *chan, float **outbuf, int len, int outnch, int offs, double vudecay)
 {
-  if (!chan->decode_codec || !chan->decodeBuffer) return;
+  I_NJDecoder *codec = chan->decode_codec;
+  if (!codec || !chan->decodeBuffer) return false;
 
+  int nch = codec->GetNumChannels();
+  if (nch > NJ_DECODER_MAX_CHANNELS) nch = NJ_DECODER_MAX_CHANNELS;
   int needed;
-  while (chan->decode_codec->m_samples_used <=
-        (needed = resampleLengthNeeded(chan->decode_codec->GetSampleRate(), m_srate,
-                                       len, &chan->resample_state) *
-         chan->decode_codec->GetNumChannels()))
   {
-    if (!chan->fillDecodeBuffer(128)) {
-      break;
+    AudioStage stage(m_telemetry, AudioTelemetry::STAGE_DECODE);
+    for (;;)
+    {
+      needed = resampleLengthNeeded(codec->GetSampleRate(), m_srate, len,
+                                    &chan->resample_state);
+
+      // skip sample frames we fell behind on during an earlier underrun
+      if (chan->dump_frames > 0)
+      {
+        int l = codec->DecodeGetAvailable();
+        if (l > chan->dump_frames) l = chan->dump_frames;
+        codec->DecodeAdvance(l);
+        chan->decode_samplesout += l;
+        chan->dump_frames -= l;
+      }
+
+      if (!chan->dump_frames && codec->DecodeGetAvailable() > needed) break;
+      if (!chan->fillDecodeBuffer(128)) break;
     }
   }
 
-  if (chan->decode_codec->m_samples_used >= needed+chan->dump_samples)
+  float *sptr[NJ_DECODER_MAX_CHANNELS];
+  if (!chan->dump_frames && needed <= codec->DecodeGetMaxRead() &&
+      codec->DecodePeek(sptr) >= needed)
   {
-    float *sptr=(float *)chan->decode_codec->m_samples.Get();
-
     // process VU meter, yay for powerful CPUs
     if (!muted && vol > 0.0000001) 
     {
-      float *p=sptr;
-      int l=(needed+chan->dump_samples)*chan->decode_codec->GetNumChannels();
       float maxf=(float) (chan->decode_peak_vol*vudecay/vol);
-      while (l--)
+      for (int c = 0; c < nch; c ++)
       {
-        float f=*p++;
-        if (f > maxf) maxf=f;
-        else if (f < -maxf) maxf=-f;
+        const float *p=sptr[c];
+        for (int x = 0; x < needed; x ++)
+        {
+          float f=p[x];
+          if (f > maxf) maxf=f;
+          else if (f < -maxf) maxf=-f;
+        }
       }
       chan->decode_peak_vol=maxf*vol;
 
       float *tmpbuf[2]={outbuf[0]+offs,outnch > 1 ? (outbuf[1]+offs) : 0};
-      mixFloatsNIOutput(sptr+chan->dump_samples,
-              chan->decode_codec->GetSampleRate(),
-              chan->decode_codec->GetNumChannels(),
+      mixFloatsNIOutputGains(sptr,
+              codec->GetSampleRate(),
+              nch,
               tmpbuf,
               m_srate, outnch > 1 ? 2 : 1, len,
-              vol, pan, &chan->resample_state);
+              vol1, vol2, &chan->resample_state);
     }
     else
       chan->decode_peak_vol=0.0;
 
     // advance the queue
-    chan->decode_samplesout += needed/chan->decode_codec->GetNumChannels();
-    chan->decode_codec->m_samples_used -= needed+chan->dump_samples;
-    memmove(sptr,sptr+needed+chan->dump_samples,chan->decode_codec->m_samples_used*sizeof(float));
-    chan->dump_samples=0;
+    chan->decode_samplesout += needed;
+    codec->DecodeAdvance(needed);
+    return false;
   }
   else
   {
-    chan->decode_samplesout += chan->decode_codec->m_samples_used/chan->decode_codec->GetNumChannels();
-    chan->decode_codec->m_samples_used=0;
-    chan->dump_samples+=needed;
+    // underrun, play silence and catch up once more data arrives
+    bool underrun = !chan->dump_frames && !chan->decodeBuffer->isFinished();
+    int l = codec->DecodeGetAvailable();
+    chan->decode_samplesout += l;
+    codec->DecodeAdvance(l);
+    chan->dump_frames += needed - l;
+    return underrun;
   }
 }
 
 void NJClient::on_new_interval()
 {
-  m_metronome_pos=0.0;
+  m_metronome.restart();
 
-  m_users_cs.Enter();
-  for (int u = 0; u < m_remoteusers.GetSize(); u ++)
+  RemoteMixState *mix=m_mix_current;
+  for (int x = 0; x < mix->numchannels; x ++)
   {
-    RemoteUser *user=m_remoteusers.Get(u);
-    int ch;
-//    printf("submask=%d,cpm=%d\n",user->submask , user->chanpresentmask);
-    for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+    RemoteMixState::Channel *chan=&mix->channels[x];
+    DecodeQueue *dq=chan->dq;
+
+    DecodeState *next=dq->takeNext(); // advance queue
+    if (!chan->subscribed)
     {
-      RemoteUser_Channel *chan=&user->channels[ch];
-      delete chan->ds;
-      chan->ds=0;
-      if ((user->submask & user->chanpresentmask) & (1<<ch)) chan->ds = chan->next_ds[0];
-      else delete chan->next_ds[0];
-      chan->next_ds[0]=chan->next_ds[1]; // advance queue
-      chan->next_ds[1]=0;
+      retireDecodeState(next);
+      next=NULL;
     }
+    retireDecodeState(dq->ds.fetchAndStoreRelease(next));
   }
-  m_users_cs.Leave();
   
   //if (m_enc->isError()) printf("ERROR\n");
   //else printf("YAY\n");
 
 }
 
+// Called from the audio thread, the decoder and its buffers are freed by
+// m_reclaimer
+void NJClient::retireDecodeState(DecodeState *ds)
+{
+  m_reclaimer.retire(ds);
+}
+
+// Make the current m_remoteusers settings visible to the audio thread. Call
+// after every change that affects mixing.
+void NJClient::publishMixState()
+{
+  RemoteMixState *state=new RemoteMixState(++m_mix_generation, m_remoteusers,
+                                           !!m_issoloactive);
+  RemoteMixState *old=m_mix_state.fetchAndStoreOrdered(state);
+
+  // old is the newest state that can still refer to the orphans
+  int x;
+  for (x = 0; x < m_mix_orphans.GetSize(); x ++) old->orphans.Add(m_mix_orphans.Get(x));
+  m_mix_orphans.Empty();
+
+  old->retired_by=state->generation;
+  m_mix_retired.Add(old);
+
+  reclaimMixState();
+}
+
+// Queues of removed channels are freed along with the last mix state that
+// refers to them
+void NJClient::retireDecodeQueue(DecodeQueue *dq)
+{
+  if (dq) m_mix_orphans.Add(dq);
+}
+
+// Free replaced mix states once the audio thread has moved past them. Use
+// force only when the audio thread is known to be stopped.
+void NJClient::reclaimMixState(bool force)
+{
+  // AudioProc() sets busy before loading m_mix_state, so when it is not busy
+  // the next callback will see the latest state
+  bool idle = force || !m_mix_busy.fetchAndAddOrdered(0);
+  unsigned int ack = m_mix_ack.loadAcquire();
+
+  int x;
+  for (x = 0; x < m_mix_retired.GetSize(); x ++)
+  {
+    RemoteMixState *state=m_mix_retired.Get(x);
+    if (idle || (int)(ack - state->retired_by) >= 0)
+    {
+      delete state;
+      m_mix_retired.Delete(x--);
+    }
+  }
+}
+
 
 char *NJClient::GetUserState(int idx, float *vol, float *pan, bool *mute)
 {
@@ -1593,6 +2577,7 @@ void NJClient::SetUserState(int idx, bool setvol, float vol, bool setpan, float
   if (setvol) p->volume=vol;
   if (setpan) p->pan=pan;
   if (setmute) p->muted=mute;
+  publishMixState();
 }
 
 int NJClient::EnumUserChannels(int useridx, int i)
@@ -1642,16 +2627,10 @@ void NJClient::SetUserChannelState(int useridx, int channelidx,
       su.build_add_rec(user->name.Get(),(user->submask&=~(1<<channelidx)));
       m_netcon->Send(su.build());
 
-      DecodeState *tmp,*tmp2,*tmp3;
-      m_users_cs.Enter();
-      tmp=p->ds; p->ds=0;
-      tmp2=p->next_ds[0]; p->next_ds[0]=0;
-      tmp3=p->next_ds[1]; p->next_ds[1]=0;
-      m_users_cs.Leave();
-
-      delete tmp;
-      delete tmp2;   
-      delete tmp3;   
+      // drop queued intervals, the audio thread keeps using the old queue
+      // until it sees the new one
+      retireDecodeQueue(p->dq);
+      p->dq=new DecodeQueue;
     }
     else
     {
@@ -1687,6 +2666,7 @@ void NJClient::SetUserChannelState(int useridx, int channelidx,
       if (x == m_remoteusers.GetSize()) m_issoloactive&=~1;
     }
   }
+  publishMixState();
 }
 
 
@@ -1696,9 +2676,44 @@ float NJClient::GetUserChannelPeak(int useridx, int channelidx)
   RemoteUser_Channel *p=m_remoteusers.Get(useridx)->channels + channelidx;
   RemoteUser *user=m_remoteusers.Get(useridx);
   if (!(user->chanpresentmask & (1<<channelidx))) return 0.0f;
-  if (!p->ds) return 0.0f;
+  if (!p->dq) return 0.0f;
+
+  // only freed by this thread, see reclaimMixState()
+  DecodeState *ds=p->dq->ds.loadAcquire();
+  if (!ds) return 0.0f;
+
+  return (float)ds->decode_peak_vol;
+}
+
+int NJClient::GetUserChannelPrebuffer(int useridx, int channelidx, unsigned int *underruns)
+{
+  if (underruns) *underruns=0;
+  if (useridx<0 || useridx>=m_remoteusers.GetSize()||channelidx<0||channelidx>=MAX_USER_CHANNELS) return -1;
+  RemoteUser_Channel *p=m_remoteusers.Get(useridx)->channels + channelidx;
+  if (underruns) *underruns=p->jitter.underruns;
+  if (p->jitter.bytes_per_sec <= 0.0) return -1;
+  return (int)(p->jitter.target_secs*1000.0 + 0.5);
+}
+
+RemoteUser_Channel *NJClient::findUserChannel(const char *username, int chidx)
+{
+  if (chidx < 0 || chidx >= MAX_USER_CHANNELS) return NULL;
+
+  int x;
+  for (x = 0; x < m_remoteusers.GetSize(); x ++)
+  {
+    RemoteUser *user=m_remoteusers.Get(x);
+    if (!strcmp(user->name.Get(),username)) return &user->channels[chidx];
+  }
+  return NULL;
+}
 
-  return (float)p->ds->decode_peak_vol;
+float NJClient::GetLocalChannelEncodeLoad(int ch)
+{
+  int x;
+  for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
+  if (x == m_locchannels.GetSize()) return 0.0f;
+  return (float)m_locchannels.Get(x)->getEncodeLoad();
 }
 
 float NJClient::GetLocalChannelPeak(int ch)
@@ -1712,6 +2727,8 @@ float NJClient::GetLocalChannelPeak(int ch)
 
 void NJClient::DeleteLocalChannel(int ch)
 {
+  m_encode_pool.waitForDone();
+
   m_locchan_cs.Enter();
   int x;
   for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
@@ -1723,7 +2740,7 @@ void NJClient::DeleteLocalChannel(int ch)
   m_locchan_cs.Leave();
 }
 
-void NJClient::SetLocalChannelProcessor(int ch, void (*cbf)(float *, int ns, void *), void *inst)
+void NJClient::SetLocalChannelProcessor(int ch, void (*cbf)(float **, int nch, int ns, qint64 timeLeftNs, void *), void *inst)
 {
   int x;
   for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
@@ -1786,6 +2803,58 @@ char *NJClient::GetLocalChannelInfo(int ch, int *srcch, int *bitrate, bool *broa
   return c->name.Get();
 }
 
+void NJClient::SetLocalChannelCodec(int ch, unsigned int fourcc)
+{
+  m_locchan_cs.Enter();
+  int x;
+  for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
+  if (x < m_locchannels.GetSize()) m_locchannels.Get(x)->codec=fourcc;
+  m_locchan_cs.Leave();
+}
+
+void NJClient::SetLocalChannelSimulcast(int ch, bool simulcast)
+{
+  m_locchan_cs.Enter();
+  int x;
+  for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
+  if (x < m_locchannels.GetSize()) m_locchannels.Get(x)->simulcast=simulcast;
+  m_locchan_cs.Leave();
+}
+
+void NJClient::SetLocalChannelMinBitrate(int ch, int bitrate)
+{
+  m_locchan_cs.Enter();
+  int x;
+  for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
+  if (x < m_locchannels.GetSize()) m_locchannels.Get(x)->min_bitrate=bitrate;
+  m_locchan_cs.Leave();
+}
+
+int NJClient::GetUploadBitrate()
+{
+  int pct=m_upload_bitrate_pct.load();
+  int kbps=0;
+
+  m_locchan_cs.Enter();
+  int x;
+  for (x = 0; x < m_locchannels.GetSize(); x ++)
+  {
+    Local_Channel *lc=m_locchannels.Get(x);
+    if (lc->broadcasting && lc->codec != NJ_FLAC_FOURCC)
+      kbps+=effectiveBitrate(lc->bitrate,lc->min_bitrate,pct);
+  }
+  m_locchan_cs.Leave();
+  return kbps;
+}
+
+unsigned int NJClient::GetLocalChannelCodec(int ch)
+{
+  int x;
+  for (x = 0; x < m_locchannels.GetSize() && m_locchannels.Get(x)->channel_idx!=ch; x ++);
+  if (x == m_locchannels.GetSize()) return 0;
+  return m_locchannels.Get(x)->codec;
+}
+
 int NJClient::EnumLocalChannels(int i)
 {
   if (i<0||i>=m_locchannels.GetSize()) return -1;
@@ -1824,6 +2893,8 @@ void NJClient::SetLocalChannelMonitoring(int ch, bool setvol, float vol, bool se
     }
   }
   m_locchan_cs.Leave();
+
+  if (setsolo) publishMixState(); // remote channel mutes depend on solo
 }
 
 int NJClient::GetLocalChannelMonitoring(int ch, float *vol, float *pan, bool *mute, bool *solo)
@@ -1856,23 +2927,85 @@ void NJClient::NotifyServerOfChannelChange()
   }
 }
 
-RemoteUser_Channel::RemoteUser_Channel() : volume(1.0f), pan(0.0f), ds(NULL)
+RemoteUser_Channel::RemoteUser_Channel() : volume(1.0f), pan(0.0f), dq(NULL)
 {
-  memset(next_ds,0,sizeof(next_ds));
+  decoders=DecoderPool::createAndRef();
 }
 
 RemoteUser_Channel::~RemoteUser_Channel()
 {
-  delete ds;
-  ds=NULL;
-  delete next_ds[0];
-  delete next_ds[1];
-  memset(next_ds,0,sizeof(next_ds));
+  // dq must have been handed to NJClient::retireDecodeQueue()
+  decoders->unref();
+}
+
+JitterBuffer::JitterBuffer()
+  : target_secs(JITTER_INITIAL_TARGET), bytes_per_sec(0.0), underruns(0),
+    m_start(0.0), m_maxlag(-1.0), m_lag_avg(JITTER_INITIAL_TARGET),
+    m_lag_dev(0.0), m_underruns_seen(0)
+{
+}
+
+void JitterBuffer::downloadStarted(double now)
+{
+  m_start=now;
+  m_maxlag=-1.0;
+}
+
+// bytes_before had arrived before this chunk. Had playback started lag
+// seconds after the download, it would have used up exactly that much by now.
+void JitterBuffer::dataArrived(double now, int bytes_before)
+{
+  if (bytes_per_sec <= 0.0) return;
+
+  double lag=(now-m_start) - bytes_before/bytes_per_sec;
+  if (lag < 0.0) lag=0.0;
+  if (lag > m_maxlag) m_maxlag=lag;
+}
+
+void JitterBuffer::downloadFinished(int bytes, double interval_secs, unsigned int dq_underruns)
+{
+  if (bytes > 0 && interval_secs > 0.0)
+  {
+    double rate=bytes/interval_secs;
+    if (bytes_per_sec > 0.0) bytes_per_sec+=(rate-bytes_per_sec)*0.25;
+    else bytes_per_sec=rate;
+  }
+
+  // smoothed mean and deviation, like TCP round trip time estimation.
+  // Nothing was measured while the byte rate was still unknown.
+  if (m_maxlag >= 0.0)
+  {
+    double err=m_maxlag-m_lag_avg;
+    m_lag_avg+=err*0.125;
+    m_lag_dev+=(fabs(err)-m_lag_dev)*0.25;
+  }
+
+  // back off after running dry, the queue restarts counting when replaced
+  if (dq_underruns < m_underruns_seen) m_underruns_seen=0;
+  if (dq_underruns > m_underruns_seen)
+  {
+    underruns+=dq_underruns-m_underruns_seen;
+    m_underruns_seen=dq_underruns;
+    m_lag_avg+=JITTER_UNDERRUN_BACKOFF;
+  }
+
+  target_secs=m_lag_avg+4.0*m_lag_dev;
+  if (target_secs < JITTER_MIN_TARGET) target_secs=JITTER_MIN_TARGET;
+  else if (target_secs > JITTER_MAX_TARGET) target_secs=JITTER_MAX_TARGET;
+}
+
+int JitterBuffer::prebufferBytes(int fallback)
+{
+  if (bytes_per_sec <= 0.0) return fallback;
+
+  int nbytes=(int)(target_secs*bytes_per_sec);
+  return nbytes > 0 ? nbytes : 1; // 0 would wait for the whole interval
 }
 
 
 RemoteDownload::RemoteDownload()
-  : chidx(-1), playtime(0), m_parent(0), decodeBuffer(0)
+  : chidx(-1), jitter_chidx(-1), playtime(0), bytes(0), m_parent(0),
+    decodeBuffer(0)
 {
   memset(&guid,0,sizeof(guid));
   time(&last_time);
@@ -1901,36 +3034,28 @@ void RemoteDownload::Open(NJClient *parent, unsigned int fourcc)
 void RemoteDownload::startPlaying(bool closing)
 {
   int nbytes = 0;
-  int x;
-  RemoteUser *theuser;
+  RemoteUser_Channel *chan;
 
   if (!m_parent || chidx < 0 || !decodeBuffer) {
     goto out;
   }
 
-  // wait until we have config_play_prebuffer of data to start playing, or if config_play_prebuffer is 0, we are closingd to play (download finished)
+  // wait until we have playtime bytes of data to start playing, or if playtime is 0, we are closing (download finished)
   nbytes = decodeBuffer->size();
   if (!closing && playtime && nbytes < playtime) {
     goto out;
   }
 
-  for (x = 0; x < m_parent->m_remoteusers.GetSize() && strcmp((theuser=m_parent->m_remoteusers.Get(x))->name.Get(),username.Get()); x ++);
-  if (x < m_parent->m_remoteusers.GetSize() && chidx >= 0 && chidx < MAX_USER_CHANNELS)
+  chan = m_parent->findUserChannel(username.Get(), chidx);
+  if (chan && chan->dq)
   {
-    DecodeState *tmp = new DecodeState(decodeBuffer);
-
-    DecodeState *tmp2;
-    m_parent->m_users_cs.Enter();
-    int useidx=!!theuser->channels[chidx].next_ds[0];
-    tmp2=theuser->channels[chidx].next_ds[useidx];
-    theuser->channels[chidx].next_ds[useidx]=tmp;
-    m_parent->m_users_cs.Leave();
-    delete tmp2;
+    m_parent->startDecodeState(username.Get(), chidx, decodeBuffer, m_fourcc);
   }
   chidx=-1;
 
 out:
   if (closing && decodeBuffer) {
+    decodeBuffer->finish();
     decodeBuffer->unref();
     decodeBuffer = 0;
   }
@@ -1941,95 +3066,150 @@ void RemoteDownload::Write(void *buf, int len)
   if (decodeBuffer) {
     decodeBuffer->write(buf, len);
   }
+  bytes += len;
 
   startPlaying();  
 }
 
 
 Local_Channel::Local_Channel() : channel_idx(0), src_channel(0), bitrate(64),
+                min_bitrate(32),
+                codec(NJ_VORBIS_FOURCC), simulcast(false),
                 volume(1.0f), pan(0.0f), muted(false), solo(false),
                 broadcasting(false), bcast_active(false), cbf(NULL),
-                cbf_inst(NULL), decode_peak_vol(0.0), m_need_header(true),
+                cbf_inst(NULL), m_bq_overflows_seen(0), m_bq_lost_markers_seen(0), m_encoding(0),
+                decode_peak_vol(0.0), m_need_header(true),
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
                 m_enc(NULL), 
                 m_enc_bitrate_used(0), 
-                m_enc_header_needsend(NULL)
+                m_enc_nch_used(0),
+                m_enc_srate_used(0),
+                m_enc_codec_used(0),
+                m_enc_header_needsend(NULL),
+                m_num_variants(0),
 #endif
+                m_encode_load(0.0)
 {
+#ifndef NJCLIENT_NO_XMIT_SUPPORT
+  memset(m_variants,0,sizeof(m_variants));
+#endif
 }
 
 
-int BufferQueue::GetBlock(WDL_HeapBuf **b) // return 0 if got one, 1 if none avail
+BufferQueue::BufferQueue()
+  : m_read(0), m_write(0), m_num_pending_markers(0), m_overflows(0),
+    m_lost_markers(0)
 {
-  m_cs.Enter();
-  if (m_samplequeue.Available())
-  {
-    *b=*(WDL_HeapBuf **)m_samplequeue.Get();
-    m_samplequeue.Advance(sizeof(WDL_HeapBuf *));
-    if (m_samplequeue.Available()<256) m_samplequeue.Compact();
-    m_cs.Leave();
-    return 0;
+  m_samplebuf = new float[NUM_BLOCKS * BLOCK_LEN];
+  for (int i = 0; i < NUM_BLOCKS; i++) {
+    m_blocks[i].samples = m_samplebuf + i * BLOCK_LEN;
+    m_blocks[i].len = 0;
+    m_blocks[i].nch = 1;
   }
-  m_cs.Leave();
-  return 1;
 }
 
-void BufferQueue::DisposeBlock(WDL_HeapBuf *b)
+BufferQueue::~BufferQueue()
 {
-  m_cs.Enter();
-  if (b && b != &silence_buf) m_emptybufs.Add(b);
-  m_cs.Leave();
+  delete [] m_samplebuf;
 }
 
+unsigned int BufferQueue::numFree()
+{
+  return NUM_BLOCKS - (m_write.load() - m_read.loadAcquire());
+}
 
-void BufferQueue::AddBlock(float *samples, int len, float *samples2)
+// Caller must have checked numFree()
+void BufferQueue::push(float **samples, int nch, int offset, int len)
 {
-  WDL_HeapBuf *mybuf=0;
-  if (len>0)
-  {
-    m_cs.Enter();
+  unsigned int w = m_write.load();
+  Block *block = &m_blocks[w % NUM_BLOCKS];
+
+  if (nch == 1) {
+    memcpy(block->samples, samples[0] + offset, len * sizeof(float));
+  } else {
+    for (int ch = 0; ch < nch; ch++) {
+      float *in = samples[ch] + offset;
+      float *out = block->samples + ch;
+      for (int i = 0; i < len; i++) {
+        *out = in[i];
+        out += nch;
+      }
+    }
+  }
+  block->len = len;
+  block->nch = nch;
+  m_write.storeRelease(w + 1);
+}
 
-    if (m_samplequeue.Available() > 512)
-    {
-      m_cs.Leave();
+int BufferQueue::GetBlock(float **samples, int *len, int *nch)
+{
+  unsigned int r = m_read.load();
+  if (r == m_write.loadAcquire()) {
+    return 1;
+  }
+
+  Block *block = &m_blocks[r % NUM_BLOCKS];
+  *samples = block->samples;
+  *len = block->len;
+  *nch = block->nch;
+  return 0;
+}
+
+void BufferQueue::DisposeBlock()
+{
+  m_read.storeRelease(m_read.load() + 1);
+}
+
+void BufferQueue::Clear()
+{
+  m_read.storeRelease(m_write.loadAcquire());
+}
+
+void BufferQueue::AddBlock(float **samples, int nch, int len)
+{
+  // Interval markers must stay in order, so flush earlier ones first
+  while (m_num_pending_markers > 0 && numFree() > 0) {
+    push(NULL, 0, 0, m_pending_markers[0]);
+    m_num_pending_markers--;
+    memmove(m_pending_markers, m_pending_markers + 1,
+            m_num_pending_markers * sizeof(m_pending_markers[0]));
+  }
+
+  if (len <= 0) {
+    if (m_num_pending_markers == 0 && numFree() > 0) {
+      push(NULL, 0, 0, len);
       return;
     }
-    int tmp;
-    if ((tmp=m_emptybufs.GetSize()))
-    {
-      mybuf=m_emptybufs.Get(tmp-1);
-      if (mybuf) m_emptybufs.Delete(tmp-1);
-    }
-    m_cs.Leave();
-    if (!mybuf) mybuf=new WDL_HeapBuf;
 
-    int uselen=len*sizeof(float);
-    if (samples2)
-    {
-      uselen+=uselen;
+    // Deferred markers go out with the next block, only count real drops
+    if (m_num_pending_markers < MAX_PENDING_MARKERS) {
+      m_pending_markers[m_num_pending_markers++] = len;
+    } else {
+      m_lost_markers.fetchAndAddOrdered(1);
     }
+    return;
+  }
 
-    mybuf->Resize(uselen);
+  int offset = 0;
+  while (len > 0) {
+    // Leave room for the end of interval and silence markers
+    if (m_num_pending_markers > 0 || numFree() <= 2) {
+      m_overflows.fetchAndAddOrdered(1);
+      return;
+    }
 
-    memcpy(mybuf->Get(),samples,len*sizeof(float));
-    if (samples2)
-      memcpy((float*)mybuf->Get()+len,samples2,len*sizeof(float));
-  } else if (len == -1) {
-    mybuf = &silence_buf;
+    int n = len < BLOCK_LEN / nch ? len : BLOCK_LEN / nch;
+    push(samples, nch, offset, n);
+    offset += n;
+    len -= n;
   }
-
-  m_cs.Enter();
-  m_samplequeue.Add(&mybuf,sizeof(mybuf));
-  m_cs.Leave();
 }
 
 Local_Channel::~Local_Channel()
 {
+  clearSendQueue();
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
-  delete m_enc;
-  m_enc=0;
-  delete m_enc_header_needsend;
-  m_enc_header_needsend=0;
+  freeEncoders();
 #endif
 }
 
@@ -33,10 +33,10 @@
 
   Some other notes:
 
-    + Currently only OGG Vorbis is supported. There's hooks in there to add support
-      for more formats, but the requirements for the formats are a little high, so
-      currently OGG Vorbis is the only thing we've seen that would work well. And it
-      really rocks for this application.
+    + Intervals are sent as OGG Vorbis, Ogg Opus or lossless FLAC, see
+      common/njcodec.h. Each interval carries the fourcc of its codec, so every
+      local channel can use a different one and receivers pick the decoder to
+      match.
 
     + OK maybe that's it for now? :)
 
@@ -55,22 +55,33 @@
 #include <time.h>
 #include <portaudio.h>
 #include <QObject>
+#include <QThreadPool>
+#include <QElapsedTimer>
 
 #include "../WDL/string.h"
 #include "../WDL/ptrlist.h"
 #include "../WDL/mutex.h"
+#include "../common/njcodec.h"
 
 #include "common/netmsg.h"
 #include "common/mpb.h"
 #include "PortMidiStreamer.h"
+#include "Metronome.h"
+#include "Reclaimer.h"
+#include "AudioTelemetry.h"
+#include "EffectWorkers.h"
 
 class I_NJEncoder;
 class RemoteDownload;
 class RemoteUser;
+class RemoteUser_Channel;
 class Local_Channel;
 class DecodeBuffer;
 class DecodeState;
+class DecodeQueue;
+class RemoteMixState;
 class BufferQueue;
+class DecodeStateJob;
 
 // #define NJCLIENT_NO_XMIT_SUPPORT // might want to do this for njcast :)
 
@@ -79,6 +90,8 @@ class NJClient : public QObject
   Q_OBJECT
 
   friend class RemoteDownload;
+  friend class LocalChannelEncodeJob;
+  friend class DecodeStateJob;
 public:
   NJClient(QObject *parent = 0);
   ~NJClient();
@@ -101,7 +114,8 @@ public:
   bool  config_mastermute;
   int   config_debug_level; 
   int   config_play_prebuffer; // -1 means play instantly, 0 means play when full file is there, otherwise refers to how many
-                               // bytes of compressed source to have before play. the default value is 4096.
+                               // bytes of compressed source to have before play until a channel's adaptive prebuffer target
+                               // is known (after its first interval). the default value is 8192.
 
   float GetOutputPeak();
 
@@ -127,6 +141,9 @@ public:
   void GetPosition(int *pos, int *length);  // positions in samples
   int GetSampleRate() { return m_srate; }
   void SetSampleRate(int srate);
+  void SetBlockSize(int len); // maximum len passed to AudioProc(), call before Connect()
+  int GetBlockSize() { return m_blocksize; }
+  void SetMetronomeSample(bool accent, const float *samples, int len, int srate); // mono, len 0 for the built-in click
 
   int GetNumUsers() { return m_remoteusers.GetSize(); }
   char *GetUserState(int idx, float *vol=0, float *pan=0, bool *mute=0);
@@ -134,6 +151,7 @@ public:
 
   float GetUserChannelPeak(int useridx, int channelidx);
   char *GetUserChannelState(int useridx, int channelidx, bool *sub=0, float *vol=0, float *pan=0, bool *mute=0, bool *solo=0);
+  int GetUserChannelPrebuffer(int useridx, int channelidx, unsigned int *underruns=0); // adaptive prebuffer target in ms, -1 if not known yet
   void SetUserChannelState(int useridx, int channelidx, bool setsub, bool sub, bool setvol, float vol, bool setpan, float pan, bool setmute, bool mute, bool setsolo, bool solo);
   int EnumUserChannels(int useridx, int i); // returns <0 if out of channels. start with i=0, and go upwards
 
@@ -141,10 +159,18 @@ public:
   void DeleteLocalChannel(int ch);
   int EnumLocalChannels(int i);
   float GetLocalChannelPeak(int ch);
-  void SetLocalChannelProcessor(int ch, void (*cbf)(float *, int ns, void *), void *inst);
+  float GetLocalChannelEncodeLoad(int ch); // fraction of real-time spent encoding
+  // Processors of different channels may run at the same time on effect
+  // worker threads, see EffectWorkers
+  void SetLocalChannelProcessor(int ch, void (*cbf)(float **, int nch, int ns, qint64 timeLeftNs, void *), void *inst); // nch is 2 for stereo channels, timeLeftNs is how long the processor may take
   void GetLocalChannelProcessor(int ch, void **func, void **inst);
   void SetLocalChannelInfo(int ch, char *name, bool setsrcch, int srcch, bool setbitrate, int bitrate, bool setbcast, bool broadcast);
   char *GetLocalChannelInfo(int ch, int *srcch, int *bitrate, bool *broadcast);
+  void SetLocalChannelCodec(int ch, unsigned int fourcc); // NJ_VORBIS_FOURCC or NJ_OPUS_FOURCC, takes effect at the next interval
+  unsigned int GetLocalChannelCodec(int ch);
+  void SetLocalChannelMinBitrate(int ch, int bitrate); // lowest bitrate when the upload is congested
+  void SetLocalChannelSimulcast(int ch, bool simulcast); // also upload lower bitrate copies for slow listeners
+  int GetUploadBitrate(); // kbps the lossy local channels are currently sent at, see uploadBitrateChanged()
   void SetLocalChannelMonitoring(int ch, bool setvol, float vol, bool setpan, float pan, bool setmute, bool mute, bool setsolo, bool solo);
   int GetLocalChannelMonitoring(int ch, float *vol, float *pan, bool *mute, bool *solo); // 0 on success
   void NotifyServerOfChannelChange(); // call after any SetLocalChannel* that occur after initial connect
@@ -163,6 +189,10 @@ public:
   {
     sendMidiStartOnInterval = enable;
   }
+  void SetTelemetry(AudioTelemetry *telemetry) // call while audio is stopped
+  {
+    m_telemetry = telemetry;
+  }
 
   int LicenseAgreement_User32;
   int (*LicenseAgreementCallback)(int user32, char *licensetext); // return TRUE if user accepts
@@ -189,6 +219,7 @@ signals:
   void beatsPerMinuteChanged(int bpi);
   void beatsPerIntervalChanged(int bpi);
   void currentBeatChanged(int currentBeat);
+  void uploadBitrateChanged(int kbps);
 
 protected:
   double output_peaklevel;
@@ -202,6 +233,7 @@ protected:
   void process_samples(float **outbuf, int outnch, int len, int offset,
                        int justmonitor, double outputBufferDacTime);
   void on_new_interval();
+  void retireDecodeState(DecodeState *ds);
   void updateInterval(int nsamples);
 
   WDL_String m_errstr;
@@ -219,17 +251,22 @@ protected:
   int m_beatinfo_updated;
   int m_audio_enable;
   int m_srate;
+  int m_blocksize;
   int m_issoloactive;
 
   int m_active_bpm, m_active_bpi;
   int m_interval_length;
-  int m_interval_pos, m_metronome_state, m_metronome_tmp,m_metronome_interval;
-  double m_metronome_pos;
+  int m_interval_pos, m_metronome_interval;
+  Reclaimer m_reclaimer; // frees what the audio thread is done with
+  Metronome m_metronome;
 
   bool sendMidiBeatClock;
   bool sendMidiStartOnInterval;
   bool midiStarted;
   PortMidiStreamer *midiStreamer;
+  AudioTelemetry *m_telemetry; // times AudioProc() stages, may be NULL
+  unsigned int m_reclaimer_overflows; // reported to m_telemetry so far
+  QElapsedTimer m_jitter_clock; // download arrival times, see JitterBuffer
 
   // Values that we watch for changes
   int lastBpm;
@@ -238,23 +275,61 @@ protected:
 
   WDL_PtrList<Local_Channel> m_locchannels;
 
-  void mixInChannel(bool muted, float vol, float pan, DecodeState *chan, float **outbuf, int len, int outnch, int offs, double vudecay);
+  bool mixInChannel(bool muted, float vol, double vol1, double vol2, DecodeState *chan, float **outbuf, int len, int outnch, int offs, double vudecay);
 
-  WDL_Mutex m_users_cs, m_locchan_cs, m_log_cs, m_misc_cs;
+  WDL_Mutex m_locchan_cs, m_log_cs, m_misc_cs;
   Net_Connection *m_netcon;
   WDL_PtrList<RemoteUser> m_remoteusers;
   WDL_PtrList<RemoteDownload> m_downloads;
 
+  // Remote users as seen by the audio thread, see publishMixState()
+  QAtomicPointer<RemoteMixState> m_mix_state; // latest published
+  RemoteMixState *m_mix_current; // audio thread only, valid during AudioProc()
+  QAtomicInteger<unsigned int> m_mix_ack; // generation of m_mix_current
+  QAtomicInteger<int> m_mix_busy; // audio thread is in AudioProc()
+  unsigned int m_mix_generation;
+  WDL_PtrList<RemoteMixState> m_mix_retired; // replaced, maybe still in use
+  WDL_PtrList<DecodeQueue> m_mix_orphans; // removed since last publish
+
   WDL_HeapBuf tmpblock;
 
+  // Runs local channel processors in parallel on the audio thread's behalf
+  EffectWorkers m_effect_workers;
+
+  // Local channels are encoded here, away from the client event loop
+  QThreadPool m_encode_pool;
+
+  // Upload congestion control, see updateUploadBitrate()
+  Net_SendRateEstimator m_upload_rate;
+  QAtomicInteger<int> m_upload_bitrate_pct; // of each channel's bitrate, read by encode jobs
+  int m_upload_bitrate_shown;
+  QAtomicInteger<int> m_server_simulcast; // server picks between variants, read by encode jobs
+
+  // Remote intervals are set up and primed here, then queued in order by the
+  // client event loop, see queueDecodedIntervals()
+  QThreadPool m_decode_pool;
+  WDL_PtrList<DecodeStateJob> m_decode_jobs; // oldest first
+
 private slots:
   void tick();
   void netconDisconnected();
   void netconMessagesReady();
+  void encoderFinished();
+  void decoderFinished();
 
 private:
   int Run();// returns nonzero if sleep is OK
   void processMessage(Net_Message *msg);
+  void encodeLocalChannel(Local_Channel *lc, bool discard);
+  void setupVariants(Local_Channel *lc, int nch);
+  void updateUploadBitrate();
+  void publishMixState();
+  void retireDecodeQueue(DecodeQueue *dq);
+  void reclaimMixState(bool force=false);
+  void startDecodeState(const char *username, int chidx, DecodeBuffer *decodeBuffer, unsigned int fourcc);
+  void queueDecodedIntervals();
+  void discardDecodeJobs();
+  RemoteUser_Channel *findUserChannel(const char *username, int chidx);
   void sendMidiMessage(PmMessage msg, PmTimestamp timestamp);
   void sendMidiStop();
 };
@@ -263,6 +338,8 @@ private:
 
 #define MAX_USER_CHANNELS 32
 #define MAX_LOCAL_CHANNELS 32 // probably want to use NJClient::GetMaxLocalChannels() if determining when it's OK to add a channel,etc
+#define NJ_SRCCH_STEREO 1024 // local channel source flag, stereo from input (srcch&1023) and the one after it
+#define NJ_SRCCH_MIX 2048 // local channel source, mono mix of all inputs
 #define DOWNLOAD_TIMEOUT 8
 
 
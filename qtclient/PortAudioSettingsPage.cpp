@@ -60,6 +60,56 @@ PortAudioSettingsPage::PortAudioSettingsPage(QWidget *parent)
   connect(inputChannelsButton, SIGNAL(toggled(bool)),
           inputChannelsList, SLOT(setVisible(bool)));
 
+  QLabel *inputModeLabel = new QLabel(tr("Send &inputs as:"));
+
+  inputModeList = new QComboBox;
+  inputModeLabel->setBuddy(inputModeList);
+  inputModeList->setEditable(false);
+  inputModeList->setToolTip(tr("How the selected input channels are sent to others"));
+  inputModeList->addItem(tr("One mono channel"), "mono");
+  inputModeList->addItem(tr("One stereo channel"), "stereo");
+  inputModeList->addItem(tr("One channel per input"), "separate");
+
+  QLabel *codecLabel = new QLabel(tr("&Codec:"));
+
+  codecList = new QComboBox;
+  codecLabel->setBuddy(codecList);
+  codecList->setEditable(false);
+  codecList->setToolTip(tr("How your audio is compressed, Opus uses less CPU "
+                           "and resamples to 48 kHz if needed.  FLAC is "
+                           "lossless and uses the least CPU but needs a "
+                           "fast connection"));
+  codecList->addItem(tr("Vorbis"), "vorbis");
+  codecList->addItem(tr("Opus"), "opus");
+  codecList->addItem(tr("FLAC (lossless)"), "flac");
+
+  static const int bitrates[] = {32, 48, 64, 96, 128, 192, 256};
+
+  QLabel *bitrateLabel = new QLabel(tr("&Bitrate (kbps):"));
+
+  bitrateList = new QComboBox;
+  bitrateLabel->setBuddy(bitrateList);
+  bitrateList->setEditable(false);
+  bitrateList->setToolTip(tr("Higher bitrates sound better but need a faster connection"));
+
+  QLabel *minBitrateLabel = new QLabel(tr("Mi&nimum bitrate (kbps):"));
+
+  minBitrateList = new QComboBox;
+  minBitrateLabel->setBuddy(minBitrateList);
+  minBitrateList->setEditable(false);
+  minBitrateList->setToolTip(tr("The bitrate is lowered down to this when your "
+                                "connection can't keep up"));
+  minBitrateList->addItem(tr("Don't lower"), 0);
+  for (size_t i = 0; i < sizeof(bitrates) / sizeof(bitrates[0]); i++) {
+    bitrateList->addItem(QString::number(bitrates[i]), bitrates[i]);
+    minBitrateList->addItem(QString::number(bitrates[i]), bitrates[i]);
+  }
+
+  simulcastBox = new QCheckBox(tr("Also send lower quality copies"));
+  simulcastBox->setToolTip(tr("Listeners with slow connections get a lower "
+                              "quality copy instead of falling behind.  This "
+                              "needs more upload bandwidth."));
+
   QLabel *outputDeviceLabel = new QLabel(tr("&Output device:"));
 
   outputDeviceList = new QComboBox;
@@ -132,6 +182,11 @@ PortAudioSettingsPage::PortAudioSettingsPage(QWidget *parent)
   formLayout->addRow(inputDeviceLabel, inputDeviceHBoxLayout);
   formLayout->addRow(new QLabel, unmuteLocalChannelsBox);
   formLayout->addRow(inputChannelsLabel, inputChannelsList);
+  formLayout->addRow(inputModeLabel, inputModeList);
+  formLayout->addRow(codecLabel, codecList);
+  formLayout->addRow(bitrateLabel, bitrateList);
+  formLayout->addRow(minBitrateLabel, minBitrateList);
+  formLayout->addRow(new QLabel, simulcastBox);
   formLayout->addRow(outputDeviceLabel, outputDeviceHBoxLayout);
   formLayout->addRow(outputChannelsLabel, outputChannelsList);
   formLayout->addRow(new QLabel); /* just a spacer */
@@ -306,6 +361,69 @@ void PortAudioSettingsPage::setInputChannels(const QList<QVariant> &channels)
   setChannelsList(inputChannelsList, channels);
 }
 
+QString PortAudioSettingsPage::inputMode() const
+{
+  return inputModeList->currentData().toString();
+}
+
+void PortAudioSettingsPage::setInputMode(const QString &mode)
+{
+  int i = inputModeList->findData(mode);
+  if (i >= 0) {
+    inputModeList->setCurrentIndex(i);
+  }
+}
+
+QString PortAudioSettingsPage::codec() const
+{
+  return codecList->currentData().toString();
+}
+
+void PortAudioSettingsPage::setCodec(const QString &codec)
+{
+  int i = codecList->findData(codec);
+  if (i >= 0) {
+    codecList->setCurrentIndex(i);
+  }
+}
+
+int PortAudioSettingsPage::bitrate() const
+{
+  return bitrateList->currentData().toInt();
+}
+
+void PortAudioSettingsPage::setBitrate(int kbps)
+{
+  int i = bitrateList->findData(kbps);
+  if (i >= 0) {
+    bitrateList->setCurrentIndex(i);
+  }
+}
+
+/* 0 means the bitrate is never lowered */
+int PortAudioSettingsPage::minBitrate() const
+{
+  return minBitrateList->currentData().toInt();
+}
+
+void PortAudioSettingsPage::setMinBitrate(int kbps)
+{
+  int i = minBitrateList->findData(kbps);
+  if (i >= 0) {
+    minBitrateList->setCurrentIndex(i);
+  }
+}
+
+bool PortAudioSettingsPage::simulcast() const
+{
+  return simulcastBox->isChecked();
+}
+
+void PortAudioSettingsPage::setSimulcast(bool enable)
+{
+  simulcastBox->setChecked(enable);
+}
+
 void PortAudioSettingsPage::setOutputChannels(const QList<QVariant> &channels)
 {
   setChannelsList(outputChannelsList, channels);
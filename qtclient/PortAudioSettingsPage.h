@@ -31,6 +31,11 @@ class PortAudioSettingsPage : public LockableSettingsPage
   Q_PROPERTY(QString inputDevice READ inputDevice WRITE setInputDevice)
   Q_PROPERTY(bool unmuteLocalChannels READ unmuteLocalChannels WRITE setUnmuteLocalChannels)
   Q_PROPERTY(QList<QVariant> inputChannels READ inputChannels WRITE setInputChannels)
+  Q_PROPERTY(QString inputMode READ inputMode WRITE setInputMode)
+  Q_PROPERTY(QString codec READ codec WRITE setCodec)
+  Q_PROPERTY(int bitrate READ bitrate WRITE setBitrate)
+  Q_PROPERTY(int minBitrate READ minBitrate WRITE setMinBitrate)
+  Q_PROPERTY(bool simulcast READ simulcast WRITE setSimulcast)
   Q_PROPERTY(QString outputDevice READ outputDevice WRITE setOutputDevice)
   Q_PROPERTY(QList<QVariant> outputChannels READ outputChannels WRITE setOutputChannels)
   Q_PROPERTY(double sampleRate READ sampleRate WRITE setSampleRate)
@@ -47,6 +52,16 @@ public:
   void setUnmuteLocalChannels(bool unmute);
   QList<QVariant> inputChannels() const;
   void setInputChannels(const QList<QVariant> &channels);
+  QString inputMode() const;
+  void setInputMode(const QString &mode);
+  QString codec() const;
+  void setCodec(const QString &codec);
+  int bitrate() const;
+  void setBitrate(int kbps);
+  int minBitrate() const;
+  void setMinBitrate(int kbps);
+  bool simulcast() const;
+  void setSimulcast(bool enable);
   QString outputDevice() const;
   void setOutputDevice(const QString &name);
   QList<QVariant> outputChannels() const;
@@ -69,6 +84,11 @@ private:
   QComboBox *inputDeviceList;
   QCheckBox *unmuteLocalChannelsBox;
   QListWidget *inputChannelsList;
+  QComboBox *inputModeList;
+  QComboBox *codecList;
+  QComboBox *bitrateList;
+  QComboBox *minBitrateList;
+  QCheckBox *simulcastBox;
   QComboBox *outputDeviceList;
   QListWidget *outputChannelsList;
   QComboBox *sampleRateList;
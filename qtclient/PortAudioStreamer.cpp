@@ -23,6 +23,7 @@
 #include <pa_jack.h>
 #endif
 #include "PortAudioStreamer.h"
+#include "RTSafety.h"
 
 static void logPortAudioError(const char *msg, PaError error)
 {
@@ -39,13 +40,13 @@ static void logPortAudioError(const char *msg, PaError error)
 
 const char *PortAudioStreamer::GetChannelName(int idx)
 {
-  if (idx >= numHWInputChannels) {
+  if (idx < 0 || (size_t)idx >= numInputChannels) {
     return NULL;
   }
 
   /* TODO make GetChannelName() reentrancy-safe */
   static char name[64];
-  snprintf(name, sizeof name, "Channel %d", idx);
+  snprintf(name, sizeof name, "Channel %d", inputChannels[idx]);
   return name;
 }
 
@@ -62,46 +63,21 @@ int PortAudioStreamer::streamCallback(const void *input, void *output,
     unsigned long frameCount, const PaStreamCallbackTimeInfo *timeInfo,
     PaStreamCallbackFlags statusFlags)
 {
-  Q_UNUSED(statusFlags);
+  RTSAFETY_AUDIO_THREAD();
+
+  if (telemetry) {
+    telemetry->beginCallback(frameCount, statusFlags);
+  }
 
   float **inbuf = (float**)input; // const-cast due to SPLPROC prototype
   float **outbuf = static_cast<float**>(output);
 
-  /* Mix down to mono */
-  if (numHWInputChannels > 1) {
-    if (inputMonoBufFrames < frameCount) {
-      /* Allocation should happen rarely so don't worry about real-time */
-      delete [] inputMonoBuf;
-      inputMonoBuf = new float[frameCount];
-      inputMonoBufFrames = frameCount;
-    }
-
-    if (numInputChannels > 0) {
-      int channel = inputChannels[0];
-
-      for (unsigned long i = 0; i < frameCount; i++) {
-        inputMonoBuf[i] = inbuf[channel][i];
-      }
-
-      for (size_t chidx = 1; chidx < numInputChannels; chidx++) {
-        channel = inputChannels[chidx];
-
-        for (unsigned long i = 0; i < frameCount; i++) {
-          inputMonoBuf[i] += inbuf[channel][i];
-        }
-      }
-
-      for (unsigned long i = 0; i < frameCount; i++) {
-        inputMonoBuf[i] /= numInputChannels;
-      }
-    } else {
-      memset(inputMonoBuf, 0, sizeof(float) * frameCount);
-    }
-
-    inbuf = &inputMonoBuf;
+  /* Hand the selected inputs over without copying them */
+  for (size_t chidx = 0; chidx < numInputChannels; chidx++) {
+    inputBufs[chidx] = inbuf[inputChannels[chidx]];
   }
 
-  splproc(inbuf, 1, outbuf, 1, frameCount, timeInfo);
+  splproc(inputBufs, numInputChannels, outbuf, 1, frameCount, timeInfo);
 
   /* Mix up to multi-channel audio */
   size_t chidx = 0;
@@ -122,6 +98,9 @@ int PortAudioStreamer::streamCallback(const void *input, void *output,
     memset(outbuf[0], 0, sizeof(float) * frameCount);
   }
 
+  if (telemetry) {
+    telemetry->endCallback();
+  }
   return paContinue;
 }
 
@@ -149,7 +128,8 @@ void PortAudioStreamer::streamFinishedCallbackTrampoline(void *userData)
 }
 
 PortAudioStreamer::PortAudioStreamer(SPLPROC proc)
-  : splproc(proc), stream(NULL), inputMonoBuf(NULL), inputMonoBufFrames(0),
+  : splproc(proc), telemetry(NULL), stream(NULL), inputBufs(NULL),
+    framesPerBuffer(0),
     numHWInputChannels(0), numHWOutputChannels(0), stopping(false),
     numInputChannels(0), inputChannels(NULL),
     numOutputChannels(0), outputChannels(NULL)
@@ -159,7 +139,6 @@ PortAudioStreamer::PortAudioStreamer(SPLPROC proc)
 PortAudioStreamer::~PortAudioStreamer()
 {
   Stop();
-  delete [] inputMonoBuf;
 }
 
 /* Used for qsort(3) on ints */
@@ -192,6 +171,8 @@ void PortAudioStreamer::Stop()
       logPortAudioError("Pa_CloseStream failed", error);
     }
     stream = NULL;
+
+    RTSAFETY_REPORT();
   }
 
   cleanupChannels();
@@ -287,6 +268,7 @@ void PortAudioStreamer::initChannels(const QList<QVariant> &inputChannels_,
     inputChannelsStr.append(QString::number(inputChannels[chidx]));
   }
   qDebug("Input channels: %s", inputChannelsStr.join(' ').toLatin1().constData());
+  inputBufs = new float*[numInputChannels > 0 ? numInputChannels : 1];
 
   numOutputChannels = outputChannels_.count();
   outputChannels = new int[numOutputChannels];
@@ -311,6 +293,9 @@ void PortAudioStreamer::cleanupChannels()
     numInputChannels = 0;
   }
 
+  delete [] inputBufs;
+  inputBufs = nullptr;
+
   if (outputChannels) {
     delete [] outputChannels;
     outputChannels = nullptr;
@@ -397,8 +382,13 @@ bool PortAudioStreamer::TryToStart(const char *hostAPI,
 
   initChannels(inputChannels_, outputChannels_);
 
+  if (telemetry) {
+    telemetry->setSampleRate(sampleRate + 0.5);
+  }
+
+  framesPerBuffer = latency * sampleRate + 0.5;
   error = Pa_OpenStream(&stream, &inputParams, &outputParams,
-                        sampleRate, latency * sampleRate + 0.5,
+                        sampleRate, framesPerBuffer,
                         paPrimeOutputBuffersUsingStreamCallback,
                         streamCallbackTrampoline, this);
   if (error != paNoError) {
@@ -24,9 +24,11 @@
 #include <QObject>
 #include <QVariant>
 #include <QList>
+#include "AudioTelemetry.h"
 
 /* Audio processing callback function. Audio samples are non-interleaved. There
- * are len samples in the input and output buffers.
+ * are len samples in the input and output buffers. Each selected input channel
+ * is passed as its own buffer, in ascending hardware channel order.
  */
 typedef void (*SPLPROC)(float **inbuf, int innch,
                         float **outbuf, int outnch,
@@ -49,6 +51,13 @@ public:
              double sampleRate, double latency);
   void Stop();
 
+  /* Record callback timings, call while stopped */
+  void SetTelemetry(AudioTelemetry *telemetry_) { telemetry = telemetry_; }
+
+  /* Number of input channels passed to the callback */
+  int GetNumInputChannels() { return numInputChannels; }
+
+  /* Hardware channel name of an input passed to the callback */
   const char *GetChannelName(int idx);
 
   int streamCallback(const void *input, void *output,
@@ -65,6 +74,9 @@ public:
 
   PaTime GetStreamTime();
 
+  /* Number of frames passed to each stream callback, or 0 if it varies */
+  unsigned long GetFramesPerBuffer() { return framesPerBuffer; }
+
 signals:
   /* Emitted when the stream fails after starting. Note this signal can be
    * emitted from another thread!
@@ -73,9 +85,10 @@ signals:
 
 private:
   SPLPROC splproc;
+  AudioTelemetry *telemetry;
   PaStream *stream;
-  float *inputMonoBuf;
-  unsigned long inputMonoBufFrames;
+  float **inputBufs; /* selected input channels, one per numInputChannels */
+  unsigned long framesPerBuffer;
   int numHWInputChannels;
   int numHWOutputChannels;
   bool stopping;
@@ -0,0 +1,267 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "RTSafety.h"
+
+#ifdef WAHJAM_RTSAFETY
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <QAtomicInteger>
+#include <QtGlobal>
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define HAVE_BACKTRACE
+#endif
+
+#ifdef __GLIBC__
+#include <dlfcn.h>
+#include <pthread.h>
+#endif
+
+enum {
+  MAX_RECORDS = 64,
+  MAX_FRAMES = 24,
+};
+
+/* One distinct offending call site */
+struct Record {
+  const char *what;
+  void *frames[MAX_FRAMES];
+  int numFrames;
+  QAtomicInteger<unsigned int> count;
+  QAtomicInteger<int> ready; /* the fields above are filled in */
+};
+
+/* The audio thread and effect workers add records at the same time.  Each
+ * claims a slot with numRecords, which may run past MAX_RECORDS, and
+ * publishes it with ready.  Two threads may both add the same call site, which
+ * only costs a slot.  The report is generated after the audio stream has
+ * stopped.
+ */
+static Record records[MAX_RECORDS];
+static QAtomicInteger<int> numRecords;
+static QAtomicInteger<unsigned int> numDropped;
+
+static thread_local int audioThreadDepth;
+static thread_local bool recording; /* don't record our own allocations */
+
+RTSafetyScope::RTSafetyScope()
+{
+  audioThreadDepth++;
+}
+
+RTSafetyScope::~RTSafetyScope()
+{
+  audioThreadDepth--;
+}
+
+void rtSafetyViolation(const char *what)
+{
+  if (audioThreadDepth == 0 || recording) {
+    return;
+  }
+  recording = true;
+
+  void *frames[MAX_FRAMES];
+  int numFrames = 0;
+#ifdef HAVE_BACKTRACE
+  numFrames = backtrace(frames, MAX_FRAMES);
+#endif
+
+  int n = qMin(numRecords.loadAcquire(), (int)MAX_RECORDS);
+  int i;
+  for (i = 0; i < n; i++) {
+    Record *record = &records[i];
+    if (record->ready.loadAcquire() &&
+        record->what == what &&
+        record->numFrames == numFrames &&
+        memcmp(record->frames, frames, numFrames * sizeof(frames[0])) == 0) {
+      record->count.fetchAndAddRelaxed(1);
+      break;
+    }
+  }
+
+  if (i == n) {
+    int slot = numRecords.fetchAndAddOrdered(1);
+    if (slot < MAX_RECORDS) {
+      Record *record = &records[slot];
+      record->what = what;
+      memcpy(record->frames, frames, numFrames * sizeof(frames[0]));
+      record->numFrames = numFrames;
+      record->count.store(1);
+      record->ready.storeRelease(1);
+    } else {
+      numDropped.fetchAndAddRelaxed(1);
+    }
+  }
+
+  recording = false;
+}
+
+void rtSafetyReport()
+{
+  int n = qMin(numRecords.loadAcquire(), (int)MAX_RECORDS);
+  if (n == 0) {
+    qDebug("Real-time safety: no violations in the audio thread");
+    return;
+  }
+
+  qWarning("Real-time safety: %d call sites violated real-time safety "
+           "in the audio thread", n);
+
+  for (int i = 0; i < n; i++) {
+    Record *record = &records[i];
+    if (!record->ready.loadAcquire()) {
+      continue;
+    }
+    qWarning("Real-time safety: %s called %u times from:",
+             record->what, record->count.load());
+
+#ifdef HAVE_BACKTRACE
+    char **symbols = backtrace_symbols(record->frames, record->numFrames);
+    /* Skip rtSafetyViolation() itself */
+    for (int j = 1; symbols && j < record->numFrames; j++) {
+      qWarning("  %s", symbols[j]);
+    }
+    free(symbols);
+#else
+    qWarning("  (call stacks are not available on this platform)");
+#endif
+  }
+
+  if (numDropped.load() > 0) {
+    qWarning("Real-time safety: %u more violations were not recorded",
+             numDropped.load());
+  }
+
+  for (int i = 0; i < n; i++) {
+    records[i].ready.store(0);
+  }
+  numRecords.storeRelease(0);
+  numDropped.store(0);
+}
+
+#ifdef HAVE_BACKTRACE
+/* The first backtrace() call may load libraries and allocate memory, do it
+ * before the audio thread needs it.
+ */
+static struct BacktraceInit {
+  BacktraceInit()
+  {
+    void *frame;
+    backtrace(&frame, 1);
+  }
+} backtraceInit;
+#endif
+
+#ifdef __GLIBC__
+
+/* Interpose the C library allocator, this also catches operator new and
+ * allocations in Qt and other libraries
+ */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+  rtSafetyViolation("malloc");
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  rtSafetyViolation("calloc");
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  rtSafetyViolation("realloc");
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+  if (ptr) {
+    rtSafetyViolation("free");
+  }
+  __libc_free(ptr);
+}
+
+/* WDL_Mutex, std::mutex and others are built on this */
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+  typedef int (*LockFn)(pthread_mutex_t *);
+  static LockFn realLock;
+
+  if (!realLock) {
+    realLock = (LockFn)dlsym(RTLD_NEXT, "pthread_mutex_lock");
+  }
+
+  rtSafetyViolation("pthread_mutex_lock");
+  return realLock(mutex);
+}
+} /* extern "C" */
+
+#else /* __GLIBC__ */
+
+void *operator new(size_t size)
+{
+  rtSafetyViolation("operator new");
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void *operator new[](size_t size)
+{
+  rtSafetyViolation("operator new[]");
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+  if (ptr) {
+    rtSafetyViolation("operator delete");
+  }
+  free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  if (ptr) {
+    rtSafetyViolation("operator delete[]");
+  }
+  free(ptr);
+}
+
+#endif /* __GLIBC__ */
+
+#endif /* WAHJAM_RTSAFETY */
@@ -0,0 +1,62 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RTSAFETY_H_
+#define _RTSAFETY_H_
+
+/* Real-time safety checker for the audio thread
+ *
+ * The audio callback must not allocate, free or block on locks because that
+ * can take an unbounded amount of time and cause audio dropouts.  When built
+ * with "qmake CONFIG+=rtsafety" the audio thread is marked while it runs the
+ * callback and such calls made from it are recorded together with their call
+ * stacks.  A report is logged when audio stops.
+ *
+ * With glibc malloc(), free() and pthread_mutex_lock() are intercepted.  On
+ * other platforms only operator new and delete are.  Locks that cannot be
+ * intercepted, like QMutex, are annotated with RTSAFETY_VIOLATION().
+ *
+ * All macros compile to nothing in normal builds.
+ */
+
+#ifdef WAHJAM_RTSAFETY
+
+/* Marks the current thread as the audio thread while in scope */
+class RTSafetyScope
+{
+public:
+  RTSafetyScope();
+  ~RTSafetyScope();
+};
+
+void rtSafetyViolation(const char *what);
+void rtSafetyReport();
+
+#define RTSAFETY_AUDIO_THREAD() RTSafetyScope rtSafetyScope_
+#define RTSAFETY_VIOLATION(what) rtSafetyViolation(what)
+#define RTSAFETY_REPORT() rtSafetyReport()
+
+#else
+
+#define RTSAFETY_AUDIO_THREAD() do {} while (0)
+#define RTSAFETY_VIOLATION(what) do {} while (0)
+#define RTSAFETY_REPORT() do {} while (0)
+
+#endif /* WAHJAM_RTSAFETY */
+
+#endif /* _RTSAFETY_H_ */
@@ -0,0 +1,175 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <limits.h>
+#include "RTSemaphore.h"
+
+#if defined(Q_OS_LINUX)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+RTSemaphore::RTSemaphore()
+  : count(0)
+{
+}
+
+RTSemaphore::~RTSemaphore()
+{
+}
+
+void RTSemaphore::release(int n)
+{
+  count.fetchAndAddRelease(n);
+  syscall(SYS_futex, reinterpret_cast<int*>(&count), FUTEX_WAKE_PRIVATE, n,
+          NULL, NULL, 0);
+}
+
+void RTSemaphore::acquire()
+{
+  for (;;) {
+    int c = count.loadAcquire();
+    if (c > 0) {
+      if (count.testAndSetAcquire(c, c - 1)) {
+        return;
+      }
+      continue;
+    }
+
+    /* Returns straight away if count is no longer 0 */
+    syscall(SYS_futex, reinterpret_cast<int*>(&count), FUTEX_WAIT_PRIVATE, 0,
+            NULL, NULL, 0);
+  }
+}
+
+bool RTSemaphore::tryAcquire(qint64 timeoutNs)
+{
+  for (bool waited = false;; waited = true) {
+    int c = count.loadAcquire();
+    if (c > 0) {
+      if (count.testAndSetAcquire(c, c - 1)) {
+        return true;
+      }
+      continue;
+    }
+    if (waited || timeoutNs <= 0) {
+      return false;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = timeoutNs / 1000000000;
+    ts.tv_nsec = timeoutNs % 1000000000;
+    syscall(SYS_futex, reinterpret_cast<int*>(&count), FUTEX_WAIT_PRIVATE, 0,
+            &ts, NULL, 0);
+  }
+}
+
+#elif defined(Q_OS_WIN)
+
+RTSemaphore::RTSemaphore()
+{
+  sem = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+}
+
+RTSemaphore::~RTSemaphore()
+{
+  CloseHandle(sem);
+}
+
+void RTSemaphore::release(int n)
+{
+  ReleaseSemaphore(sem, n, NULL);
+}
+
+void RTSemaphore::acquire()
+{
+  WaitForSingleObject(sem, INFINITE);
+}
+
+bool RTSemaphore::tryAcquire(qint64 timeoutNs)
+{
+  /* Rounded up, the wait only has millisecond resolution */
+  DWORD ms = timeoutNs > 0 ? (DWORD)((timeoutNs + 999999) / 1000000) : 0;
+  return WaitForSingleObject(sem, ms) == WAIT_OBJECT_0;
+}
+
+#elif defined(Q_OS_MAC)
+
+RTSemaphore::RTSemaphore()
+{
+  semaphore_create(mach_task_self(), &sem, SYNC_POLICY_FIFO, 0);
+}
+
+RTSemaphore::~RTSemaphore()
+{
+  semaphore_destroy(mach_task_self(), sem);
+}
+
+void RTSemaphore::release(int n)
+{
+  for (int i = 0; i < n; i++) {
+    semaphore_signal(sem);
+  }
+}
+
+void RTSemaphore::acquire()
+{
+  /* Interrupted waits are retried */
+  while (semaphore_wait(sem) != KERN_SUCCESS) {
+  }
+}
+
+bool RTSemaphore::tryAcquire(qint64 timeoutNs)
+{
+  mach_timespec_t ts;
+  if (timeoutNs < 0) {
+    timeoutNs = 0;
+  }
+  ts.tv_sec = timeoutNs / 1000000000;
+  ts.tv_nsec = timeoutNs % 1000000000;
+  return semaphore_timedwait(sem, ts) == KERN_SUCCESS;
+}
+
+#else
+
+RTSemaphore::RTSemaphore()
+{
+}
+
+RTSemaphore::~RTSemaphore()
+{
+}
+
+void RTSemaphore::release(int n)
+{
+  sem.release(n);
+}
+
+void RTSemaphore::acquire()
+{
+  sem.acquire();
+}
+
+bool RTSemaphore::tryAcquire(qint64 timeoutNs)
+{
+  return sem.tryAcquire(1, timeoutNs > 0 ? (int)((timeoutNs + 999999) / 1000000) : 0);
+}
+
+#endif
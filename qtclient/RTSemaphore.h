@@ -0,0 +1,69 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RTSEMAPHORE_H_
+#define _RTSEMAPHORE_H_
+
+#include <QtGlobal>
+#include <QAtomicInteger>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#elif defined(Q_OS_MAC)
+#include <mach/mach.h>
+#elif !defined(Q_OS_LINUX)
+#include <QSemaphore>
+#endif
+
+/* Counting semaphore that the audio thread can release
+ *
+ * QSemaphore takes a mutex outside Linux, so releasing it could leave the
+ * audio thread waiting for whichever thread holds the mutex.  This uses the
+ * kernel's wait primitive directly instead: a futex on Linux, a Mach
+ * semaphore on macOS and a semaphore object on Windows.  release() never
+ * blocks, only acquire() does.
+ */
+class RTSemaphore
+{
+public:
+  RTSemaphore();
+  ~RTSemaphore();
+
+  void release(int n = 1);
+  void acquire();
+
+  /* Like acquire() but gives up after about timeoutNs and returns false.  May
+   * also return false early, so callers check the time themselves.
+   */
+  bool tryAcquire(qint64 timeoutNs);
+
+private:
+#if defined(Q_OS_LINUX)
+  QAtomicInteger<int> count; /* futex word */
+#elif defined(Q_OS_WIN)
+  HANDLE sem;
+#elif defined(Q_OS_MAC)
+  semaphore_t sem;
+#else
+  QSemaphore sem;
+#endif
+
+  Q_DISABLE_COPY(RTSemaphore)
+};
+
+#endif /* _RTSEMAPHORE_H_ */
@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "Reclaimer.h"
+
+Reclaimer::Reclaimer(QObject *parent)
+  : QThread(parent), stopping(0), overflows(0)
+{
+  start(QThread::LowestPriority);
+}
+
+Reclaimer::~Reclaimer()
+{
+  stopping.storeRelease(1);
+  wait();
+  reclaim();
+}
+
+void Reclaimer::retire(void *obj, void (*destroyFn)(void *obj))
+{
+  Entry entry = {obj, destroyFn};
+  if (!queue.push(entry)) {
+    /* The reclaimer thread is starved, leaking would be worse */
+    overflows.fetchAndAddRelaxed(1);
+    destroyFn(obj);
+  }
+}
+
+void Reclaimer::reclaim()
+{
+  QMutexLocker locker(&consumerLock);
+  Entry entry;
+
+  while (queue.pop(&entry)) {
+    entry.destroyFn(entry.obj);
+  }
+}
+
+void Reclaimer::run()
+{
+  /* Polling keeps retire() free of system calls */
+  while (!stopping.loadAcquire()) {
+    reclaim();
+    msleep(INTERVAL_MS);
+  }
+}
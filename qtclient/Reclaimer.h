@@ -0,0 +1,92 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RECLAIMER_H_
+#define _RECLAIMER_H_
+
+#include <QAtomicInteger>
+#include <QMutex>
+#include <QThread>
+
+#include "SPSCQueue.h"
+
+/* Deferred destruction of objects the audio thread is done with
+ *
+ * Freeing memory or tearing down codec state can take locks and is not
+ * real-time safe.  The audio thread hands such objects to retire() instead,
+ * which only appends them to a lock-free queue.  A low-priority thread
+ * destroys them a little later.
+ *
+ * Only the audio thread may call retire().
+ *
+ * Not everything goes through here.  BufferQueue blocks are preallocated and
+ * recycled in place.  Effect chains and their plugins are freed on the GUI
+ * thread by EffectProcessor::reclaimChains() once the audio thread has moved
+ * past them, because plugins must be destroyed on the thread that owns them.
+ */
+class Reclaimer : public QThread
+{
+public:
+  Reclaimer(QObject *parent = 0);
+  ~Reclaimer(); /* destroys anything still queued */
+
+  /* Audio thread only */
+  template<typename T>
+  void retire(T *obj)
+  {
+    if (obj) {
+      retire(obj, destroy<T>);
+    }
+  }
+  void retire(void *obj, void (*destroyFn)(void *obj));
+
+  /* Destroy queued objects now instead of waiting for the reclaimer thread */
+  void reclaim();
+
+  /* Number of objects the audio thread had to destroy itself because the
+   * queue was full
+   */
+  unsigned int overflowCount() const { return overflows.load(); }
+
+protected:
+  void run();
+
+private:
+  enum {
+    QUEUE_SIZE = 1024, /* power of two */
+    INTERVAL_MS = 20,
+  };
+
+  struct Entry {
+    void *obj;
+    void (*destroyFn)(void *obj);
+  };
+
+  SPSCQueue<Entry, QUEUE_SIZE> queue;
+  QMutex consumerLock; /* reclaim() may race with the reclaimer thread */
+  QAtomicInteger<int> stopping;
+  QAtomicInteger<unsigned int> overflows;
+
+  template<typename T>
+  static void destroy(void *obj)
+  {
+    delete static_cast<T*>(obj);
+  }
+};
+
+#endif /* _RECLAIMER_H_ */
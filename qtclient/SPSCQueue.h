@@ -0,0 +1,79 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _SPSCQUEUE_H_
+#define _SPSCQUEUE_H_
+
+#include <QAtomicInteger>
+
+/* Fixed-size single-producer single-consumer queue
+ *
+ * One thread may call push() and another thread may call pop() without
+ * locking.  Neither side blocks or allocates memory so this is suitable for
+ * passing items to and from the audio thread.  N must be a power of two.
+ */
+template<typename T, unsigned int N>
+class SPSCQueue
+{
+public:
+  SPSCQueue()
+    : readIdx(0), writeIdx(0)
+  {
+  }
+
+  /* Producer only.  Returns false if the queue is full. */
+  bool push(const T &item)
+  {
+    unsigned int w = writeIdx.load();
+    if (w - readIdx.loadAcquire() >= N) {
+      return false;
+    }
+    items[w & (N - 1)] = item;
+    writeIdx.storeRelease(w + 1);
+    return true;
+  }
+
+  /* Consumer only.  Returns false if the queue is empty. */
+  bool pop(T *item)
+  {
+    unsigned int r = readIdx.load();
+    if (writeIdx.loadAcquire() == r) {
+      return false;
+    }
+    *item = items[r & (N - 1)];
+    readIdx.storeRelease(r + 1);
+    return true;
+  }
+
+  /* Consumer only */
+  bool isEmpty()
+  {
+    return writeIdx.loadAcquire() == readIdx.load();
+  }
+
+private:
+  T items[N];
+  QAtomicInteger<unsigned int> readIdx;
+  QAtomicInteger<unsigned int> writeIdx;
+
+  /* Not copyable */
+  SPSCQueue(const SPSCQueue &);
+  SPSCQueue &operator=(const SPSCQueue &);
+};
+
+#endif /* _SPSCQUEUE_H_ */
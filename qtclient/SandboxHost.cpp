@@ -0,0 +1,304 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QSharedMemory>
+#include <QThread>
+#include <QTimer>
+
+#include "SandboxPlugin.h"
+#include "VSTPlugin.h"
+
+/* Plugin host side of SandboxPlugin, runs in its own process */
+
+enum {
+  HOST_WAIT_NS = 100000000, /* to notice shutdown without a request */
+  HOST_TIMER_MS = 100,
+};
+
+/* Copies its inputs to its outputs, used to measure the sandbox overhead */
+class SandboxDummyPlugin : public EffectPlugin
+{
+public:
+  bool load() { return true; }
+  void unload() {}
+  QString getName() const { return "Sandbox test"; }
+
+  void openEditor(QWidget *) {}
+  void closeEditor() {}
+  void queueResizeEditor(int, int) {}
+  void queueIdle() {}
+  void outputEvents(VstEvents *) {}
+
+  int numInputs() const { return 2; }
+  int numOutputs() const { return 2; }
+  void setSampleRate(int) {}
+  void setTempo(int) {}
+  void changeMains(bool) {}
+  void processEvents(VstEvents *) {}
+  void process(float **inbuf, float **outbuf, int ns)
+  {
+    for (int i = 0; i < 2; i++) {
+      memcpy(outbuf[i], inbuf[i], sizeof(float) * ns);
+    }
+  }
+
+  void idle() {}
+};
+
+/* Processes blocks as the client requests them */
+class SandboxHostThread : public QThread
+{
+public:
+  SandboxHostThread(SandboxShared *shared_, EffectPlugin *plugin_)
+    : shared(shared_), plugin(plugin_), stopping(0)
+  {
+  }
+
+  void stop()
+  {
+    stopping.storeRelease(1);
+    sandboxWake(&shared->requestSeq);
+    wait();
+  }
+
+protected:
+  void run();
+
+private:
+  SandboxShared *shared;
+  EffectPlugin *plugin;
+  QAtomicInteger<int> stopping;
+};
+
+void SandboxHostThread::run()
+{
+  float *inputs[SANDBOX_MAX_CHANNELS];
+  float *outputs[SANDBOX_MAX_CHANNELS];
+  for (int i = 0; i < SANDBOX_MAX_CHANNELS; i++) {
+    inputs[i] = shared->inputs[i];
+    outputs[i] = shared->outputs[i];
+  }
+
+  VstMidiEvent midiEvents[SANDBOX_MAX_EVENTS];
+  VstEvents *vstEvents = (VstEvents*)malloc(sizeof(*vstEvents) +
+      SANDBOX_MAX_EVENTS * sizeof(vstEvents->events[0]));
+  memset(vstEvents, 0, sizeof(*vstEvents));
+  memset(midiEvents, 0, sizeof(midiEvents));
+  for (int i = 0; i < SANDBOX_MAX_EVENTS; i++) {
+    vstEvents->events[i] = (VstEvent*)&midiEvents[i];
+  }
+
+  unsigned int handled = shared->requestSeq.loadAcquire();
+  int sampleRate = 0;
+  int mains = 0;
+  int tempo = 0;
+
+  while (!stopping.loadAcquire() && !shared->shutdown.loadAcquire()) {
+    unsigned int seq = shared->requestSeq.loadAcquire();
+    if (seq == handled) {
+      sandboxWait(&shared->requestSeq, seq, HOST_WAIT_NS);
+      continue;
+    }
+
+    /* Parameters only change between blocks */
+    if (shared->sampleRate.loadAcquire() != sampleRate) {
+      sampleRate = shared->sampleRate.loadAcquire();
+      if (mains) {
+        plugin->changeMains(false);
+      }
+      plugin->setSampleRate(sampleRate);
+      if (mains) {
+        plugin->changeMains(true);
+      }
+    }
+    if (shared->mains.loadAcquire() != mains) {
+      mains = shared->mains.loadAcquire();
+      plugin->changeMains(mains);
+    }
+    if (shared->tempo.loadAcquire() != tempo) {
+      tempo = shared->tempo.loadAcquire();
+      plugin->setTempo(tempo);
+    }
+
+    int ns = shared->ns;
+
+    if (shared->numEvents > 0) {
+      for (int i = 0; i < shared->numEvents; i++) {
+        midiEvents[i].type = kVstMidiType;
+        midiEvents[i].byteSize = sizeof(midiEvents[i]);
+        midiEvents[i].deltaFrames = shared->events[i].deltaFrames;
+        memcpy(midiEvents[i].midiData, shared->events[i].data,
+               sizeof(midiEvents[i].midiData));
+      }
+      vstEvents->numEvents = shared->numEvents;
+      plugin->processEvents(vstEvents);
+      shared->numEvents = 0;
+    }
+
+    if (mains) {
+      plugin->process(inputs, outputs, ns);
+    } else {
+      for (int i = 0; i < shared->numOutputs; i++) {
+        memset(outputs[i], 0, sizeof(float) * ns);
+      }
+    }
+
+    handled = seq;
+    shared->responseSeq.storeRelease(seq);
+    sandboxWake(&shared->responseSeq);
+  }
+
+  free(vstEvents);
+}
+
+int sandboxHostMain(const QStringList &args)
+{
+  if (args.size() < 4) {
+    qCritical("usage: %s --plugin-host <key> <filename>",
+              args.value(0).toLocal8Bit().constData());
+    return 1;
+  }
+
+  QSharedMemory shm(args.at(2));
+  if (!shm.attach()) {
+    qCritical("Plugin host failed to attach shared memory: %s",
+              shm.errorString().toLatin1().constData());
+    return 1;
+  }
+
+  SandboxShared *shared = static_cast<SandboxShared*>(shm.data());
+  if (shm.size() < (int)sizeof(*shared) ||
+      shared->version != SANDBOX_VERSION) {
+    qCritical("Plugin host shared memory version mismatch");
+    return 1;
+  }
+
+  const QString &filename = args.at(3);
+  EffectPlugin *plugin;
+  if (filename == "dummy") {
+    plugin = new SandboxDummyPlugin;
+  } else {
+    plugin = new VSTPlugin(filename);
+  }
+
+  if (!plugin->load() ||
+      plugin->numInputs() > SANDBOX_MAX_CHANNELS ||
+      plugin->numOutputs() > SANDBOX_MAX_CHANNELS) {
+    delete plugin;
+    shared->state.storeRelease(SANDBOX_FAILED);
+    return 1;
+  }
+
+  QByteArray name = plugin->getName().toUtf8().left(SANDBOX_NAME_SIZE - 1);
+  memcpy(shared->name, name.constData(), name.size());
+  shared->numInputs = plugin->numInputs();
+  shared->numOutputs = plugin->numOutputs();
+  shared->state.storeRelease(SANDBOX_READY);
+
+  SandboxHostThread thread(shared, plugin);
+  thread.start(QThread::TimeCriticalPriority);
+
+  /* Editor requests, plugin idle processing and noticing when the client is
+   * gone happen on the main thread
+   */
+  unsigned int editorRequests = 0;
+  unsigned int heartbeat = 0;
+  QElapsedTimer heartbeatTimer;
+  heartbeatTimer.start();
+
+  QTimer timer;
+  QObject::connect(&timer, &QTimer::timeout, [&]() {
+    if (shared->shutdown.loadAcquire()) {
+      QCoreApplication::quit();
+      return;
+    }
+
+    unsigned int beat = shared->heartbeat.loadAcquire();
+    if (beat != heartbeat) {
+      heartbeat = beat;
+      heartbeatTimer.restart();
+    } else if (heartbeatTimer.hasExpired(SANDBOX_HEARTBEAT_TIMEOUT_MS)) {
+      qWarning("Plugin host lost the client, exiting");
+      QCoreApplication::quit();
+      return;
+    }
+
+    unsigned int requests = shared->editorRequests.loadAcquire();
+    if (requests != editorRequests) {
+      editorRequests = requests;
+      plugin->openEditor(NULL);
+    }
+
+    plugin->idle();
+  });
+  timer.start(HOST_TIMER_MS);
+
+  int ret = QCoreApplication::exec();
+
+  thread.stop();
+  plugin->changeMains(false);
+  plugin->closeEditor();
+  plugin->unload();
+  delete plugin;
+  return ret;
+}
+
+/* Measures the round trip through the sandbox with the dummy plugin.  Blocks
+ * are paced like audio callbacks so the host sleeps between them as it would
+ * during a jam.
+ */
+int sandboxBenchmarkMain()
+{
+  enum {
+    SAMPLE_RATE = 48000,
+    FRAMES = 128,
+    BLOCKS = 1000, /* stays within the host heartbeat timeout */
+    BUDGET_PCT = 50, /* of the block duration, as NJClient allows effects */
+  };
+
+  SandboxPlugin plugin("dummy");
+  if (!plugin.load()) {
+    return 1;
+  }
+  plugin.setSampleRate(SAMPLE_RATE);
+  plugin.changeMains(true);
+
+  static float bufs[4][FRAMES];
+  float *inbuf[2] = {bufs[0], bufs[1]};
+  float *outbuf[2] = {bufs[2], bufs[3]};
+
+  for (int i = 0; i < BLOCKS; i++) {
+    plugin.setTimeLeft((qint64)FRAMES * 1000000000 / SAMPLE_RATE *
+                       BUDGET_PCT / 100);
+    plugin.process(inbuf, outbuf, FRAMES);
+    QThread::usleep(FRAMES * 1000000 / SAMPLE_RATE);
+  }
+
+  SandboxPlugin::Stats stats = plugin.takeStats();
+  printf("%d blocks of %d frames at %d Hz, %u missed the %d%% budget\n",
+         BLOCKS, FRAMES, SAMPLE_RATE, stats.misses, (int)BUDGET_PCT);
+  printf("round trip avg %.1f us, max %.1f us\n",
+         stats.blocks ? stats.totalNs / 1000.0 / stats.blocks : 0.0,
+         stats.maxNs / 1000.0);
+  return 0;
+}
@@ -0,0 +1,337 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <new>
+#include <string.h>
+#include <QCoreApplication>
+#include <QThread>
+#include <QUuid>
+
+#include "SandboxPlugin.h"
+
+SandboxPlugin::SandboxPlugin(const QString &filename_)
+  : filename(filename_), shared(NULL), nin(0), nout(0), requestSeq(0),
+    unloading(false), hostDead(0), blocks(0), misses(0), totalNs(0), maxNs(0)
+{
+  connect(&host, SIGNAL(finished(int, QProcess::ExitStatus)),
+          this, SLOT(hostFinished()));
+  timer.start();
+  statsTimer.start();
+}
+
+SandboxPlugin::~SandboxPlugin()
+{
+  unload();
+}
+
+bool SandboxPlugin::load()
+{
+  if (shared) {
+    return false;
+  }
+
+  shm.setKey(QString("%1-sandbox-%2").arg(APPNAME)
+             .arg(QUuid::createUuid().toString()));
+  if (!shm.create(sizeof(SandboxShared))) {
+    qCritical("Failed to create plugin sandbox shared memory: %s",
+              shm.errorString().toLatin1().constData());
+    return false;
+  }
+
+  shared = new (shm.data()) SandboxShared;
+  shared->version = SANDBOX_VERSION;
+  shared->state.store(SANDBOX_STARTING);
+  shared->numInputs = 0;
+  shared->numOutputs = 0;
+  memset(shared->name, 0, sizeof(shared->name));
+  shared->sampleRate.store(44100);
+  shared->mains.store(0);
+  shared->editorRequests.store(0);
+  shared->heartbeat.store(0);
+  shared->shutdown.store(0);
+  shared->tempo.store(120);
+  shared->requestSeq.store(0);
+  shared->responseSeq.store(0);
+  shared->ns = 0;
+  shared->numEvents = 0;
+
+  nin = 0;
+  nout = 0;
+  requestSeq = 0;
+  unloading = false;
+  hostDead.store(0);
+  host.setProcessChannelMode(QProcess::ForwardedChannels);
+  host.start(QCoreApplication::applicationFilePath(),
+             QStringList() << "--plugin-host" << shm.key() << filename);
+
+  /* The host reports whether the plugin loaded */
+  QElapsedTimer startup;
+  startup.start();
+  while (shared->state.loadAcquire() == SANDBOX_STARTING &&
+         !startup.hasExpired(STARTUP_TIMEOUT_MS)) {
+    if (host.state() == QProcess::NotRunning || host.waitForFinished(10)) {
+      break;
+    }
+  }
+
+  if (shared->state.loadAcquire() != SANDBOX_READY) {
+    qCritical("Plugin sandbox failed to load %s",
+              filename.toLocal8Bit().constData());
+    unload();
+    return false;
+  }
+
+  /* A bad host could report more channels than the shared memory has */
+  nin = qBound(0, shared->numInputs, (int)SANDBOX_MAX_CHANNELS);
+  nout = qBound(0, shared->numOutputs, (int)SANDBOX_MAX_CHANNELS);
+  name = QString::fromUtf8(shared->name,
+                           qstrnlen(shared->name, sizeof(shared->name)));
+  qDebug("Plugin sandbox loaded %s with %d inputs and %d outputs",
+         name.toUtf8().constData(), nin, nout);
+  return true;
+}
+
+void SandboxPlugin::unload()
+{
+  if (!shared) {
+    return;
+  }
+
+  unloading = true;
+  shared->shutdown.storeRelease(1);
+  sandboxWake(&shared->requestSeq);
+  if (host.state() != QProcess::NotRunning && !host.waitForFinished(1000)) {
+    host.kill();
+    host.waitForFinished(1000);
+  }
+
+  shared->~SandboxShared();
+  shared = NULL;
+  nin = 0;
+  nout = 0;
+  unloading = false;
+  shm.detach();
+}
+
+QString SandboxPlugin::getName() const
+{
+  return name;
+}
+
+/* The editor opens in the host process */
+void SandboxPlugin::openEditor(QWidget *parent)
+{
+  Q_UNUSED(parent);
+
+  if (shared) {
+    shared->editorRequests.fetchAndAddRelease(1);
+  }
+}
+
+void SandboxPlugin::closeEditor()
+{
+}
+
+void SandboxPlugin::queueResizeEditor(int width, int height)
+{
+  Q_UNUSED(width);
+  Q_UNUSED(height);
+}
+
+void SandboxPlugin::queueIdle()
+{
+}
+
+/* MIDI output stays in the host process */
+void SandboxPlugin::outputEvents(VstEvents *vstEvents)
+{
+  Q_UNUSED(vstEvents);
+}
+
+int SandboxPlugin::numInputs() const
+{
+  return nin;
+}
+
+int SandboxPlugin::numOutputs() const
+{
+  return nout;
+}
+
+void SandboxPlugin::setSampleRate(int rate)
+{
+  if (shared) {
+    shared->sampleRate.storeRelease(rate);
+  }
+}
+
+void SandboxPlugin::setTempo(int tempo)
+{
+  if (shared) {
+    shared->tempo.storeRelease(tempo);
+  }
+}
+
+void SandboxPlugin::changeMains(bool enable)
+{
+  if (shared) {
+    shared->mains.storeRelease(enable);
+  }
+}
+
+/* Events go out with the next block, the host clears them once delivered */
+void SandboxPlugin::processEvents(VstEvents *vstEvents)
+{
+  if (!shared ||
+      shared->responseSeq.loadAcquire() != requestSeq) {
+    return; /* the host still owns the request */
+  }
+
+  int n = 0;
+  for (int i = 0; i < vstEvents->numEvents && n < SANDBOX_MAX_EVENTS; i++) {
+    VstMidiEvent *event = (VstMidiEvent*)vstEvents->events[i];
+    if (event->type != kVstMidiType) {
+      continue;
+    }
+
+    shared->events[n].deltaFrames = event->deltaFrames;
+    memcpy(shared->events[n].data, event->midiData,
+           sizeof(shared->events[n].data));
+    n++;
+  }
+  shared->numEvents = n;
+}
+
+void SandboxPlugin::passThrough(float **inbuf, float **outbuf, int ns)
+{
+  for (int i = 0; i < nout; i++) {
+    if (i < nin) {
+      memcpy(outbuf[i], inbuf[i], sizeof(float) * ns);
+    } else {
+      memset(outbuf[i], 0, sizeof(float) * ns);
+    }
+  }
+}
+
+void SandboxPlugin::process(float **inbuf, float **outbuf, int ns)
+{
+  if (!shared || hostDead.loadAcquire() || ns > SANDBOX_MAX_BLOCK) {
+    passThrough(inbuf, outbuf, ns);
+    return;
+  }
+
+  /* The budget is what the rest of the callback leaves, so several sandboxed
+   * plugins in a chain don't each wait for a share of the whole period
+   */
+  qint64 start = timer.nsecsElapsed();
+  qint64 budgetNs = timeLeftNs;
+
+  /* A block that missed its budget may still be in the host, don't touch
+   * the buffers until it is done
+   */
+  unsigned int seq = requestSeq;
+  if (budgetNs <= 0 || shared->responseSeq.loadAcquire() != seq) {
+    misses.fetchAndAddRelaxed(1);
+    passThrough(inbuf, outbuf, ns);
+    return;
+  }
+
+  for (int i = 0; i < nin; i++) {
+    memcpy(shared->inputs[i], inbuf[i], sizeof(float) * ns);
+  }
+  shared->ns = ns;
+  requestSeq = seq + 1;
+  shared->requestSeq.storeRelease(requestSeq);
+  sandboxWake(&shared->requestSeq);
+
+  /* Spin briefly since a quick plugin is often done before a sleep would be
+   * worth it
+   */
+  bool done = false;
+  for (;;) {
+    done = shared->responseSeq.loadAcquire() == seq + 1;
+    qint64 elapsed = timer.nsecsElapsed() - start;
+    if (done || elapsed >= budgetNs) {
+      break;
+    }
+    if (elapsed >= SPIN_NS) {
+      sandboxWait(&shared->responseSeq, seq, budgetNs - elapsed);
+    }
+  }
+
+  if (!done) {
+    misses.fetchAndAddRelaxed(1);
+    passThrough(inbuf, outbuf, ns);
+    return;
+  }
+
+  for (int i = 0; i < nout; i++) {
+    memcpy(outbuf[i], shared->outputs[i], sizeof(float) * ns);
+  }
+
+  qint64 elapsed = timer.nsecsElapsed() - start;
+  blocks.fetchAndAddRelaxed(1);
+  totalNs.fetchAndAddRelaxed(elapsed);
+  if (elapsed > maxNs.load()) {
+    maxNs.store(elapsed);
+  }
+}
+
+SandboxPlugin::Stats SandboxPlugin::takeStats()
+{
+  Stats stats;
+  stats.blocks = blocks.fetchAndStoreRelaxed(0);
+  stats.misses = misses.fetchAndStoreRelaxed(0);
+  stats.totalNs = totalNs.fetchAndStoreRelaxed(0);
+  stats.maxNs = maxNs.fetchAndStoreRelaxed(0);
+  return stats;
+}
+
+void SandboxPlugin::idle()
+{
+  if (!shared) {
+    return;
+  }
+
+  shared->heartbeat.fetchAndAddRelease(1);
+
+  if (statsTimer.hasExpired(STATS_INTERVAL_MS)) {
+    statsTimer.restart();
+
+    Stats stats = takeStats();
+    if (stats.misses > 0) {
+      qWarning("Plugin sandbox %s missed %u of %u blocks, "
+               "round trip avg %lld us max %lld us",
+               name.toUtf8().constData(), stats.misses,
+               stats.blocks + stats.misses,
+               stats.blocks ? stats.totalNs / stats.blocks / 1000 : 0,
+               stats.maxNs / 1000);
+    }
+  }
+}
+
+void SandboxPlugin::hostFinished()
+{
+  if (!shared || unloading) {
+    return;
+  }
+
+  qCritical("Plugin sandbox for %s exited unexpectedly, passing audio "
+            "through", name.toUtf8().constData());
+  hostDead.storeRelease(1);
+}
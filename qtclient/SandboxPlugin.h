@@ -0,0 +1,118 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _SANDBOXPLUGIN_H_
+#define _SANDBOXPLUGIN_H_
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QProcess>
+#include <QSharedMemory>
+#include "EffectPlugin.h"
+#include "SandboxShared.h"
+
+/* A VST plugin running in a separate host process
+ *
+ * A plugin that crashes or hangs only takes down its host process instead of
+ * the jam session.  Audio goes through shared memory, see SandboxShared.  The
+ * audio thread waits for the host for at most the time left in the callback,
+ * see EffectPlugin::setTimeLeft().  When the host misses that budget, or has
+ * died, the block is passed through dry and the session carries on.
+ *
+ * The host is this program started with --plugin-host, see
+ * sandboxHostMain().  The filename "dummy" loads a pass-through plugin in the
+ * host, which --plugin-host-benchmark uses to measure the round trip.
+ */
+class SandboxPlugin : public EffectPlugin
+{
+  Q_OBJECT
+
+public:
+  SandboxPlugin(const QString &filename);
+  ~SandboxPlugin();
+
+  bool load();
+  void unload();
+
+  QString getName() const;
+
+  void openEditor(QWidget *parent);
+  void closeEditor();
+  void queueResizeEditor(int width, int height);
+  void queueIdle();
+  void outputEvents(VstEvents *vstEvents);
+
+  int numInputs() const;
+  int numOutputs() const;
+  void setSampleRate(int rate);
+  void setTempo(int tempo);
+  void changeMains(bool enable);
+  void processEvents(VstEvents *vstEvents);
+  void process(float **inbuf, float **outbuf, int ns);
+
+  /* Round trip statistics, reset on each call */
+  struct Stats {
+    unsigned int blocks;
+    unsigned int misses; /* passed through because the host was late */
+    qint64 totalNs;
+    qint64 maxNs;
+  };
+  Stats takeStats();
+
+public slots:
+  void idle();
+
+private slots:
+  void hostFinished();
+
+private:
+  enum {
+    SPIN_NS = 20000, /* before sleeping, the host is often done by then */
+    STARTUP_TIMEOUT_MS = 10000,
+    STATS_INTERVAL_MS = 10000,
+  };
+
+  QString filename;
+  QString name;
+  QSharedMemory shm;
+  SandboxShared *shared;
+  /* The host can write the shared memory, so apart from the sequence numbers
+   * and state the client keeps its own copy of everything it reads back
+   */
+  int nin;
+  int nout;
+  unsigned int requestSeq; /* last block sent, audio thread only */
+  bool unloading;
+  QProcess host;
+  QAtomicInteger<int> hostDead;
+  QElapsedTimer timer;
+  QElapsedTimer statsTimer;
+
+  /* Statistics, written by the audio thread */
+  QAtomicInteger<unsigned int> blocks;
+  QAtomicInteger<unsigned int> misses;
+  QAtomicInteger<qint64> totalNs;
+  QAtomicInteger<qint64> maxNs;
+
+  void passThrough(float **inbuf, float **outbuf, int ns);
+};
+
+int sandboxHostMain(const QStringList &args);
+int sandboxBenchmarkMain();
+
+#endif /* _SANDBOXPLUGIN_H_ */
@@ -0,0 +1,116 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _SANDBOXSHARED_H_
+#define _SANDBOXSHARED_H_
+
+#include <QtGlobal>
+#include <QAtomicInteger>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Shared memory between SandboxPlugin and the plugin host process
+ *
+ * Linux only: the audio thread sleeps on the sequence numbers with futexes.
+ * Other platforms have no timed wait on shared memory with better than
+ * scheduler tick resolution, so the sandbox is not offered there.
+ *
+ * The client owns the memory and the host attaches to it.  Audio is passed
+ * one block at a time: the client fills in the inputs and bumps requestSeq,
+ * the host processes the block and sets responseSeq to the same value.
+ * Neither side locks, each side only writes the fields it owns, and the
+ * sequence numbers hand the audio buffers back and forth.
+ *
+ * Parameters changed from the client GUI thread are plain values that the
+ * host picks up before the next block or on its idle timer.
+ */
+enum {
+  SANDBOX_VERSION = 1,
+  SANDBOX_MAX_CHANNELS = 8,  /* plugin inputs or outputs */
+  SANDBOX_MAX_BLOCK = 4096,  /* frames, see NJClient::SetBlockSize() */
+  SANDBOX_MAX_EVENTS = 128,
+  SANDBOX_NAME_SIZE = 128,
+  SANDBOX_HEARTBEAT_TIMEOUT_MS = 5000, /* host exits without the client */
+};
+
+enum SandboxState {
+  SANDBOX_STARTING,
+  SANDBOX_READY,
+  SANDBOX_FAILED, /* the plugin could not be loaded */
+};
+
+struct SandboxMidiEvent {
+  int deltaFrames;
+  char data[4];
+};
+
+struct SandboxShared {
+  int version;
+
+  /* Written by the host before it becomes ready */
+  QAtomicInteger<int> state;
+  int numInputs;
+  int numOutputs;
+  char name[SANDBOX_NAME_SIZE];
+
+  /* Written by the client GUI thread */
+  QAtomicInteger<int> sampleRate;
+  QAtomicInteger<int> mains;
+  QAtomicInteger<unsigned int> editorRequests;
+  QAtomicInteger<unsigned int> heartbeat;
+  QAtomicInteger<int> shutdown;
+
+  /* Written by the client audio thread */
+  QAtomicInteger<int> tempo;
+  QAtomicInteger<unsigned int> requestSeq; /* futex word */
+  int ns;
+  int numEvents;
+  SandboxMidiEvent events[SANDBOX_MAX_EVENTS];
+  float inputs[SANDBOX_MAX_CHANNELS][SANDBOX_MAX_BLOCK];
+
+  /* Written by the host audio thread */
+  QAtomicInteger<unsigned int> responseSeq; /* futex word */
+  float outputs[SANDBOX_MAX_CHANNELS][SANDBOX_MAX_BLOCK];
+};
+
+Q_STATIC_ASSERT(sizeof(QAtomicInteger<unsigned int>) == sizeof(int));
+
+/* Wakes the other process if it waits on word */
+static inline void sandboxWake(QAtomicInteger<unsigned int> *word)
+{
+  /* Not FUTEX_PRIVATE_FLAG, the word is shared between processes */
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE, 1,
+          NULL, NULL, 0);
+}
+
+/* Waits while *word is val, for at most timeoutNs.  May return early so
+ * callers check again.
+ */
+static inline void sandboxWait(QAtomicInteger<unsigned int> *word,
+                               unsigned int val, qint64 timeoutNs)
+{
+  struct timespec ts;
+  ts.tv_sec = timeoutNs / 1000000000;
+  ts.tv_nsec = timeoutNs % 1000000000;
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT, val,
+          &ts, NULL, 0);
+}
+
+#endif /* _SANDBOXSHARED_H_ */
@@ -0,0 +1,149 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <math.h>
+#include <QVector>
+
+#include "common/opusencdec.h"
+#include "common/flacencdec.h"
+#include "TestCodecs.h"
+
+/* Interleaved stereo sine waves, a different pitch on each channel */
+static QVector<float> makeInput(int srate, int frames)
+{
+  QVector<float> samples(frames * 2);
+  for (int i = 0; i < frames; i++) {
+    samples[i * 2] = 0.5f * sinf(2 * M_PI * 440.0 * i / srate);
+    samples[i * 2 + 1] = 0.25f * sinf(2 * M_PI * 660.0 * i / srate);
+  }
+  return samples;
+}
+
+/* Encode one interval in uneven chunks like the audio thread does */
+static void encode(I_NJEncoder *enc, QVector<float> &samples)
+{
+  int frames = samples.size() / 2;
+  for (int pos = 0; pos < frames; pos += 1000) {
+    enc->Encode(samples.data() + pos * 2, qMin(1000, frames - pos), 2, 1);
+  }
+  enc->Encode(NULL, 0);
+}
+
+/* Returns interleaved stereo, the decoder's ring buffer is drained as it fills */
+static QVector<float> decode(I_NJDecoder *dec, WDL_Queue *stream)
+{
+  QVector<float> samples;
+  const char *data = (const char *)stream->Get();
+  int len = stream->Available();
+  bool ended = false;
+
+  dec->DecodeSetMaxReadLength(1024, 48000);
+  for (int pos = 0;;) {
+    if (pos < len) {
+      int n = qMin(4096, len - pos);
+      memcpy(dec->DecodeGetSrcBuffer(n), data + pos, n);
+      dec->DecodeWrote(n);
+      pos += n;
+    } else if (!ended) {
+      dec->DecodeEnd();
+      ended = true;
+    } else {
+      dec->DecodeWrote(0);
+    }
+
+    int avail = dec->DecodeGetAvailable();
+    while (dec->DecodeGetAvailable() > 0) {
+      float *bufs[NJ_DECODER_MAX_CHANNELS];
+      int n = dec->DecodePeek(bufs);
+      for (int i = 0; i < n; i++) {
+        samples.append(bufs[0][i]);
+        samples.append(bufs[dec->GetNumChannels() > 1 ? 1 : 0][i]);
+      }
+      dec->DecodeAdvance(n);
+    }
+    if (ended && avail == 0) {
+      break;
+    }
+  }
+  return samples;
+}
+
+static double rms(const QVector<float> &samples, int channel)
+{
+  double sum = 0;
+  for (int i = channel; i < samples.size(); i += 2) {
+    sum += samples[i] * samples[i];
+  }
+  return sqrt(sum / (samples.size() / 2));
+}
+
+void TestCodecs::opusRoundTrip()
+{
+  QVector<float> input = makeInput(48000, 48000 + 123);
+  OggOpusEncoder enc(48000, 2, 128, 0);
+  QVERIFY(!enc.isError());
+  encode(&enc, input);
+
+  OggOpusDecoder dec;
+  QVector<float> output = decode(&dec, &enc.outqueue);
+  QCOMPARE(dec.GetNumChannels(), 2);
+
+  /* Pre-skip and the final granule position trim the stream exactly */
+  QCOMPARE(output.size(), input.size());
+
+  /* Lossy, but the level of each channel survives */
+  for (int c = 0; c < 2; c++) {
+    QVERIFY(qAbs(rms(output, c) - rms(input, c)) < 0.1 * rms(input, c));
+  }
+}
+
+void TestCodecs::opusRoundTripResampled()
+{
+  int frames = 44100 + 123;
+  QVector<float> input = makeInput(44100, frames);
+  OggOpusEncoder enc(44100, 2, 128, 0);
+  QVERIFY(!enc.isError());
+  encode(&enc, input);
+
+  OggOpusDecoder dec;
+  QVector<float> output = decode(&dec, &enc.outqueue);
+  QCOMPARE(dec.GetSampleRate(), 48000);
+  QCOMPARE(output.size() / 2, (frames * 48000 + 44099) / 44100);
+
+  for (int c = 0; c < 2; c++) {
+    QVERIFY(qAbs(rms(output, c) - rms(input, c)) < 0.1 * rms(input, c));
+  }
+}
+
+void TestCodecs::flacRoundTrip()
+{
+  QVector<float> input = makeInput(44100, 44100 + 123);
+  FlacEncoder enc(44100, 2);
+  QVERIFY(!enc.isError());
+  encode(&enc, input);
+
+  FlacDecoder dec;
+  QVector<float> output = decode(&dec, &enc.outqueue);
+  QCOMPARE(dec.GetSampleRate(), 44100);
+  QCOMPARE(output.size(), input.size());
+
+  /* Lossless apart from quantizing to FLAC_ENC_BITS_PER_SAMPLE */
+  for (int i = 0; i < input.size(); i++) {
+    QVERIFY(qAbs(output[i] - input[i]) < 1e-6f);
+  }
+}
@@ -0,0 +1,72 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "common/mpb.h"
+#include "TestMpb.h"
+
+void TestMpb::uploadIntervalVariants()
+{
+  mpb_client_upload_interval_variants out;
+  out.chidx = 3;
+  out.num_variants = MAX_INTERVAL_VARIANTS;
+  for (int i = 0; i < MAX_INTERVAL_VARIANTS; i++) {
+    memset(out.guids[i], 0x10 + i, sizeof(out.guids[i]));
+    out.bitrates[i] = 256 >> i;
+  }
+  out.bitrates[0] = 0x1234; /* both bytes matter */
+
+  Net_Message *msg = out.build();
+  QVERIFY(msg != NULL);
+  QCOMPARE(msg->get_type(), MESSAGE_CLIENT_UPLOAD_INTERVAL_VARIANTS);
+  QCOMPARE(msg->get_size(), 1 + 18 * MAX_INTERVAL_VARIANTS);
+
+  mpb_client_upload_interval_variants in;
+  QCOMPARE(in.parse(msg), 0);
+  delete msg;
+
+  QCOMPARE(in.chidx, 3);
+  QCOMPARE(in.num_variants, MAX_INTERVAL_VARIANTS);
+  for (int i = 0; i < MAX_INTERVAL_VARIANTS; i++) {
+    QVERIFY(memcmp(in.guids[i], out.guids[i], sizeof(in.guids[i])) == 0);
+    QCOMPARE(in.bitrates[i], out.bitrates[i]);
+  }
+}
+
+void TestMpb::uploadIntervalVariantsLimits()
+{
+  mpb_client_upload_interval_variants out;
+  out.num_variants = 0;
+  QVERIFY(out.build() == NULL);
+  out.num_variants = MAX_INTERVAL_VARIANTS + 1;
+  QVERIFY(out.build() == NULL);
+
+  mpb_client_upload_interval_variants in;
+  Net_Message msg;
+
+  msg.set_type(MESSAGE_CLIENT_UPLOAD_INTERVAL_BEGIN);
+  msg.set_size(1 + 18);
+  QVERIFY(in.parse(&msg) < 0); /* wrong message type */
+
+  msg.set_type(MESSAGE_CLIENT_UPLOAD_INTERVAL_VARIANTS);
+  msg.set_size(1 + 18 - 1);
+  QVERIFY(in.parse(&msg) > 0); /* truncated variant */
+
+  msg.set_size(1 + 18 * (MAX_INTERVAL_VARIANTS + 1));
+  memset(msg.get_data(), 0, msg.get_size());
+  QVERIFY(in.parse(&msg) > 0); /* too many variants */
+}
@@ -0,0 +1,32 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _TESTMPB_H_
+#define _TESTMPB_H_
+
+#include <QtTest/QtTest>
+
+class TestMpb : public QObject
+{
+  Q_OBJECT
+private slots:
+  void uploadIntervalVariants();
+  void uploadIntervalVariantsLimits();
+};
+
+#endif /* _TESTMPB_H_ */
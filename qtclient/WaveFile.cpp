@@ -0,0 +1,126 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+#include <QByteArray>
+#include <QFile>
+#include <QtEndian>
+
+#include "WaveFile.h"
+
+enum {
+  MAX_FILE_SIZE = 16 * 1024 * 1024, /* much longer than any click */
+  FORMAT_PCM = 1,
+  FORMAT_FLOAT = 3,
+  FORMAT_EXTENSIBLE = 0xfffe, /* the real format is in the sub-format */
+};
+
+/* Returns one sample in [-1.0, 1.0] */
+static float readSample(const uchar *p, int format, int bits)
+{
+  if (format == FORMAT_FLOAT) {
+    quint32 u = qFromLittleEndian<quint32>(p);
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+  }
+
+  switch (bits) {
+  case 8:
+    return (p[0] - 128) / 128.0f; /* unsigned */
+  case 16:
+    return qFromLittleEndian<qint16>(p) / 32768.0f;
+  case 24:
+    return (qint32)((p[0] << 8) | (p[1] << 16) | ((quint32)p[2] << 24)) /
+           2147483648.0f;
+  default:
+    return qFromLittleEndian<qint32>(p) / 2147483648.0f;
+  }
+}
+
+bool readWaveFile(const QString &filename, QVector<float> *samples,
+                  int *sampleRate)
+{
+  QFile file(filename);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  if (file.size() > MAX_FILE_SIZE) {
+    return false;
+  }
+
+  QByteArray contents = file.readAll();
+  const uchar *data = reinterpret_cast<const uchar*>(contents.constData());
+  qint64 size = contents.size();
+
+  if (size < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4)) {
+    return false;
+  }
+
+  int format = 0, channels = 0, rate = 0, bits = 0;
+  const uchar *pcm = NULL;
+  qint64 pcmSize = 0;
+
+  /* Chunks are word aligned */
+  qint64 pos = 12;
+  while (pos + 8 <= size) {
+    const uchar *chunk = data + pos;
+    qint64 chunkSize = qFromLittleEndian<quint32>(chunk + 4);
+    const uchar *body = chunk + 8;
+    if (chunkSize > size - pos - 8) {
+      chunkSize = size - pos - 8; /* truncated file */
+    }
+
+    if (!memcmp(chunk, "fmt ", 4) && chunkSize >= 16) {
+      format = qFromLittleEndian<quint16>(body);
+      channels = qFromLittleEndian<quint16>(body + 2);
+      rate = qFromLittleEndian<quint32>(body + 4);
+      bits = qFromLittleEndian<quint16>(body + 14);
+      if (format == FORMAT_EXTENSIBLE && chunkSize >= 26) {
+        format = qFromLittleEndian<quint16>(body + 24);
+      }
+    } else if (!memcmp(chunk, "data", 4)) {
+      pcm = body;
+      pcmSize = chunkSize;
+    }
+
+    pos += 8 + chunkSize + (chunkSize & 1);
+  }
+
+  bool valid = (format == FORMAT_PCM &&
+                (bits == 8 || bits == 16 || bits == 24 || bits == 32)) ||
+               (format == FORMAT_FLOAT && bits == 32);
+  if (!valid || channels <= 0 || rate <= 0 || !pcm) {
+    return false;
+  }
+
+  int frameSize = channels * bits / 8;
+  int frames = pcmSize / frameSize;
+
+  samples->resize(frames);
+  for (int i = 0; i < frames; i++) {
+    const uchar *frame = pcm + (qint64)i * frameSize;
+    float sum = 0.0f;
+    for (int ch = 0; ch < channels; ch++) {
+      sum += readSample(frame + ch * bits / 8, format, bits);
+    }
+    (*samples)[i] = sum / channels;
+  }
+  *sampleRate = rate;
+  return true;
+}
@@ -27,6 +27,9 @@
 #include "PortAudioStreamer.h"
 #include "PortMidiStreamer.h"
 #include "MainWindow.h"
+#ifdef Q_OS_LINUX
+#include "SandboxPlugin.h"
+#endif
 
 QSettings *settings;
 QString logFilePath;
@@ -47,6 +50,17 @@ int main(int argc, char *argv[])
   QCoreApplication::setOrganizationDomain(ORGDOMAIN);
   QCoreApplication::setApplicationName(APPNAME);
 
+#ifdef Q_OS_LINUX
+  /* Plugin sandbox host process, see SandboxPlugin */
+  QStringList args = app.arguments();
+  if (args.value(1) == "--plugin-host") {
+    return sandboxHostMain(args);
+  }
+  if (args.value(1) == "--plugin-host-benchmark") {
+    return sandboxBenchmarkMain();
+  }
+#endif
+
   /* Instantiate QSettings now that application information has been set */
   QSettings appSettings;
   settings = &appSettings;
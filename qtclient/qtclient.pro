@@ -108,7 +108,7 @@ include(../common/libcommon.pri)
 
 QMAKE_CXXFLAGS += -Wno-write-strings
 CONFIG += link_pkgconfig
-PKGCONFIG += ogg vorbis vorbisenc portaudio-2.0
+PKGCONFIG += ogg vorbis vorbisenc opus flac portaudio-2.0
 
 # portmidi does not use pkg-config
 LIBS += -lportmidi
@@ -121,6 +121,15 @@ LIBS += -lqt5keychain
 	LIBS += -lporttime
 }
 
+# Audio thread real-time safety checker, see RTSafety.h
+rtsafety {
+	DEFINES += WAHJAM_RTSAFETY
+	linux {
+		LIBS += -ldl
+		QMAKE_LFLAGS += -rdynamic
+	}
+}
+
 win32 {
 	exists($${TARGET}.ico) {
 		RC_ICONS = $${TARGET}.ico
@@ -152,6 +161,7 @@ HEADERS += PortAudioSettingsPage.h
 HEADERS += PortMidiSettingsPage.h
 HEADERS += ServerBrowser.h
 HEADERS += MetronomeBar.h
+HEADERS += Metronome.h
 HEADERS += ChatOutput.h
 HEADERS += AddEffectPluginDialog.h
 HEADERS += EffectSettingsPage.h
@@ -165,6 +175,8 @@ HEADERS += NJClient.h
 HEADERS += NINJAMServerBrowser.h
 HEADERS += logging.h
 HEADERS += PortAudioStreamer.h
+HEADERS += AudioTelemetry.h
+HEADERS += DiagnosticsDialog.h
 HEADERS += EffectPlugin.h
 HEADERS += VSTPlugin.h
 mac:HEADERS += PmEventParser.h
@@ -172,8 +184,17 @@ mac:HEADERS += AudioUnitPlugin.h
 mac:HEADERS += createuiwidget.h
 HEADERS += EffectProcessor.h
 HEADERS += PortMidiStreamer.h
+HEADERS += Reclaimer.h
+HEADERS += EffectWorkers.h
+linux:HEADERS += SandboxShared.h
+linux:HEADERS += SandboxPlugin.h
+HEADERS += RTSafety.h
+HEADERS += RTSemaphore.h
+HEADERS += SPSCQueue.h
 HEADERS += screensleep.h
 HEADERS += UISettingsPage.h
+HEADERS += MetronomeSettingsPage.h
+HEADERS += WaveFile.h
 
 SOURCES += qtclient.cpp
 SOURCES += MainWindow.cpp
@@ -186,6 +207,7 @@ SOURCES += PortAudioSettingsPage.cpp
 SOURCES += PortMidiSettingsPage.cpp
 SOURCES += ServerBrowser.cpp
 SOURCES += MetronomeBar.cpp
+SOURCES += Metronome.cpp
 SOURCES += ChatOutput.cpp
 SOURCES += AddEffectPluginDialog.cpp
 SOURCES += EffectSettingsPage.cpp
@@ -198,6 +220,12 @@ SOURCES += NJClient.cpp
 SOURCES += NINJAMServerBrowser.cpp
 SOURCES += logging.cpp
 SOURCES += PortAudioStreamer.cpp
+SOURCES += Reclaimer.cpp
+SOURCES += EffectWorkers.cpp
+linux:SOURCES += SandboxPlugin.cpp
+linux:SOURCES += SandboxHost.cpp
+SOURCES += AudioTelemetry.cpp
+SOURCES += DiagnosticsDialog.cpp
 SOURCES += EffectPlugin.cpp
 SOURCES += VSTPlugin.cpp
 mac:SOURCES += PmEventParser.cpp
@@ -205,6 +233,8 @@ mac:SOURCES += AudioUnitPlugin.cpp
 mac:OBJECTIVE_SOURCES += createuiwidget.mm
 SOURCES += EffectProcessor.cpp
 SOURCES += PortMidiStreamer.cpp
+SOURCES += RTSafety.cpp
+SOURCES += RTSemaphore.cpp
 win32 {
 	SOURCES += screensleep_win32.cpp
 } else:mac {
@@ -213,3 +243,5 @@ win32 {
 	SOURCES += screensleep_stub.cpp
 }
 SOURCES += UISettingsPage.cpp
+SOURCES += MetronomeSettingsPage.cpp
+SOURCES += WaveFile.cpp
@@ -111,6 +111,9 @@ bool Server::setConfig(ServerConfig *config_)
   group->m_voting_threshold = config->votingThreshold;
   group->m_voting_timeout = config->votingTimeout;
   group->m_allow_hidden_users = config->allowHiddenUsers;
+  group->m_transcoder->setConfig(config->transcodeBitrate,
+                                 config->transcodeThreads,
+                                 config->transcodeCPU);
 
   /* Only set certain settings when not active */
   if (!listener.isListening()) {
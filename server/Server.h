@@ -76,6 +76,9 @@ struct ServerConfig
   int logSessionLen;
   int votingThreshold;
   int votingTimeout;
+  int transcodeBitrate;
+  int transcodeThreads;
+  int transcodeCPU; /* percent of one CPU */
   WDL_String logPath;
   WDL_String pidFilename;
   WDL_String logFilename;
@@ -0,0 +1,371 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+#include <QRunnable>
+#include <QUuid>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "../WDL/vorbisencdec.h"
+#include "../common/mpb.h"
+#include "usercon.h"
+#include "Transcoder.h"
+
+enum {
+  MIN_BLOCKSIZE = 2048,        /* bytes per write message */
+  MAX_BLOCKSIZE = 8192 + 1024,
+  MAX_BACKLOG = 256 * 1024,    /* input bytes before a stream is cut short */
+  MAX_STREAMS = 64,
+  LOAD_CHECK_MS = 1000,
+};
+
+TranscodeStream::TranscodeStream()
+  : ended(false), scheduled(false), dropped(false), finished(false),
+    bitrate(0), decoder(NULL), encoder(NULL)
+{
+  memset(guid, 0, sizeof(guid));
+}
+
+TranscodeStream::~TranscodeStream()
+{
+  delete decoder;
+  delete encoder;
+}
+
+/* CPU time used by the calling thread so far, so time spent waiting for the
+ * CPU while other processes run isn't charged to the budget
+ */
+static qint64 threadCpuNs()
+{
+#ifdef _WIN32
+  FILETIME creation, exited, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel, &user)) {
+    return 0;
+  }
+  /* In units of 100 ns */
+  return ((((qint64)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+          (((qint64)user.dwHighDateTime << 32) | user.dwLowDateTime)) * 100;
+#else
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return (qint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Processes whatever a stream has received so far on the thread pool */
+class TranscodeJob : public QRunnable
+{
+public:
+  TranscodeJob(Transcoder *transcoder_, TranscodeStream *stream_)
+    : transcoder(transcoder_), stream(stream_)
+  {
+  }
+
+  void run()
+  {
+    qint64 start = threadCpuNs();
+
+    transcoder->process(stream);
+
+    transcoder->busyNs.fetchAndAddRelaxed(threadCpuNs() - start);
+    QMetaObject::invokeMethod(transcoder, "deliverOutput",
+                              Qt::QueuedConnection);
+  }
+
+private:
+  Transcoder *transcoder;
+  TranscodeStream *stream;
+};
+
+Transcoder::Transcoder(User_Group *group_, QObject *parent)
+  : QObject(parent), group(group_), bitrate(0), cpuBudget(0), load(0),
+    busyNs(0)
+{
+  connect(&loadTimer, SIGNAL(timeout()), this, SLOT(updateLoad()));
+  loadTimer.start(LOAD_CHECK_MS);
+  loadElapsed.start();
+}
+
+Transcoder::~Transcoder()
+{
+  pool.waitForDone();
+
+  foreach (TranscodeStream *stream, streams) {
+    delete stream;
+  }
+  while (!output.isEmpty()) {
+    delete output.dequeue();
+  }
+}
+
+void Transcoder::setConfig(int bitrate_, int threads, int cpuBudget_)
+{
+  bitrate = bitrate_;
+  cpuBudget = cpuBudget_;
+  pool.setMaxThreadCount(threads > 0 ? threads : 1);
+}
+
+TranscodeStream *Transcoder::startStream()
+{
+  if (!isEnabled() || load >= cpuBudget || streams.size() >= MAX_STREAMS) {
+    return NULL;
+  }
+
+  TranscodeStream *stream = new TranscodeStream;
+  QByteArray guid = QUuid::createUuid().toRfc4122();
+  memcpy(stream->guid, guid.constData(), sizeof(stream->guid));
+  stream->bitrate = bitrate;
+  stream->decoder = new VorbisDecoder;
+  streams.append(stream);
+  return stream;
+}
+
+void Transcoder::write(TranscodeStream *stream, const void *data, int len)
+{
+  QMutexLocker locker(&stream->lock);
+
+  if (stream->dropped || len <= 0) {
+    return;
+  }
+
+  if (stream->input.Available() + len > MAX_BACKLOG) {
+    qWarning("Transcoding fell behind, cutting interval short");
+    stream->dropped = true;
+  } else {
+    stream->input.Add(data, len);
+  }
+
+  if (!stream->scheduled) {
+    schedule(stream);
+  }
+}
+
+void Transcoder::endStream(TranscodeStream *stream)
+{
+  bool done;
+  {
+    QMutexLocker locker(&stream->lock);
+
+    stream->ended = true;
+    done = stream->finished && !stream->scheduled;
+    if (!done && !stream->scheduled) {
+      schedule(stream);
+    }
+  }
+
+  /* Cut short streams may be finished already */
+  if (done) {
+    streams.removeOne(stream);
+    delete stream;
+  }
+}
+
+/* Call with stream->lock held */
+void Transcoder::schedule(TranscodeStream *stream)
+{
+  stream->scheduled = true;
+  pool.start(new TranscodeJob(this, stream));
+}
+
+/* Called from the thread pool */
+void Transcoder::process(TranscodeStream *stream)
+{
+  for (;;) {
+    bool end;
+    int len;
+
+    {
+      QMutexLocker locker(&stream->lock);
+
+      if (stream->dropped) {
+        stream->input.Clear();
+      }
+
+      len = stream->input.Available();
+      end = stream->ended || stream->dropped;
+      if (len == 0 && !end) {
+        stream->scheduled = false;
+        return;
+      }
+
+      if (len > 0) {
+        void *buf = stream->decoder->DecodeGetSrcBuffer(len);
+        memcpy(buf, stream->input.Get(), len);
+        stream->input.Advance(len);
+        stream->input.Compact();
+      }
+    }
+
+    if (len > 0) {
+      stream->decoder->DecodeWrote(len);
+      encodeDecoded(stream);
+    }
+
+    if (!end) {
+      queueWrites(stream, false);
+      continue;
+    }
+
+    if (stream->encoder) {
+      stream->encoder->Encode(NULL, 0);
+    }
+    queueWrites(stream, true);
+
+    QMutexLocker locker(&stream->lock);
+    stream->finished = true;
+    stream->scheduled = false;
+    return;
+  }
+}
+
+void Transcoder::encodeDecoded(TranscodeStream *stream)
+{
+  VorbisDecoder *decoder = stream->decoder;
+
+  while (decoder->DecodeGetAvailable() > 0) {
+    int nch = decoder->GetNumChannels() > 1 ? 2 : 1;
+    if (!stream->encoder) {
+      stream->encoder = new VorbisEncoder(decoder->GetSampleRate(), nch,
+                                          stream->bitrate, 0);
+    }
+
+    float *samples[NJ_DECODER_MAX_CHANNELS];
+    int n = decoder->DecodePeek(samples);
+    float *buf = stream->interleaved.Resize(n * nch, false);
+    for (int i = 0; i < n; i++) {
+      for (int c = 0; c < nch; c++) {
+        buf[i * nch + c] = samples[c][i];
+      }
+    }
+
+    stream->encoder->Encode(buf, n, nch, 1);
+    decoder->DecodeAdvance(n);
+    decoder->DecodeWrote(0); /* decode what didn't fit before */
+  }
+}
+
+/* Queues what has been encoded as interval write messages.  With finish set
+ * everything left goes out and the last write ends the upload, even if nothing
+ * could be decoded.
+ */
+void Transcoder::queueWrites(TranscodeStream *stream, bool finish)
+{
+  WDL_Queue *q = stream->encoder ? &stream->encoder->outqueue : NULL;
+
+  do {
+    int len = q ? q->Available() : 0;
+    if (!finish && len < MIN_BLOCKSIZE) {
+      break;
+    }
+    if (len > MAX_BLOCKSIZE) {
+      len = MAX_BLOCKSIZE;
+    }
+
+    mpb_server_download_interval_write wh;
+    memcpy(wh.guid, stream->guid, sizeof(wh.guid));
+    wh.audio_data = len ? q->Get() : NULL;
+    wh.audio_data_len = len;
+    if (q) {
+      q->Advance(len);
+    }
+    wh.flags = finish && (!q || q->Available() <= 0) ? 1 : 0;
+
+    Net_Message *msg = wh.build();
+    QMutexLocker locker(&outputLock);
+    output.enqueue(msg);
+  } while (q && q->Available() > 0);
+
+  if (q) {
+    q->Compact();
+  }
+}
+
+void Transcoder::deliverOutput()
+{
+  for (;;) {
+    Net_Message *msg;
+    {
+      QMutexLocker locker(&outputLock);
+      if (output.isEmpty()) {
+        break;
+      }
+      msg = output.dequeue();
+    }
+
+    mpb_server_download_interval_write wh;
+    if (!wh.parse(msg)) {
+      group->RelayIntervalWrite(msg, wh.guid, wh.audio_data_len,
+                                wh.flags & 1, NULL);
+    }
+    delete msg;
+  }
+
+  for (int i = 0; i < streams.size(); i++) {
+    TranscodeStream *stream = streams.at(i);
+    bool done;
+    {
+      QMutexLocker locker(&stream->lock);
+      done = stream->ended && stream->finished && !stream->scheduled;
+    }
+    if (done) {
+      streams.removeAt(i--);
+      delete stream;
+    }
+  }
+}
+
+void Transcoder::updateLoad()
+{
+  qint64 elapsedNs = loadElapsed.nsecsElapsed();
+  loadElapsed.restart();
+
+  qint64 ns = busyNs.fetchAndStoreRelaxed(0);
+  if (elapsedNs > 0) {
+    load = load * 0.5 + ns * 100.0 / elapsedNs * 0.5;
+  }
+
+  if (load <= cpuBudget) {
+    return;
+  }
+
+  /* Refusing new streams takes until running intervals end, so shed the most
+   * recent stream each check until the load is back within budget
+   */
+  for (int i = streams.size() - 1; i >= 0; i--) {
+    TranscodeStream *stream = streams.at(i);
+    QMutexLocker locker(&stream->lock);
+
+    if (stream->dropped || stream->ended) {
+      continue;
+    }
+
+    qWarning("Transcoding over CPU budget (%.0f%% of %d%%), cutting interval "
+             "short", load, cpuBudget);
+    stream->dropped = true;
+    if (!stream->scheduled) {
+      schedule(stream); /* end it for the listeners now */
+    }
+    break;
+  }
+}
@@ -0,0 +1,126 @@
+/*
+    Copyright (C) 2020 Stefan Hajnoczi <stefanha@jammr.net>
+
+    Wahjam is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Wahjam is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Wahjam; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _TRANSCODER_H_
+#define _TRANSCODER_H_
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QQueue>
+#include <QThreadPool>
+#include <QTimer>
+
+#include "../WDL/heapbuf.h"
+#include "../WDL/queue.h"
+#include "../common/netmsg.h"
+
+class VorbisDecoder;
+class VorbisEncoder;
+class User_Group;
+
+/* One upload being re-encoded, see Transcoder */
+class TranscodeStream
+{
+public:
+  TranscodeStream();
+  ~TranscodeStream();
+
+  unsigned char guid[16]; /* of the low bitrate upload */
+
+private:
+  friend class Transcoder;
+
+  /* Shared between the event loop and transcode jobs */
+  QMutex lock;
+  WDL_Queue input;
+  bool ended;     /* no more input will be written */
+  bool scheduled; /* a job has been started and has not returned yet */
+  bool dropped;   /* fell too far behind, the rest of the input is ignored */
+  bool finished;  /* the last write has been queued */
+
+  /* Only used by the transcode job */
+  int bitrate;
+  VorbisDecoder *decoder;
+  VorbisEncoder *encoder;
+  WDL_TypedBuf<float> interleaved;
+};
+
+/* Re-encodes Vorbis uploads at a low bitrate for users whose connection
+ * can't keep up with the original
+ *
+ * Upload data is handed over as it arrives and jobs on a thread pool decode
+ * and re-encode it.  Finished interval write messages are relayed to the
+ * users receiving the low bitrate upload from the event loop.
+ *
+ * The CPU budget is checked against the CPU time the jobs use, measured per
+ * thread.  New streams are refused while over budget and the most recent
+ * running stream is cut short on each load check until it is back within
+ * budget.  A stream whose input backs up is cut short too, so transcoding
+ * can't hold up relaying or other servers on the same machine.
+ */
+class Transcoder : public QObject
+{
+  Q_OBJECT
+
+public:
+  Transcoder(User_Group *group, QObject *parent = 0);
+  ~Transcoder();
+
+  /* bitrate is in kbps, 0 disables transcoding.  cpuBudget is in percent of
+   * one CPU.
+   */
+  void setConfig(int bitrate, int threads, int cpuBudget);
+  bool isEnabled() const { return bitrate > 0; }
+
+  /* Returns NULL if over budget */
+  TranscodeStream *startStream();
+  void write(TranscodeStream *stream, const void *data, int len);
+
+  /* No more input, the stream is deleted once it has been relayed */
+  void endStream(TranscodeStream *stream);
+
+private slots:
+  void deliverOutput();
+  void updateLoad();
+
+private:
+  friend class TranscodeJob;
+
+  User_Group *group;
+  QThreadPool pool;
+  int bitrate;
+  int cpuBudget;
+  double load; /* smoothed, in percent of one CPU */
+  QTimer loadTimer;
+  QElapsedTimer loadElapsed;
+  QAtomicInteger<qint64> busyNs; /* thread CPU time used by jobs */
+  QList<TranscodeStream *> streams;
+
+  QMutex outputLock; /* protects output */
+  QQueue<Net_Message *> output;
+
+  void schedule(TranscodeStream *stream);
+  void process(TranscodeStream *stream);
+  void encodeDecoded(TranscodeStream *stream);
+  void queueWrites(TranscodeStream *stream, bool finish);
+};
+
+#endif /* _TRANSCODER_H_ */
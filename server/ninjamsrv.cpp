@@ -283,6 +283,13 @@ static int ConfigOnToken(ServerConfig *config, LineParser *lp)
     }
     config->keepAlive = p;
   }
+  else if (token == QString("Transcode").toLower())
+  {
+    if (lp->getnumtokens() < 2 || lp->getnumtokens() > 4) return -1;
+    config->transcodeBitrate = lp->gettoken_int(1);
+    if (lp->getnumtokens() > 2) config->transcodeThreads = lp->gettoken_int(2);
+    if (lp->getnumtokens() > 3) config->transcodeCPU = lp->gettoken_int(3);
+  }
   else if (token == QString("SetVotingThreshold").toLower())
   {
     if (lp->getnumtokens() != 2) return -1;
@@ -470,6 +477,9 @@ static int ReadConfig(ServerConfig *config, char *configfile)
   config->logSessionLen = 10; // ten minute default, tho the user will need to specify the path anyway
   config->votingThreshold = 110;
   config->votingTimeout = 120;
+  config->transcodeBitrate = 0; // disabled
+  config->transcodeThreads = 1;
+  config->transcodeCPU = 50;
   config->logPath.Set("");
   config->pidFilename.Set("");
   config->logFilename.Set("");
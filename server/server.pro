@@ -16,6 +16,9 @@ QT += network
 
 include(../common/libcommon.pri)
 
+CONFIG += link_pkgconfig
+PKGCONFIG += ogg vorbis vorbisenc
+
 # Build console application
 win32:CONFIG += console
 
@@ -30,6 +33,9 @@ HEADERS += usercon.h \
            logging.h \
            JammrUserLookup.h \
            ninjamsrv.h \
+           Transcoder.h \
+           ../common/njcodec.h \
+           ../WDL/vorbisencdec.h \
            ../WDL/queue.h \
            ../WDL/heapbuf.h \
            ../WDL/string.h \
@@ -39,4 +45,5 @@ SOURCES += ninjamsrv.cpp \
            logging.cpp \
            usercon.cpp \
            Server.cpp \
+           Transcoder.cpp \
            JammrUserLookup.cpp
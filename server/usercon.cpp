@@ -46,6 +46,8 @@
 #include "common/mpb.h"
 #include "common/UserPrivs.h"
 #include "common/njmisc.h"
+#include "common/njcodec.h"
+#include "Transcoder.h"
 
 #ifdef _WIN32
 #define strncasecmp strnicmp
@@ -100,8 +102,35 @@ static void type_to_string(unsigned int t, char *out)
 
 #define TRANSFER_TIMEOUT 8
 
+// how often to check whether a user's connection keeps up with what we send
+#define SEND_CHECK_MS 1000
+#define SEND_MIN_STEP 0.5 // cuts per check, lower variants are already encoded
+#define SEND_MAX_STEP 0.9
+
+// users getting less than this share of full quality get transcoded uploads
+#define TRANSCODE_CONSTRAINED_PCT 75
+
+// ends the upload's transcode, if any, along with it
+static void deleteRecvTransfer(User_Group *group, User_TransferState *t)
+{
+  if (t->transcode) group->m_transcoder->endStream(t->transcode);
+  delete t;
+}
+
+static User_TransferState *findTransfer(WDL_PtrList<User_TransferState> *list, const unsigned char *guid)
+{
+  int x;
+  for (x = 0; x < list->GetSize(); x ++)
+  {
+    User_TransferState *t=list->Get(x);
+    if (!memcmp(t->guid,guid,sizeof(t->guid))) return t;
+  }
+  return NULL;
+}
+
 User_Connection::User_Connection(QTcpSocket *sock, User_Group *grp) : group(grp), m_netcon(sock), m_auth_state(0), m_clientcaps(0), m_auth_privs(0), m_reserved(0), m_max_channels(0),
-      m_vote_bpm(0), m_vote_bpm_lasttime(0), m_vote_bpi(0), m_vote_bpi_lasttime(0)
+      m_vote_bpm(0), m_vote_bpm_lasttime(0), m_vote_bpi(0), m_vote_bpi_lasttime(0), m_send_pct(100),
+      m_send_rate(0,SEND_MIN_STEP,SEND_MAX_STEP)
 {
   name = QString("%1:%2").arg(sock->peerAddress().toString()).arg(sock->peerPort());
   qDebug("%s: Connected", name.toLatin1().constData());
@@ -134,7 +163,7 @@ User_Connection::User_Connection(QTcpSocket *sock, User_Group *grp) : group(grp)
 
   if (ka < 0)ka=0;
   else if (ka > 255) ka=255;
-  ch.server_caps=ka<<8;
+  ch.server_caps=(ka<<8)|SERVER_CAP_SIMULCAST;
 
   if (grp->m_licensetext.Get()[0])
   {
@@ -153,6 +182,10 @@ User_Connection::User_Connection(QTcpSocket *sock, User_Group *grp) : group(grp)
           this, SLOT(authenticationTimeout()));
   authenticationTimer.setSingleShot(true);
   authenticationTimer.start(120 * 1000 /* milliseconds */);
+
+  connect(&sendRateTimer, SIGNAL(timeout()),
+          this, SLOT(updateSendRate()));
+  sendRateTimer.start(SEND_CHECK_MS);
 }
 
 void User_Connection::Send(Net_Message *msg, bool deleteAfterSend)
@@ -190,11 +223,14 @@ User_Connection::~User_Connection()
     delete m_sublist.Get(x);
   m_sublist.Empty();
   for (x = 0; x < m_recvfiles.GetSize(); x ++)
-    delete m_recvfiles.Get(x);
+    deleteRecvTransfer(group,m_recvfiles.Get(x));
   m_recvfiles.Empty();
   for (x = 0; x < m_sendfiles.GetSize(); x ++)
     delete m_sendfiles.Get(x);
   m_sendfiles.Empty();
+  for (x = 0; x < m_simulcasts.GetSize(); x ++)
+    delete m_simulcasts.Get(x);
+  m_simulcasts.Empty();
 
   delete m_lookup;
   m_lookup=0;
@@ -616,10 +652,32 @@ void User_Connection::processMessage(Net_Message *msg)
 
           static unsigned char zero_guid[16];
 
+          // is this one of several variants of the interval? A guid listed
+          // as a variant never goes out as an ordinary upload.
+          User_Simulcast *sc=NULL;
+          int scidx=-1;
+          {
+            int x;
+            for (x = 0; x < m_simulcasts.GetSize() && !sc; x ++)
+            {
+              User_Simulcast *s=m_simulcasts.Get(x);
+              int v;
+              for (v = 0; v < s->num_variants && !sc; v ++)
+              {
+                if (!memcmp(s->guids[v],mp.guid,sizeof(mp.guid)))
+                {
+                  sc=s;
+                  scidx=v;
+                }
+              }
+            }
+          }
 
-          if (mp.fourcc && memcmp(mp.guid,zero_guid,sizeof(zero_guid))) // zero = silence, so simply rebroadcast
+          // only the best variant is archived
+          User_TransferState *newrecv=NULL;
+          if (mp.fourcc && memcmp(mp.guid,zero_guid,sizeof(zero_guid)) && scidx <= 0) // zero = silence, so simply rebroadcast
           {
-            User_TransferState *newrecv=new User_TransferState;
+            newrecv=new User_TransferState;
             newrecv->bytes_estimated=mp.estsize;
             newrecv->fourcc=mp.fourcc;
             memcpy(newrecv->guid,mp.guid,sizeof(newrecv->guid));
@@ -651,6 +709,10 @@ void User_Connection::processMessage(Net_Message *msg)
             m_recvfiles.Add(newrecv);
           }
 
+          // clients that upload variants already cover slow users
+          bool can_transcode=newrecv && !sc && mp.fourcc == NJ_VORBIS_FOURCC &&
+                             group->m_transcoder->isEnabled();
+          Net_Message *transcodemsg=NULL;
 
           int user;
           for (user=0;user<group->m_users.GetSize(); user++)
@@ -664,8 +726,33 @@ void User_Connection::processMessage(Net_Message *msg)
                 User_SubscribeMask *sm=u->m_sublist.Get(i);
                 if (!strcasecmp(sm->username.Get(),myusername))
                 {
-                  if (sm->channelmask & (1<<mp.chidx))
+                  if (sc)
+                  {
+                    // selectVariants() already picked what this user gets,
+                    // users who subscribed since then get the best variant
+                    int sel;
+                    for (sel = 0; sel < sc->num_variants && !findTransfer(&u->m_sendfiles,sc->guids[sel]); sel ++);
+
+                    User_TransferState *nt=NULL;
+                    if (sel == scidx) nt=findTransfer(&u->m_sendfiles,mp.guid);
+                    else if (sel == sc->num_variants && !scidx && (sm->channelmask & (1<<mp.chidx)))
+                    {
+                      nt=new User_TransferState;
+                      memcpy(nt->guid,mp.guid,sizeof(nt->guid));
+                      u->m_sendfiles.Add(nt);
+                    }
+
+                    if (nt)
+                    {
+                      time(&nt->last_acttime);
+                      nt->bytes_estimated = mp.estsize;
+                      nt->fourcc = mp.fourcc;
+                      u->Send(newmsg, false);
+                    }
+                  }
+                  else if (sm->channelmask & (1<<mp.chidx))
                   {
+                    Net_Message *sendmsg=newmsg;
                     if (memcmp(mp.guid,zero_guid,sizeof(zero_guid))) // zero = silence, so simply rebroadcast
                     {
                       // add entry in send list
@@ -673,10 +760,38 @@ void User_Connection::processMessage(Net_Message *msg)
                       memcpy(nt->guid,mp.guid,sizeof(nt->guid));
                       nt->bytes_estimated = mp.estsize;
                       nt->fourcc = mp.fourcc;
+
+                      // users whose connection can't keep up get the low
+                      // bitrate transcode, started by the first of them
+                      if (can_transcode && u->m_send_pct < TRANSCODE_CONSTRAINED_PCT)
+                      {
+                        if (!newrecv->transcode)
+                        {
+                          newrecv->transcode=group->m_transcoder->startStream();
+                          can_transcode=newrecv->transcode != NULL;
+                        }
+                        if (newrecv->transcode)
+                        {
+                          if (!transcodemsg)
+                          {
+                            mpb_server_download_interval_begin tmb;
+                            tmb.chidx=mp.chidx;
+                            tmb.estsize=0;
+                            tmb.fourcc=NJ_VORBIS_FOURCC;
+                            memcpy(tmb.guid,newrecv->transcode->guid,sizeof(tmb.guid));
+                            tmb.username = myusername;
+                            transcodemsg=tmb.build();
+                          }
+                          memcpy(nt->guid,newrecv->transcode->guid,sizeof(nt->guid));
+                          nt->bytes_estimated = 0;
+                          sendmsg=transcodemsg;
+                        }
+                      }
+
                       u->m_sendfiles.Add(nt);
                     }
 
-                    u->Send(newmsg, false);
+                    u->Send(sendmsg, false);
                   }
                   break;
                 }
@@ -684,10 +799,41 @@ void User_Connection::processMessage(Net_Message *msg)
             }
           }
           delete newmsg;
+          delete transcodemsg;
         }
       }
       //m_recvfiles
     break;
+    case MESSAGE_CLIENT_UPLOAD_INTERVAL_VARIANTS:
+      {
+        mpb_client_upload_interval_variants mp;
+        if (!mp.parse(msg) && mp.chidx < m_max_channels)
+        {
+          // records go when their main upload ends, so the oldest one has
+          // been abandoned by now
+          if (m_simulcasts.GetSize() >= MAX_UPLOADS)
+          {
+            qWarning("%s: too many interval variant records, dropping the oldest",
+                     name.toLatin1().constData());
+            delete m_simulcasts.Get(0);
+            m_simulcasts.Delete(0);
+          }
+
+          User_Simulcast *sc=new User_Simulcast;
+          sc->chidx=mp.chidx;
+          sc->num_variants=mp.num_variants;
+          int v;
+          for (v = 0; v < mp.num_variants; v ++)
+          {
+            memcpy(sc->guids[v],mp.guids[v],sizeof(sc->guids[v]));
+            sc->bitrates[v]=mp.bitrates[v];
+          }
+          m_simulcasts.Add(sc);
+
+          selectVariants(sc);
+        }
+      }
+    break;
     case MESSAGE_CLIENT_UPLOAD_INTERVAL_WRITE:
       {
         mpb_client_upload_interval_write mp;
@@ -698,7 +844,7 @@ void User_Connection::processMessage(Net_Message *msg)
           msg->set_type(MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE); // we rely on the fact that the upload/download write messages are identical
                                                                  // though we may need to update this at a later date if we change things.
 
-          int user,x;
+          int x;
 
 
           for (x = 0; x < m_recvfiles.GetSize(); x ++)
@@ -709,53 +855,26 @@ void User_Connection::processMessage(Net_Message *msg)
               t->last_acttime=now;
 
               if (t->fp) fwrite(mp.audio_data,1,mp.audio_data_len,t->fp);
+              if (t->transcode) group->m_transcoder->write(t->transcode,mp.audio_data,mp.audio_data_len);
 
               t->bytes_sofar+=mp.audio_data_len;
               if (mp.flags & 1)
               {
-                delete t;
+                endSimulcast(t->guid);
+                deleteRecvTransfer(group,t);
                 m_recvfiles.Delete(x);
               }
               break;
             }
             if (now-t->last_acttime > TRANSFER_TIMEOUT)
             {
-              delete t;
+              endSimulcast(t->guid);
+              deleteRecvTransfer(group,t);
               m_recvfiles.Delete(x--);
             }
           }
 
-
-          for (user=0;user<group->m_users.GetSize(); user++)
-          {
-            User_Connection *u=group->m_users.Get(user);
-            if (u && u != this)
-            {
-              int i;
-              for (i=0; i < u->m_sendfiles.GetSize(); i ++)
-              {
-                User_TransferState *t=u->m_sendfiles.Get(i);
-                if (t && !memcmp(t->guid,mp.guid,sizeof(t->guid)))
-                {
-                  t->last_acttime=now;
-                  t->bytes_sofar += mp.audio_data_len;
-                  u->Send(msg, false);
-                  if (mp.flags & 1)
-                  {
-                    delete t;
-                    u->m_sendfiles.Delete(i);
-                    // remove from transfer list
-                  }
-                  break;
-                }
-                if (now-t->last_acttime > TRANSFER_TIMEOUT)
-                {
-                  delete t;
-                  u->m_sendfiles.Delete(i--);
-                }
-              }
-            }
-          }
+          group->RelayIntervalWrite(msg,mp.guid,mp.audio_data_len,mp.flags & 1,this);
         }
       }
     break;
@@ -775,6 +894,73 @@ void User_Connection::processMessage(Net_Message *msg)
   }
 }
 
+// Forgets the variants of the interval whose main upload was guid, once it
+// has ended all of their begin messages have come in
+void User_Connection::endSimulcast(const unsigned char *guid)
+{
+  int x;
+  for (x = 0; x < m_simulcasts.GetSize(); x ++)
+  {
+    User_Simulcast *sc=m_simulcasts.Get(x);
+    if (!memcmp(sc->guids[0],guid,sizeof(sc->guids[0])))
+    {
+      delete sc;
+      m_simulcasts.Delete(x);
+      return;
+    }
+  }
+}
+
+// Picks the variant each subscriber gets, the best one that fits the share of
+// full quality its connection has been keeping up with
+void User_Connection::selectVariants(User_Simulcast *sc)
+{
+  char *myusername=m_username.Get();
+  int user;
+  for (user=0;user<group->m_users.GetSize(); user++)
+  {
+    User_Connection *u=group->m_users.Get(user);
+    if (!u || u == this) continue;
+
+    int i;
+    for (i=0; i < u->m_sublist.GetSize(); i ++)
+    {
+      User_SubscribeMask *sm=u->m_sublist.Get(i);
+      if (!strcasecmp(sm->username.Get(),myusername))
+      {
+        if (sm->channelmask & (1<<sc->chidx))
+        {
+          int budget=sc->bitrates[0]*u->m_send_pct/100;
+          int v;
+          for (v = 0; v < sc->num_variants-1 && sc->bitrates[v] > budget; v ++);
+
+          // fourcc and size are filled in by the begin message
+          User_TransferState *nt=new User_TransferState;
+          memcpy(nt->guid,sc->guids[v],sizeof(nt->guid));
+          u->m_sendfiles.Add(nt);
+        }
+        break;
+      }
+    }
+  }
+}
+
+// Lowers the share of full quality variants when the connection can't send
+// what it is given in time, and raises it again slowly once the backlog is
+// gone, see Net_SendRateEstimator. Takes effect from the next interval, see
+// selectVariants().
+void User_Connection::updateSendRate()
+{
+  int pct=m_send_rate.Update(&m_netcon,m_send_pct);
+  if (pct != m_send_pct)
+  {
+    qDebug("%s: send backlog %lld bytes, drain %.0f bytes/s, variants up to %d%%",
+           name.toLatin1().constData(), (long long)m_send_rate.GetBacklog(),
+           m_send_rate.GetDrainRate(), pct);
+    m_send_pct=pct;
+  }
+}
+
 void User_Connection::netconMessagesReady()
 {
   while (m_netcon.hasMessagesAvailable()) {
@@ -811,6 +997,8 @@ User_Group::User_Group(CreateUserLookupFn *CreateUserLookup_, QObject *parent)
     m_voting_timeout(120), m_allow_hidden_users(0), m_logfp(0),
     protocol(JAM_PROTO_NINJAM), m_loopcnt(0)
 {
+  m_transcoder = new Transcoder(this, this);
+
   connect(&intervalTimer, SIGNAL(timeout()),
           this, SLOT(intervalExpired()));
 }
@@ -896,6 +1084,44 @@ JamProtocol User_Group::GetProtocol() const
   return protocol;
 }
 
+void User_Group::RelayIntervalWrite(Net_Message *msg, const unsigned char *guid, int len, bool end, User_Connection *src)
+{
+  time_t now;
+  time(&now);
+
+  int user;
+  for (user=0;user<m_users.GetSize(); user++)
+  {
+    User_Connection *u=m_users.Get(user);
+    if (u && u != src)
+    {
+      int i;
+      for (i=0; i < u->m_sendfiles.GetSize(); i ++)
+      {
+        User_TransferState *t=u->m_sendfiles.Get(i);
+        if (t && !memcmp(t->guid,guid,sizeof(t->guid)))
+        {
+          t->last_acttime=now;
+          t->bytes_sofar += len;
+          u->Send(msg, false);
+          if (end)
+          {
+            delete t;
+            u->m_sendfiles.Delete(i);
+            // remove from transfer list
+          }
+          break;
+        }
+        if (now-t->last_acttime > TRANSFER_TIMEOUT)
+        {
+          delete t;
+          u->m_sendfiles.Delete(i--);
+        }
+      }
+    }
+  }
+}
+
 void User_Group::Broadcast(Net_Message *msg, User_Connection *nosend)
 {
   if (msg)
@@ -79,6 +79,8 @@ signals:
 typedef IUserInfoLookup *CreateUserLookupFn(char *username);
 
 class User_Connection;
+class Transcoder;
+class TranscodeStream;
 
 class User_Group : public QObject
 {
@@ -106,6 +108,10 @@ class User_Group : public QObject
     // sends a message to the people subscribing to a channel of a user
     void BroadcastToSubs(Net_Message *msg, User_Connection *src, int channel);
 
+    // sends an interval write to the users receiving that upload, src is the
+    // uploader and is skipped
+    void RelayIntervalWrite(Net_Message *msg, const unsigned char *guid, int len, bool end, User_Connection *src);
+
     void onChatMessage(User_Connection *con, mpb_chat_message *msg);
 
     int numAuthenticatedUsers();
@@ -130,6 +136,8 @@ class User_Group : public QObject
     WDL_String m_logdir;
     FILE *m_logfp;
 
+    Transcoder *m_transcoder;
+
   private slots:
     void userConDisconnected(User_Connection *p);
     void intervalExpired();
@@ -167,7 +175,7 @@ public:
 class User_TransferState
 {
 public:
-  User_TransferState() : fourcc(0), bytes_estimated(0), bytes_sofar(0), fp(0)
+  User_TransferState() : fourcc(0), bytes_estimated(0), bytes_sofar(0), fp(0), transcode(0)
   { 
     time(&last_acttime);
     memset(guid,0,sizeof(guid));
@@ -186,6 +194,26 @@ public:
   unsigned int bytes_sofar;
   
   FILE *fp;
+  TranscodeStream *transcode; // low bitrate copy for slow users, see Transcoder
+};
+
+
+// uploads of one interval at different bitrates, best first, until the main
+// (best) upload ends. The client sends every begin message before that.
+class User_Simulcast
+{
+public:
+  User_Simulcast() : chidx(0), num_variants(0)
+  {
+    memset(guids,0,sizeof(guids));
+    memset(bitrates,0,sizeof(bitrates));
+  }
+  ~User_Simulcast() { }
+
+  int chidx;
+  int num_variants;
+  unsigned char guids[MAX_INTERVAL_VARIANTS][16];
+  int bitrates[MAX_INTERVAL_VARIANTS];
 };
 
 
@@ -235,6 +263,10 @@ class User_Connection : public QObject
 
     WDL_PtrList<User_TransferState> m_recvfiles;
     WDL_PtrList<User_TransferState> m_sendfiles;
+    WDL_PtrList<User_Simulcast> m_simulcasts;
+
+    // percentage of full quality variants this connection keeps up with
+    int m_send_pct;
 
     IUserInfoLookup *m_lookup;
 
@@ -246,9 +278,15 @@ class User_Connection : public QObject
     void netconMessagesReady();
     void authenticationTimeout();
     void userLookupCompleted();
+    void updateSendRate();
 
   private:
+    QTimer sendRateTimer;
+    Net_SendRateEstimator m_send_rate;
+
     void processMessage(Net_Message *msg);
+    void endSimulcast(const unsigned char *guid);
+    void selectVariants(User_Simulcast *sc);
 };
 
 